@@ -0,0 +1,203 @@
+// Bulk IN throughput of the proxy's data path against a simulated device:
+// the in_stream of device-libusb.cpp reads from the mock libusb device of
+// mock-libusb.cpp straight into ep_queue slots, and a writer thread sends
+// them on the way ep_loop_write() does, with Raw Gadget's copy of each
+// MAX_TRANSFER_SIZE chunk standing in for usb_raw_ep_write().
+//
+//	./bench/bench-bulk [--transfer_size=N] [--in_transfers=N] [--mb=N]
+//			   [--rate=MB/s] [--short_every=N]
+//
+// Without --transfer_size it runs a sweep over the sizes --transfer_size
+// accepts in the proxy.
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <thread>
+#include <time.h>
+
+#include "host-raw-gadget.h"
+#include "device-libusb.h"
+#include "ep-queue.h"
+#include "mock-libusb.h"
+
+int verbose_level = 0;
+volatile bool please_stop_eps = false;
+bool reset_device_before_proxy = false;
+
+#define BENCH_MAXP	512
+
+static uint64_t bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct bench_run {
+	struct ep_queue		*queue;
+	int			transfer_size;
+	uint64_t		total;
+	std::atomic<bool>	done;
+	uint64_t		written;
+	uint64_t		writes;
+	uint64_t		zlps;
+};
+
+// ep_loop_read() for a bulk IN endpoint: keep in_transfers reads in
+// flight, each into a slot of its own, and publish them in order.
+static void bench_read(struct bench_run *run) {
+	struct in_stream *stream = in_stream_create(0x81, USB_ENDPOINT_XFER_BULK,
+				run->transfer_size, in_transfers);
+
+	while (mock_device_bytes < run->total) {
+		while (stream->in_flight < stream->num_transfers) {
+			int slot = ep_queue_acquire(run->queue);
+			if (slot < 0)
+				break;
+			struct usb_raw_transfer_io *io = ep_queue_slot(run->queue, slot);
+			if (in_stream_submit(stream, (uint8_t *)io->data, slot) != LIBUSB_SUCCESS) {
+				ep_queue_cancel(run->queue, slot);
+				break;
+			}
+		}
+		if (stream->in_flight == 0) {
+			std::this_thread::yield();
+			continue;
+		}
+
+		int slot, nbytes;
+		int rv = in_stream_next(stream, &slot, &nbytes, IN_STREAM_POLL_TIMEOUT);
+		if (rv == LIBUSB_ERROR_TIMEOUT)
+			continue;
+		if (rv != LIBUSB_SUCCESS) {
+			ep_queue_cancel(run->queue, slot);
+			continue;
+		}
+
+		// As ep_publish_in(): a short transfer of whole packets was
+		// ended by a ZLP.
+		struct usb_raw_transfer_io *io = ep_queue_slot(run->queue, slot);
+		io->inner.ep = 1;
+		io->inner.length = nbytes;
+		io->inner.flags = 0;
+		if (nbytes > 0 && nbytes < run->transfer_size && nbytes % BENCH_MAXP == 0)
+			io->inner.flags = USB_RAW_IO_FLAGS_ZERO;
+		ep_queue_publish(run->queue, slot);
+	}
+
+	run->done.store(true);
+	ep_queue_wake(run->queue);
+
+	// Reads still in flight are cancelled; their slots are never
+	// published.
+	in_stream_destroy(stream);
+}
+
+// ep_loop_write() for an IN endpoint, each chunk copied out once.
+static void bench_write(struct bench_run *run) {
+	static char sink[MAX_TRANSFER_SIZE];
+	uint32_t chunk = (MAX_TRANSFER_SIZE / BENCH_MAXP) * BENCH_MAXP;
+
+	while (true) {
+		struct usb_raw_transfer_io *io = ep_queue_front(run->queue);
+		if (!io) {
+			if (run->done.load() && ep_queue_size(run->queue) == 0)
+				break;
+			ep_queue_wait(run->queue);
+			continue;
+		}
+
+		for (uint32_t offset = 0; offset < io->inner.length; offset += chunk) {
+			uint32_t length = std::min(chunk, io->inner.length - offset);
+			memcpy(sink, io->data + offset, length);
+			run->writes++;
+		}
+		if (io->inner.flags & USB_RAW_IO_FLAGS_ZERO)
+			run->zlps++;
+		run->written += io->inner.length;
+		ep_queue_pop_front(run->queue);
+	}
+}
+
+static void bench_run(int transfer_size, uint64_t total) {
+	struct bench_run run;
+	run.queue = ep_queue_create(EP_QUEUE_CAPACITY, in_transfers,
+				std::max(transfer_size, MAX_TRANSFER_SIZE));
+	run.transfer_size = transfer_size;
+	run.total = total;
+	run.done.store(false);
+	run.written = 0;
+	run.writes = 0;
+	run.zlps = 0;
+	mock_device_bytes = 0;
+	mock_device_transfers = 0;
+
+	uint64_t start = bench_now();
+	std::thread writer(bench_write, &run);
+	std::thread reader(bench_read, &run);
+	reader.join();
+	writer.join();
+	double seconds = (bench_now() - start) / 1e9;
+
+	printf("%8d %6d %10.1f %12.0f %10.0f %8" PRIu64 " %10" PRIu64 "\n",
+		transfer_size, in_transfers, run.written / seconds / (1024 * 1024),
+		mock_device_transfers / seconds, run.writes / seconds, run.zlps,
+		ep_queue_overflows(run.queue));
+	ep_queue_destroy(run.queue);
+}
+
+int main(int argc, char **argv) {
+	static const struct option options[] = {
+		{"transfer_size", required_argument, NULL, 's'},
+		{"in_transfers", required_argument, NULL, 't'},
+		{"mb", required_argument, NULL, 'm'},
+		{"rate", required_argument, NULL, 'r'},
+		{"short_every", required_argument, NULL, 'z'},
+		{NULL, 0, NULL, 0},
+	};
+	int transfer_size = 0;
+	uint64_t mb = 1024;
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			transfer_size = atoi(optarg);
+			break;
+		case 't':
+			in_transfers = std::min(std::max(atoi(optarg), 1), IN_STREAM_MAX_TRANSFERS);
+			break;
+		case 'm':
+			mb = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			mock_device_rate = strtoull(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		case 'z':
+			mock_device_short_every = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [--transfer_size=N] [--in_transfers=N] [--mb=N] "
+				"[--rate=MB/s] [--short_every=N]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (transfer_size < 0 || transfer_size > MAX_BULK_TRANSFER_SIZE ||
+	    transfer_size % BENCH_MAXP) {
+		fprintf(stderr, "--transfer_size must be a multiple of %d up to %d\n",
+			BENCH_MAXP, MAX_BULK_TRANSFER_SIZE);
+		return 1;
+	}
+	mock_device_packet_size = BENCH_MAXP;
+
+	printf("%8s %6s %10s %12s %10s %8s %10s\n", "size", "flight", "MB/s",
+		"transfers/s", "writes/s", "zlps", "overflows");
+	if (transfer_size) {
+		bench_run(transfer_size, mb << 20);
+		return 0;
+	}
+	static const int sizes[] = { 512, 4096, 16384, 65536 };
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		bench_run(sizes[i], mb << 20);
+	return 0;
+}
@@ -0,0 +1,150 @@
+// Filter programs: filter_run() over mouse reports and bulk packets, for
+// a few programs of the kind endpoint rules carry.
+//
+//	./bench/bench-filter [--ms=N]
+//
+// Each program runs for --ms milliseconds (default 500) over the same 256
+// packets, in place; the table gives ns per packet and how many of them
+// the program accepted.
+
+#include <algorithm>
+#include <getopt.h>
+#include <random>
+#include <time.h>
+
+#include "filter.h"
+
+struct bench_program {
+	const char			*name;
+	int				size;
+	std::vector<const char *>	insns;
+};
+
+static uint64_t bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Logitech reports: X at 3 and Y at 5, little-endian. One in four has no
+// motion.
+static std::vector<std::vector<uint8_t>> bench_packets(int size) {
+	std::mt19937 rng(size);
+	std::vector<std::vector<uint8_t>> packets;
+	for (int i = 0; i < 256; i++) {
+		std::vector<uint8_t> packet(size);
+		for (int j = 0; j < size; j++)
+			packet[j] = rng();
+		if (size >= 7 && i % 4 == 0)
+			memset(&packet[3], 0, 4);
+		packets.push_back(packet);
+	}
+	return packets;
+}
+
+static void bench_run(const struct bench_program *program, uint64_t duration) {
+	Json::Value insns;
+	for (size_t i = 0; i < program->insns.size(); i++)
+		insns.append(program->insns[i]);
+	struct filter filter;
+	if (!filter_compile(insns, &filter)) {
+		printf("%-10s does not compile\n", program->name);
+		return;
+	}
+
+	std::vector<std::vector<uint8_t>> packets = bench_packets(program->size);
+	uint64_t accepted = 0, runs = 0;
+	uint64_t start = bench_now(), now;
+	do {
+		for (size_t i = 0; i < packets.size(); i++)
+			accepted += filter_run(&filter, packets[i].data(), packets[i].size());
+		runs += packets.size();
+		now = bench_now();
+	} while (now - start < duration);
+
+	printf("%-10s %6d %6zu %10.1f %9.1f%%\n", program->name, program->size,
+		program->insns.size(), (double)(now - start) / runs,
+		100.0 * accepted / runs);
+}
+
+int main(int argc, char **argv) {
+	static const struct option options[] = {
+		{"ms", required_argument, NULL, 'm'},
+		{NULL, 0, NULL, 0},
+	};
+	uint64_t duration = 500 * 1000000ULL;
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+		switch (opt) {
+		case 'm':
+			duration = strtoull(optarg, NULL, 10) * 1000000;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [--ms=N]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	// The longest program the verifier accepts, all of it run.
+	std::vector<const char *> longest(FILTER_MAX_INSNS - 2, "add #1");
+	longest.push_back("st M[0]");
+	longest.push_back("accept");
+
+	std::vector<struct bench_program> programs = {
+		{ "accept", 9, { "accept" } },
+		// The README's example: drop reports without motion.
+		{ "idle", 9, {
+			"ldsh [3]",
+			"jne #0, keep",
+			"ldsh [5]",
+			"jne #0, keep",
+			"drop",
+			"keep: accept",
+		} },
+		// Invert X and double Y.
+		{ "rewrite", 9, {
+			"ldsh [3]",
+			"neg",
+			"sth [3]",
+			"ldsh [5]",
+			"mul #2",
+			"sth [5]",
+			"accept",
+		} },
+		// At most one report every 8 ms.
+		{ "ratelimit", 9, {
+			"ld now",
+			"ldx M[1]",
+			"sub x",
+			"jlt #8, skip",
+			"ld now",
+			"st M[1]",
+			"accept",
+			"skip: drop",
+		} },
+		// Drop a packet that repeats the one before it.
+		{ "dedupe", 9, {
+			"ldx M[0]",
+			"ld hash",
+			"jeq x, same",
+			"st M[0]",
+			"accept",
+			"same: drop",
+		} },
+		{ "dedupe", 512, {
+			"ldx M[0]",
+			"ld hash",
+			"jeq x, same",
+			"st M[0]",
+			"accept",
+			"same: drop",
+		} },
+		{ "longest", 9, longest },
+	};
+
+	printf("%-10s %6s %6s %10s %10s\n", "program", "size", "insns", "ns", "accepted");
+	for (size_t i = 0; i < programs.size(); i++)
+		bench_run(&programs[i], duration);
+	return 0;
+}
@@ -0,0 +1,316 @@
+// Endpoint injection rules: injection_apply() and its Aho-Corasick matcher
+// against a copy of the linear scan the proxy used before, which tried
+// each rule's patterns in turn with std::string::find().
+//
+//	./bench/bench-injection [--check] [--ms=N]
+//
+// First checks that both engines rewrite payloads the same way and exits
+// with status 1 if they do not. Then, unless --check is given, times both
+// on the same random rules and payloads, each for --ms milliseconds
+// (default 500), and prints ns per packet.
+
+#include <algorithm>
+#include <cinttypes>
+#include <fcntl.h>
+#include <getopt.h>
+#include <random>
+#include <time.h>
+#include <unistd.h>
+
+#include "device-libusb.h"
+#include "injection.h"
+#include "misc.h"
+
+std::string injection_file;
+struct libusb_device_descriptor device_device_desc;
+struct libusb_config_descriptor **device_config_desc;
+
+#define BENCH_EP_ADDRESS	0x81
+#define BENCH_CAPACITY		1023
+
+// The rules of the linear engine, as injection_compile() gets them.
+static Json::Value bench_config(const std::vector<std::vector<std::string>> &patterns,
+			const std::vector<std::string> &replacements) {
+	Json::Value config;
+	for (size_t i = 0; i < patterns.size(); i++) {
+		Json::Value rule;
+		rule["enable"] = true;
+		rule["ep_address"] = 81;
+		for (size_t j = 0; j < patterns[i].size(); j++)
+			rule["content_pattern"].append(patterns[i][j]);
+		rule["replacement"] = replacements[i];
+		config["bulk"].append(rule);
+	}
+	return config;
+}
+
+// The engine before the matchers, for one endpoint.
+static bool linear_apply(const Json::Value &config, char *data, uint32_t *length) {
+	const Json::Value &list = config["bulk"];
+	for (unsigned int i = 0; i < list.size(); i++) {
+		const Json::Value &rule = list[i];
+		if (rule["enable"].asBool() != true ||
+		    hexToDecimal(rule["ep_address"].asInt()) != BENCH_EP_ADDRESS)
+			continue;
+
+		std::string buffer(data, *length);
+		std::string replacement = hexToAscii(rule["replacement"].asString());
+		const Json::Value &patterns = rule["content_pattern"];
+		bool modified = false;
+		for (unsigned int j = 0; j < patterns.size(); j++) {
+			std::string pattern = hexToAscii(patterns[j].asString());
+			std::string::size_type pos = buffer.find(pattern);
+			while (pos != std::string::npos) {
+				if (buffer.length() - pattern.length() + replacement.length() > BENCH_CAPACITY)
+					break;
+				buffer.replace(pos, pattern.length(), replacement);
+				modified = true;
+				pos = buffer.find(pattern);
+			}
+		}
+		if (modified) {
+			memcpy(data, buffer.data(), buffer.length());
+			*length = buffer.length();
+			return true;
+		}
+	}
+	return false;
+}
+
+static struct injection_rules *bench_compile(const Json::Value &config,
+			const struct injection_matcher **matcher) {
+	struct usb_endpoint_descriptor ep;
+	memset(&ep, 0, sizeof(ep));
+	ep.bEndpointAddress = BENCH_EP_ADDRESS;
+	ep.bmAttributes = USB_ENDPOINT_XFER_BULK;
+
+	struct injection_rules *rules = injection_compile(config);
+	*matcher = injection_endpoint_matcher(rules, &ep);
+	return rules;
+}
+
+// The "\x41\x42" form rules give their bytes in.
+static std::string bench_hex(const std::string &bytes) {
+	static const char digits[] = "0123456789abcdef";
+	std::string hex;
+	for (size_t i = 0; i < bytes.length(); i++) {
+		hex += "\\x";
+		hex += digits[(uint8_t)bytes[i] >> 4];
+		hex += digits[(uint8_t)bytes[i] & 0xf];
+	}
+	return hex;
+}
+
+// Runs one payload through both engines; returns false if they differ.
+static bool check_payload(const Json::Value &config,
+			const struct injection_matcher *matcher,
+			const std::string &payload, const char *expected) {
+	char linear[BENCH_CAPACITY], compiled[BENCH_CAPACITY];
+	uint32_t linear_length = payload.length(), compiled_length = payload.length();
+	memcpy(linear, payload.data(), payload.length());
+	memcpy(compiled, payload.data(), payload.length());
+
+	bool linear_modified = linear_apply(config, linear, &linear_length);
+	bool compiled_modified = injection_apply(matcher, compiled, &compiled_length,
+					BENCH_CAPACITY);
+	std::string linear_result(linear, linear_length);
+	std::string compiled_result(compiled, compiled_length);
+
+	if (linear_modified != compiled_modified || linear_result != compiled_result ||
+	    (expected && compiled_result != expected)) {
+		fprintf(stderr, "Mismatch on %s: linear %s, compiled %s",
+			payload.c_str(), linear_result.c_str(), compiled_result.c_str());
+		if (expected)
+			fprintf(stderr, ", expected %s", expected);
+		fprintf(stderr, "\n");
+		return false;
+	}
+	return true;
+}
+
+// A later rule's match must not use up bytes that a match of the winning
+// rule overlaps: with "BC" before "AB", "ABC" becomes "Axx".
+static bool check_overlap() {
+	Json::Value config = bench_config({{bench_hex("BC")}, {bench_hex("AB")}},
+				{bench_hex("xx"), bench_hex("yy")});
+	const struct injection_matcher *matcher;
+	struct injection_rules *rules = bench_compile(config, &matcher);
+
+	bool ok = check_payload(config, matcher, "ABC", "Axx") &&
+		check_payload(config, matcher, "ABCABC", "AxxAxx") &&
+		check_payload(config, matcher, "ABAB", "yyyy") &&
+		check_payload(config, matcher, "CAB", "Cyy");
+	injection_free(rules);
+	return ok;
+}
+
+// Random rules of one pattern each over ABCD, replaced by bytes from xyz
+// so that a replacement never forms a new match: the linear engine then
+// rewrites the leftmost matches of the first matching rule, as
+// injection_apply() does.
+static bool check_random(int rounds) {
+	std::mt19937 rng(1);
+	auto text = [&](const char *alphabet, int min, int max) {
+		std::string s(std::uniform_int_distribution<int>(min, max)(rng), ' ');
+		for (size_t i = 0; i < s.length(); i++)
+			s[i] = alphabet[rng() % strlen(alphabet)];
+		return s;
+	};
+
+	for (int round = 0; round < rounds; round++) {
+		std::vector<std::vector<std::string>> patterns;
+		std::vector<std::string> replacements;
+		int num_rules = std::uniform_int_distribution<int>(1, 6)(rng);
+		for (int i = 0; i < num_rules; i++) {
+			patterns.push_back({bench_hex(text("ABCD", 2, 4))});
+			replacements.push_back(bench_hex(text("xyz", 1, 4)));
+		}
+		Json::Value config = bench_config(patterns, replacements);
+		const struct injection_matcher *matcher;
+		struct injection_rules *rules = bench_compile(config, &matcher);
+
+		bool ok = true;
+		for (int i = 0; i < 20 && ok; i++)
+			ok = check_payload(config, matcher, text("ABCD", 0, 48), NULL);
+		injection_free(rules);
+		if (!ok)
+			return false;
+	}
+	return true;
+}
+
+// Both engines print every replacement they make; that goes to /dev/null
+// while they run.
+static void bench_quiet(bool quiet) {
+	static int saved = -1;
+	fflush(stdout);
+	if (quiet) {
+		int null = open("/dev/null", O_WRONLY);
+		saved = dup(STDOUT_FILENO);
+		dup2(null, STDOUT_FILENO);
+		close(null);
+	} else {
+		dup2(saved, STDOUT_FILENO);
+		close(saved);
+	}
+}
+
+static uint64_t bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// num_rules rules of two random 4 to 8 byte patterns each, over payloads
+// of random bytes. One payload in 16 carries a pattern of a random rule.
+static void bench_run(int num_rules, int size, uint64_t duration) {
+	std::mt19937 rng(num_rules * 65536 + size);
+	auto bytes = [&](int length) {
+		std::string s(length, ' ');
+		for (int i = 0; i < length; i++)
+			s[i] = rng();
+		return s;
+	};
+
+	std::vector<std::vector<std::string>> patterns(num_rules);
+	std::vector<std::string> raw;
+	std::vector<std::string> replacements;
+	for (int i = 0; i < num_rules; i++) {
+		for (int j = 0; j < 2; j++) {
+			raw.push_back(bytes(4 + rng() % 5));
+			patterns[i].push_back(bench_hex(raw.back()));
+		}
+		replacements.push_back(bench_hex(bytes(4)));
+	}
+	Json::Value config = bench_config(patterns, replacements);
+	const struct injection_matcher *matcher;
+	struct injection_rules *rules = bench_compile(config, &matcher);
+
+	std::vector<std::string> payloads;
+	for (int i = 0; i < 256; i++) {
+		std::string payload = bytes(size);
+		if (i % 16 == 0) {
+			const std::string &pattern = raw[rng() % raw.size()];
+			payload.replace(rng() % (size - pattern.length()), pattern.length(), pattern);
+		}
+		payloads.push_back(payload);
+	}
+
+	char data[BENCH_CAPACITY];
+	uint32_t length;
+	double ns[2];
+	uint64_t modified[2] = { 0, 0 }, packets[2] = { 0, 0 };
+	for (int engine = 0; engine < 2; engine++) {
+		uint64_t start = bench_now(), now;
+		// Whole rounds over the payloads, so that both engines see the
+		// same share of matching ones.
+		do {
+			for (size_t i = 0; i < payloads.size(); i++) {
+				memcpy(data, payloads[i].data(), payloads[i].length());
+				length = payloads[i].length();
+				if (engine == 0)
+					modified[0] += linear_apply(config, data, &length);
+				else
+					modified[1] += injection_apply(matcher, data, &length, BENCH_CAPACITY);
+			}
+			packets[engine] += payloads.size();
+			now = bench_now();
+		} while (now - start < duration);
+		ns[engine] = (double)(now - start) / packets[engine];
+	}
+	injection_free(rules);
+
+	bench_quiet(false);
+	printf("%6d %6d %12.1f %12.1f %8.1fx %8.1f%%\n", num_rules, size, ns[0], ns[1],
+		ns[0] / ns[1], 100.0 * modified[1] / packets[1]);
+	if (modified[0] * packets[1] != modified[1] * packets[0])
+		printf("The engines modified %.1f%% and %.1f%% of the packets\n",
+			100.0 * modified[0] / packets[0], 100.0 * modified[1] / packets[1]);
+	bench_quiet(true);
+}
+
+int main(int argc, char **argv) {
+	static const struct option options[] = {
+		{"check", no_argument, NULL, 'c'},
+		{"ms", required_argument, NULL, 'm'},
+		{NULL, 0, NULL, 0},
+	};
+	bool check_only = false;
+	uint64_t duration = 500 * 1000000ULL;
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+			check_only = true;
+			break;
+		case 'm':
+			duration = strtoull(optarg, NULL, 10) * 1000000;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [--check] [--ms=N]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	bench_quiet(true);
+	bool ok = check_overlap() && check_random(2000);
+	bench_quiet(false);
+	if (!ok)
+		return 1;
+	printf("The compiled rules rewrite payloads as the linear engine does\n");
+	if (check_only)
+		return 0;
+
+	printf("%6s %6s %12s %12s %9s %9s\n", "rules", "size", "linear ns",
+		"compiled ns", "speedup", "modified");
+	bench_quiet(true);
+	static const int num_rules[] = { 1, 8, 32, 128 };
+	static const int sizes[] = { 64, 1023 };
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		for (size_t r = 0; r < sizeof(num_rules) / sizeof(num_rules[0]); r++)
+			bench_run(num_rules[r], sizes[s], duration);
+	}
+	bench_quiet(false);
+	return 0;
+}
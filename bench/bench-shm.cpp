@@ -0,0 +1,261 @@
+// One-way latency of handing a binary move message to the proxy over
+// loopback UDP and over the shared-memory ring, futex and busy polling.
+// The receivers mirror UdpServer: poll() and recvmmsg() for UDP, and
+// shm_loop()/shm_drain() for the ring. Decoding the message is left out.
+//
+//	./bench/bench-shm [--count=N] [--interval_us=N]
+//
+// A producer thread sends --count messages (default 20000), one every
+// --interval_us microseconds (default 100) so that the receiver goes to
+// sleep in between, each stamped with CLOCK_MONOTONIC; the receiver takes
+// the difference when it has the message in hand. Percentiles are in us.
+// With a single CPU the busy poller shares it with the producer.
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
+
+#include "shm_ring.h"
+
+struct bench_msg {
+	struct udp_msg_move	move;
+	uint64_t		sent_ns;
+} __attribute__((packed));
+
+#define BENCH_UDP_BATCH		32
+
+static int bench_count = 20000;
+static int bench_interval_us = 100;
+
+static uint64_t bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_sleep_until(uint64_t ns) {
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+// Calls send(msg) every bench_interval_us.
+template <typename Send>
+static void bench_produce(Send send) {
+	uint64_t next = bench_now();
+	for (int i = 0; i < bench_count; i++) {
+		next += bench_interval_us * 1000ULL;
+		bench_sleep_until(next);
+
+		struct bench_msg msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.move.header.magic = UDP_MSG_MAGIC;
+		msg.move.header.version = UDP_MSG_VERSION;
+		msg.move.header.op = UDP_MSG_MOVE;
+		msg.move.x = 1;
+		msg.sent_ns = bench_now();
+		while (!send(&msg))
+			;
+	}
+}
+
+static void bench_report(const char *name, std::vector<uint64_t> &latencies) {
+	std::sort(latencies.begin(), latencies.end());
+	auto at = [&](double p) {
+		return latencies[std::min(latencies.size() - 1, (size_t)(p * latencies.size()))] / 1000.0;
+	};
+	printf("%-12s %8zu %8.1f %8.1f %8.1f %8.1f\n", name, latencies.size(),
+		at(0.5), at(0.9), at(0.99), latencies.back() / 1000.0);
+}
+
+/*----------------------------------------------------------------------*/
+
+static void bench_udp() {
+	int rx = socket(AF_INET, SOCK_DGRAM, 0);
+	int tx = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(addr);
+	if (rx < 0 || tx < 0 || bind(rx, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    getsockname(rx, (struct sockaddr *)&addr, &addr_len) < 0) {
+		perror("UDP socket");
+		exit(EXIT_FAILURE);
+	}
+
+	std::vector<uint64_t> latencies;
+	latencies.reserve(bench_count);
+	std::atomic<bool> sent(false);
+	std::thread receiver([&] {
+		struct bench_msg bufs[BENCH_UDP_BATCH];
+		struct iovec iovs[BENCH_UDP_BATCH];
+		struct mmsghdr msgs[BENCH_UDP_BATCH];
+		memset(msgs, 0, sizeof(msgs));
+		for (int i = 0; i < BENCH_UDP_BATCH; i++) {
+			iovs[i].iov_base = &bufs[i];
+			iovs[i].iov_len = sizeof(bufs[i]);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		while ((int)latencies.size() < bench_count) {
+			// Datagrams the socket dropped never arrive.
+			struct pollfd fd = { rx, POLLIN, 0 };
+			if (poll(&fd, 1, 1000) <= 0) {
+				if (sent.load())
+					break;
+				continue;
+			}
+			int n = recvmmsg(rx, msgs, BENCH_UDP_BATCH, MSG_DONTWAIT, NULL);
+			uint64_t now = bench_now();
+			for (int i = 0; i < n; i++)
+				latencies.push_back(now - bufs[i].sent_ns);
+		}
+	});
+
+	bench_produce([&](const struct bench_msg *msg) {
+		return sendto(tx, msg, sizeof(*msg), 0, (struct sockaddr *)&addr,
+				sizeof(addr)) == sizeof(*msg);
+	});
+	sent.store(true);
+	receiver.join();
+	close(rx);
+	close(tx);
+	bench_report("udp", latencies);
+}
+
+/*----------------------------------------------------------------------*/
+
+// UdpServer::shm_create().
+static struct shm_ring *bench_shm_create(const char *name) {
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 || ftruncate(fd, sizeof(struct shm_ring)) < 0) {
+		perror("shm_open() injection ring");
+		exit(EXIT_FAILURE);
+	}
+	void *map = mmap(NULL, sizeof(struct shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap() injection ring");
+		exit(EXIT_FAILURE);
+	}
+
+	struct shm_ring *ring = (struct shm_ring *)map;
+	ring->records = SHM_RING_RECORDS;
+	ring->record_size = sizeof(struct shm_ring_record);
+	ring->consumer_waiting = 0;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->overflows = 0;
+	for (uint32_t i = 0; i < SHM_RING_RECORDS; i++)
+		ring->record[i].seq = i;
+	ring->version = SHM_RING_VERSION;
+	__atomic_store_n(&ring->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+	return ring;
+}
+
+// UdpServer::shm_drain().
+static bool bench_shm_drain(struct shm_ring *ring, std::vector<uint64_t> *latencies) {
+	uint32_t head = ring->head;
+	struct shm_ring_record *record = &ring->record[head & (SHM_RING_RECORDS - 1)];
+	if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != head + 1)
+		return false;
+
+	do {
+		uint8_t data[SHM_RING_DATA];
+		size_t length = std::min<size_t>(record->length, SHM_RING_DATA);
+		memcpy(data, record->data, length);
+		__atomic_store_n(&record->seq, head + SHM_RING_RECORDS, __ATOMIC_RELEASE);
+		head++;
+		__atomic_store_n(&ring->head, head, __ATOMIC_RELAXED);
+
+		struct bench_msg msg;
+		memcpy(&msg, data, sizeof(msg));
+		latencies->push_back(bench_now() - msg.sent_ns);
+
+		record = &ring->record[head & (SHM_RING_RECORDS - 1)];
+	} while (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) == head + 1);
+	return true;
+}
+
+static void bench_shm(bool busy_poll) {
+	char name[64];
+	snprintf(name, sizeof(name), "/usb-proxy-bench-%d", getpid());
+	struct shm_ring *consumer_ring = bench_shm_create(name);
+	struct shm_ring *ring = shm_ring_open(name);
+	if (!ring) {
+		printf("Could not open the ring %s\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	// UdpServer::shm_loop().
+	std::vector<uint64_t> latencies;
+	latencies.reserve(bench_count);
+	std::thread receiver([&] {
+		while ((int)latencies.size() < bench_count) {
+			if (bench_shm_drain(consumer_ring, &latencies) || busy_poll)
+				continue;
+
+			__atomic_store_n(&consumer_ring->consumer_waiting, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (bench_shm_drain(consumer_ring, &latencies)) {
+				__atomic_store_n(&consumer_ring->consumer_waiting, 0, __ATOMIC_RELAXED);
+				continue;
+			}
+			struct timespec timeout = { 1, 0 };
+			shm_ring_futex(&consumer_ring->consumer_waiting, FUTEX_WAIT, 1, &timeout);
+			__atomic_store_n(&consumer_ring->consumer_waiting, 0, __ATOMIC_RELAXED);
+		}
+	});
+
+	bench_produce([&](const struct bench_msg *msg) {
+		return shm_ring_send(ring, msg, sizeof(*msg)) == 0;
+	});
+	receiver.join();
+	shm_ring_close(ring);
+	munmap(consumer_ring, sizeof(struct shm_ring));
+	shm_unlink(name);
+	bench_report(busy_poll ? "shm busy" : "shm futex", latencies);
+}
+
+int main(int argc, char **argv) {
+	static const struct option options[] = {
+		{"count", required_argument, NULL, 'c'},
+		{"interval_us", required_argument, NULL, 'i'},
+		{NULL, 0, NULL, 0},
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+			bench_count = std::max(atoi(optarg), 1);
+			break;
+		case 'i':
+			bench_interval_us = std::max(atoi(optarg), 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [--count=N] [--interval_us=N]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	printf("%ld CPUs, a message every %d us\n", sysconf(_SC_NPROCESSORS_ONLN),
+		bench_interval_us);
+	printf("%-12s %8s %8s %8s %8s %8s\n", "transport", "msgs", "p50", "p90", "p99", "max");
+	bench_udp();
+	bench_shm(false);
+	bench_shm(true);
+	return 0;
+}
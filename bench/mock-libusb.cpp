@@ -0,0 +1,288 @@
+#include <algorithm>
+#include <deque>
+#include <errno.h>
+#include <mutex>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+// The prototypes of these two changed between libusb releases. The mock
+// defines them by name only, which is all C linkage needs.
+#define libusb_strerror mock_libusb_strerror_decl
+#define libusb_hotplug_register_callback mock_libusb_hotplug_register_callback_decl
+#include <libusb-1.0/libusb.h>
+#undef libusb_strerror
+#undef libusb_hotplug_register_callback
+
+#include "mock-libusb.h"
+
+uint64_t mock_device_rate = 0;
+int mock_device_short_every = 0;
+int mock_device_packet_size = 512;
+uint64_t mock_device_bytes = 0;
+uint64_t mock_device_transfers = 0;
+
+// transfer has to come last: it ends with the iso packet descriptors.
+struct mock_transfer {
+	bool			cancelled;
+	uint64_t		submitted_ns;
+	struct libusb_transfer	transfer;
+};
+
+static std::mutex mock_mutex;
+static std::deque<struct mock_transfer *> mock_pending;
+// When the device finished the last transfer.
+static uint64_t mock_last_ns;
+
+static uint64_t mock_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void mock_sleep_until(uint64_t ns) {
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static struct mock_transfer *mock_of(struct libusb_transfer *transfer) {
+	return (struct mock_transfer *)((char *)transfer - offsetof(struct mock_transfer, transfer));
+}
+
+// Fills in the transfer at the head of the queue. Returns false if the
+// device is not done with it by deadline.
+static bool mock_complete_head(uint64_t deadline) {
+	struct mock_transfer *mock = mock_pending.front();
+	struct libusb_transfer *transfer = &mock->transfer;
+
+	if (mock->cancelled) {
+		transfer->status = LIBUSB_TRANSFER_CANCELLED;
+		transfer->actual_length = 0;
+		return true;
+	}
+
+	int length = transfer->length;
+	if (mock_device_short_every > 0 && length > mock_device_packet_size &&
+	    (mock_device_transfers + 1) % mock_device_short_every == 0)
+		length -= mock_device_packet_size;
+
+	// The device works through the transfers one after the other, each
+	// from when it was submitted or the previous one was done.
+	if (mock_device_rate) {
+		uint64_t ready = std::max(mock_last_ns, mock->submitted_ns) +
+				(uint64_t)length * 1000000000 / mock_device_rate;
+		if (ready > deadline)
+			return false;
+		mock_sleep_until(ready);
+		mock_last_ns = ready;
+	}
+
+	memset(transfer->buffer, (uint8_t)mock_device_transfers, length);
+	transfer->status = LIBUSB_TRANSFER_COMPLETED;
+	transfer->actual_length = length;
+	mock_device_bytes += length;
+	mock_device_transfers++;
+	return true;
+}
+
+int libusb_handle_events_timeout_completed(libusb_context *ctx __attribute__((unused)),
+			struct timeval *tv, int *completed) {
+	uint64_t deadline = mock_now() + (uint64_t)tv->tv_sec * 1000000000 +
+				(uint64_t)tv->tv_usec * 1000;
+
+	std::unique_lock<std::mutex> lock(mock_mutex);
+	while (!*completed) {
+		if (mock_pending.empty() || !mock_complete_head(deadline)) {
+			lock.unlock();
+			mock_sleep_until(deadline);
+			return LIBUSB_SUCCESS;
+		}
+		struct mock_transfer *mock = mock_pending.front();
+		mock_pending.pop_front();
+
+		lock.unlock();
+		mock->transfer.callback(&mock->transfer);
+		lock.lock();
+	}
+	return LIBUSB_SUCCESS;
+}
+
+int libusb_handle_events_completed(libusb_context *ctx, int *completed) {
+	struct timeval tv = { 60, 0 };
+	return libusb_handle_events_timeout_completed(ctx, &tv, completed);
+}
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets) {
+	size_t size = sizeof(struct mock_transfer) +
+			iso_packets * sizeof(struct libusb_iso_packet_descriptor);
+	struct mock_transfer *mock = (struct mock_transfer *)new char[size];
+	memset(mock, 0, size);
+	mock->transfer.num_iso_packets = iso_packets;
+	return &mock->transfer;
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer) {
+	if (transfer)
+		delete[] (char *)mock_of(transfer);
+}
+
+int libusb_submit_transfer(struct libusb_transfer *transfer) {
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_BULK &&
+	    transfer->type != LIBUSB_TRANSFER_TYPE_INTERRUPT)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	std::lock_guard<std::mutex> lock(mock_mutex);
+	mock_of(transfer)->cancelled = false;
+	mock_of(transfer)->submitted_ns = mock_now();
+	mock_pending.push_back(mock_of(transfer));
+	return LIBUSB_SUCCESS;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *transfer) {
+	std::lock_guard<std::mutex> lock(mock_mutex);
+	for (size_t i = 0; i < mock_pending.size(); i++) {
+		if (mock_pending[i] == mock_of(transfer)) {
+			mock_pending[i]->cancelled = true;
+			return LIBUSB_SUCCESS;
+		}
+	}
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+/*----------------------------------------------------------------------*/
+
+// The rest of what device-libusb.cpp links against.
+
+int libusb_init(libusb_context **ctx) {
+	if (ctx)
+		*ctx = NULL;
+	return LIBUSB_SUCCESS;
+}
+
+void libusb_exit(libusb_context *ctx __attribute__((unused))) {
+}
+
+void libusb_set_debug(libusb_context *ctx __attribute__((unused)),
+			int level __attribute__((unused))) {
+}
+
+extern "C" const char *libusb_strerror(int errcode __attribute__((unused))) {
+	return "mock libusb error";
+}
+
+extern "C" int libusb_hotplug_register_callback() {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+ssize_t libusb_get_device_list(libusb_context *ctx __attribute__((unused)),
+			libusb_device ***list) {
+	*list = NULL;
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+void libusb_free_device_list(libusb_device **list __attribute__((unused)),
+			int unref_devices __attribute__((unused))) {
+}
+
+int libusb_open(libusb_device *dev __attribute__((unused)),
+			libusb_device_handle **dev_handle) {
+	*dev_handle = NULL;
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+libusb_device *libusb_get_device(libusb_device_handle *dev_handle __attribute__((unused))) {
+	return NULL;
+}
+
+int libusb_get_device_descriptor(libusb_device *dev __attribute__((unused)),
+			struct libusb_device_descriptor *desc __attribute__((unused))) {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int libusb_get_config_descriptor(libusb_device *dev __attribute__((unused)),
+			uint8_t config_index __attribute__((unused)),
+			struct libusb_config_descriptor **config __attribute__((unused))) {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int libusb_get_max_iso_packet_size(libusb_device *dev __attribute__((unused)),
+			unsigned char endpoint __attribute__((unused))) {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int libusb_get_configuration(libusb_device_handle *dev_handle __attribute__((unused)),
+			int *config __attribute__((unused))) {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int libusb_set_configuration(libusb_device_handle *dev_handle __attribute__((unused)),
+			int configuration __attribute__((unused))) {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int libusb_set_auto_detach_kernel_driver(libusb_device_handle *dev_handle __attribute__((unused)),
+			int enable __attribute__((unused))) {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int libusb_detach_kernel_driver(libusb_device_handle *dev_handle __attribute__((unused)),
+			int interface_number __attribute__((unused))) {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int libusb_claim_interface(libusb_device_handle *dev_handle __attribute__((unused)),
+			int interface_number __attribute__((unused))) {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int libusb_release_interface(libusb_device_handle *dev_handle __attribute__((unused)),
+			int interface_number __attribute__((unused))) {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int libusb_set_interface_alt_setting(libusb_device_handle *dev_handle __attribute__((unused)),
+			int interface_number __attribute__((unused)),
+			int alternate_setting __attribute__((unused))) {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int libusb_reset_device(libusb_device_handle *dev_handle __attribute__((unused))) {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int libusb_clear_halt(libusb_device_handle *dev_handle __attribute__((unused)),
+			unsigned char endpoint __attribute__((unused))) {
+	return LIBUSB_SUCCESS;
+}
+
+int libusb_control_transfer(libusb_device_handle *dev_handle __attribute__((unused)),
+			uint8_t request_type __attribute__((unused)),
+			uint8_t bRequest __attribute__((unused)),
+			uint16_t wValue __attribute__((unused)),
+			uint16_t wIndex __attribute__((unused)),
+			unsigned char *data __attribute__((unused)),
+			uint16_t wLength __attribute__((unused)),
+			unsigned int timeout __attribute__((unused))) {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int libusb_bulk_transfer(libusb_device_handle *dev_handle __attribute__((unused)),
+			unsigned char endpoint __attribute__((unused)),
+			unsigned char *data __attribute__((unused)),
+			int length __attribute__((unused)),
+			int *actual_length __attribute__((unused)),
+			unsigned int timeout __attribute__((unused))) {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int libusb_interrupt_transfer(libusb_device_handle *dev_handle __attribute__((unused)),
+			unsigned char endpoint __attribute__((unused)),
+			unsigned char *data __attribute__((unused)),
+			int length __attribute__((unused)),
+			int *actual_length __attribute__((unused)),
+			unsigned int timeout __attribute__((unused))) {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
@@ -0,0 +1,25 @@
+#ifndef MOCK_LIBUSB_H
+#define MOCK_LIBUSB_H
+
+#include <stdint.h>
+
+// A simulated device standing in for libusb in the benchmarks. It has one
+// bulk IN endpoint that always has data: submitted transfers complete in
+// order, from libusb_handle_events_*(), on the thread that calls it, as
+// with the real library. Everything else libusb offers fails with
+// LIBUSB_ERROR_NOT_SUPPORTED.
+
+// Bytes per second the device delivers, 0 for as fast as transfers are
+// submitted.
+extern uint64_t mock_device_rate;
+
+// Every Nth transfer comes back one packet of packet_size short, as when
+// a device ends a transfer early with a ZLP. 0 for never.
+extern int mock_device_short_every;
+extern int mock_device_packet_size;
+
+// Bytes delivered and transfers completed so far.
+extern uint64_t mock_device_bytes;
+extern uint64_t mock_device_transfers;
+
+#endif // MOCK_LIBUSB_H
@@ -1,3 +1,5 @@
+#include <cinttypes>
+
 #include "device-libusb.h"
 
 libusb_device 			**devs;
@@ -10,6 +12,11 @@ struct libusb_config_descriptor		**device_config_desc;
 
 pthread_t hotplug_monitor_thread;
 
+int in_transfers = 4;
+int out_transfers = 4;
+int iso_transfers = 4;
+int iso_packets = 8;
+
 int hotplug_callback(struct libusb_context *ctx __attribute__((unused)),
 			struct libusb_device *dev __attribute__((unused)),
 			libusb_hotplug_event envet __attribute__((unused)),
@@ -257,8 +264,8 @@ int send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
 		fprintf(stderr, "Can't send on a control endpoint.\n");
 		break;
 	case USB_ENDPOINT_XFER_ISOC:
-		if (verbose_level)
-			fprintf(stderr, "Isochronous(write) endpoint EP%02x unhandled.\n", endpoint);
+		fprintf(stderr, "Isochronous endpoint EP%02x must be written through an iso_stream.\n", endpoint);
+		result = LIBUSB_ERROR_NOT_SUPPORTED;
 		break;
 	case USB_ENDPOINT_XFER_BULK:
 		do {
@@ -299,16 +306,11 @@ int send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
 	return result;
 }
 
-void iso_transfer_callback(struct libusb_transfer *transfer) {
-	int *iso_completed = (int *)transfer->user_data;
-	*iso_completed = 1;
-}
-
+// Reads one packet (up to maxPacketSize bytes) into data, which the
+// caller provides; no buffer is allocated here.
 int receive_data(uint8_t endpoint, uint8_t attributes, uint16_t maxPacketSize,
-			uint8_t **dataptr, int *length, int timeout) {
+			uint8_t *data, int *length, int timeout) {
 	int result = LIBUSB_SUCCESS;
-	struct libusb_transfer *transfer;
-	int iso_completed, iso_packets;
 
 	int attempt = 0;
 	switch (attributes & USB_ENDPOINT_XFERTYPE_MASK) {
@@ -316,39 +318,12 @@ int receive_data(uint8_t endpoint, uint8_t attributes, uint16_t maxPacketSize,
 		fprintf(stderr, "Can't read on a control endpoint.\n");
 		break;
 	case USB_ENDPOINT_XFER_ISOC:
-		*dataptr = new uint8_t[maxPacketSize];
-		// We could retrieve multiple packets at a time, but then we
-		// would need to split the received data submit each packet
-		// separately via Raw Gadget. So retrieve only one packet for
-		// simplicity.
-		iso_packets = 1;
-		transfer = libusb_alloc_transfer(iso_packets);
-		if (!transfer) {
-			fprintf(stderr, "Failed to allocate libusb_transfer.\n");
-			result = LIBUSB_ERROR_OTHER;
-		}
-		iso_completed = 0;
-		libusb_fill_iso_transfer(transfer, dev_handle, endpoint, *dataptr, maxPacketSize,
-					iso_packets, iso_transfer_callback, &iso_completed, timeout);
-		libusb_set_iso_packet_lengths(transfer, maxPacketSize / iso_packets);
-		result = libusb_submit_transfer(transfer);
-		if (result != LIBUSB_SUCCESS) {
-			libusb_free_transfer(transfer);
-			break;
-		}
-		while (!iso_completed)
-			libusb_handle_events_completed(NULL, &iso_completed);
-		*length = 0;
-		for (int i = 0; i < iso_packets; i++)
-			*length += transfer->iso_packet_desc[i].actual_length;
-		if (result == LIBUSB_SUCCESS && verbose_level > 2)
-			printf("Received iso data(%d) bytes\n", *length);
-		libusb_free_transfer(transfer);
+		fprintf(stderr, "Isochronous endpoint EP%02x must be read through an iso_stream.\n", endpoint);
+		result = LIBUSB_ERROR_NOT_SUPPORTED;
 		break;
 	case USB_ENDPOINT_XFER_BULK:
-		*dataptr = new uint8_t[maxPacketSize * 8];
 		do {
-			result = libusb_bulk_transfer(dev_handle, endpoint, *dataptr, maxPacketSize, length, timeout);
+			result = libusb_bulk_transfer(dev_handle, endpoint, data, maxPacketSize, length, timeout);
 			if (result == LIBUSB_SUCCESS && verbose_level > 2)
 				printf("Received bulk data(%d) bytes\n", *length);
 			if ((result == LIBUSB_ERROR_PIPE || result == LIBUSB_ERROR_TIMEOUT))
@@ -358,8 +333,7 @@ int receive_data(uint8_t endpoint, uint8_t attributes, uint16_t maxPacketSize,
 		} while ((result == LIBUSB_ERROR_PIPE || result == LIBUSB_ERROR_TIMEOUT) && attempt < MAX_ATTEMPTS);
 		break;
 	case USB_ENDPOINT_XFER_INT:
-		*dataptr = new uint8_t[maxPacketSize];
-		result = libusb_interrupt_transfer(dev_handle, endpoint, *dataptr, maxPacketSize, length, timeout);
+		result = libusb_interrupt_transfer(dev_handle, endpoint, data, maxPacketSize, length, timeout);
 		if (result == LIBUSB_SUCCESS && verbose_level > 2)
 			printf("Received int data(%d) bytes\n", *length);
 		break;
@@ -372,3 +346,553 @@ int receive_data(uint8_t endpoint, uint8_t attributes, uint16_t maxPacketSize,
 
 	return result;
 }
+
+/*----------------------------------------------------------------------*/
+
+int stream_notify_fd = -1;
+thread_local bool stream_notify_self = false;
+
+void stream_transfer_callback(struct libusb_transfer *transfer) {
+	int *completed = (int *)transfer->user_data;
+	*completed = 1;
+
+	// Whichever thread happens to handle libusb events runs this callback.
+	// If that is not the reactor, it would never learn about the
+	// completion, so poke it.
+	if (stream_notify_fd >= 0 && !stream_notify_self) {
+		uint64_t value = 1;
+		if (write(stream_notify_fd, &value, sizeof(value)) < 0)
+			perror("write() stream_notify_fd");
+	}
+}
+
+struct in_stream *in_stream_create(uint8_t endpoint, uint8_t attributes,
+			int length, int num_transfers) {
+	struct in_stream *stream = new struct in_stream;
+	stream->endpoint = endpoint;
+	stream->attributes = attributes;
+	stream->length = length;
+	stream->num_transfers = num_transfers;
+	stream->head = 0;
+	stream->tail = 0;
+	stream->in_flight = 0;
+
+	for (int i = 0; i < num_transfers; i++) {
+		stream->transfers[i] = libusb_alloc_transfer(0);
+		if (!stream->transfers[i]) {
+			fprintf(stderr, "Failed to allocate libusb_transfer.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		// No timeout: an idle interrupt endpoint may not report anything
+		// for minutes. The owner polls for completion with its own
+		// timeout instead, so it can still notice please_stop_eps.
+		if ((attributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_BULK)
+			libusb_fill_bulk_transfer(stream->transfers[i], dev_handle, endpoint,
+				NULL, length, stream_transfer_callback,
+				&stream->completed[i], 0);
+		else
+			libusb_fill_interrupt_transfer(stream->transfers[i], dev_handle, endpoint,
+				NULL, length, stream_transfer_callback,
+				&stream->completed[i], 0);
+		stream->completed[i] = 1;
+	}
+
+	if (verbose_level)
+		printf("EP%02x: up to %d transfers of %d bytes in flight\n",
+			endpoint, num_transfers, length);
+
+	return stream;
+}
+
+// Queues a read of up to stream->length bytes straight into buffer, which
+// must stay valid until the transfer is returned by in_stream_next().
+int in_stream_submit(struct in_stream *stream, uint8_t *buffer, int tag) {
+	int i = stream->tail;
+	struct libusb_transfer *transfer = stream->transfers[i];
+
+	assert(stream->in_flight < stream->num_transfers);
+	transfer->buffer = buffer;
+	stream->tags[i] = tag;
+	stream->completed[i] = 0;
+
+	int result = libusb_submit_transfer(transfer);
+	if (result != LIBUSB_SUCCESS) {
+		stream->completed[i] = 1;
+		fprintf(stderr, "Transfer error receiving on EP%02x: %s\n",
+				stream->endpoint, libusb_strerror((libusb_error)result));
+		return result;
+	}
+
+	stream->tail = (stream->tail + 1) % stream->num_transfers;
+	stream->in_flight++;
+	return LIBUSB_SUCCESS;
+}
+
+// Waits up to timeout ms for the oldest transfer. Returns
+// LIBUSB_ERROR_TIMEOUT if it is still in flight; otherwise the transfer is
+// retired, its tag is returned and, on success, the number of bytes read.
+int in_stream_next(struct in_stream *stream, int *tag, int *length, int timeout) {
+	int i = stream->head;
+	struct libusb_transfer *transfer = stream->transfers[i];
+
+	if (stream->in_flight == 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	if (!stream->completed[i]) {
+		struct timeval tv = {
+			.tv_sec = timeout / 1000,
+			.tv_usec = (timeout % 1000) * 1000,
+		};
+		libusb_handle_events_timeout_completed(context, &tv, &stream->completed[i]);
+		if (!stream->completed[i])
+			return LIBUSB_ERROR_TIMEOUT;
+	}
+
+	stream->head = (stream->head + 1) % stream->num_transfers;
+	stream->in_flight--;
+	*tag = stream->tags[i];
+
+	int result;
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		*length = transfer->actual_length;
+		if (verbose_level > 2)
+			printf("Received data(%d) bytes on EP%02x\n",
+				*length, stream->endpoint);
+		return LIBUSB_SUCCESS;
+	case LIBUSB_TRANSFER_STALL:
+		libusb_clear_halt(dev_handle, stream->endpoint);
+		result = LIBUSB_ERROR_PIPE;
+		break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		result = LIBUSB_ERROR_NO_DEVICE;
+		break;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		result = LIBUSB_ERROR_OVERFLOW;
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		result = LIBUSB_ERROR_INTERRUPTED;
+		break;
+	default:
+		result = LIBUSB_ERROR_IO;
+		break;
+	}
+
+	fprintf(stderr, "Transfer error receiving on EP%02x: %s\n",
+			stream->endpoint, libusb_strerror((libusb_error)result));
+	return result;
+}
+
+void in_stream_destroy(struct in_stream *stream) {
+	if (!stream)
+		return;
+
+	for (int i = 0; i < stream->num_transfers; i++) {
+		if (!stream->completed[i])
+			libusb_cancel_transfer(stream->transfers[i]);
+	}
+
+	// Cancellation is asynchronous too; the transfers cannot be freed
+	// (nor their buffers reused) until libusb has reaped them.
+	for (int i = 0; i < stream->num_transfers; i++) {
+		while (!stream->completed[i])
+			libusb_handle_events_completed(context, &stream->completed[i]);
+		libusb_free_transfer(stream->transfers[i]);
+	}
+
+	delete stream;
+}
+
+/*----------------------------------------------------------------------*/
+
+struct out_stream *out_stream_create(uint8_t endpoint, uint8_t attributes,
+			int buffer_length, int num_transfers) {
+	struct out_stream *stream = new struct out_stream;
+	stream->endpoint = endpoint;
+	stream->attributes = attributes;
+	stream->buffer_length = buffer_length;
+	stream->num_transfers = num_transfers;
+	stream->head = 0;
+	stream->tail = 0;
+	stream->in_flight = 0;
+	stream->sent = 0;
+	stream->errors = 0;
+	stream->halts = 0;
+
+	for (int i = 0; i < num_transfers; i++) {
+		stream->transfers[i] = libusb_alloc_transfer(0);
+		if (!stream->transfers[i]) {
+			fprintf(stderr, "Failed to allocate libusb_transfer.\n");
+			exit(EXIT_FAILURE);
+		}
+		uint8_t *buffer = new uint8_t[buffer_length];
+
+		if ((attributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_BULK)
+			libusb_fill_bulk_transfer(stream->transfers[i], dev_handle, endpoint,
+				buffer, 0, stream_transfer_callback,
+				&stream->completed[i], USB_REQUEST_TIMEOUT);
+		else
+			libusb_fill_interrupt_transfer(stream->transfers[i], dev_handle, endpoint,
+				buffer, 0, stream_transfer_callback,
+				&stream->completed[i], USB_REQUEST_TIMEOUT);
+		stream->completed[i] = 1;
+	}
+
+	return stream;
+}
+
+// Waits up to timeout ms for the oldest outstanding transfer and accounts
+// for its result. A failed transfer is reported and dropped; the transfers
+// queued behind it are left alone. Returns LIBUSB_ERROR_TIMEOUT if the
+// oldest transfer is still in flight.
+int out_stream_reap(struct out_stream *stream, int timeout) {
+	if (stream->in_flight == 0)
+		return LIBUSB_SUCCESS;
+
+	int i = stream->head;
+	struct libusb_transfer *transfer = stream->transfers[i];
+
+	if (!stream->completed[i]) {
+		struct timeval tv = {
+			.tv_sec = timeout / 1000,
+			.tv_usec = (timeout % 1000) * 1000,
+		};
+		libusb_handle_events_timeout_completed(context, &tv, &stream->completed[i]);
+		if (!stream->completed[i])
+			return LIBUSB_ERROR_TIMEOUT;
+	}
+
+	stream->head = (stream->head + 1) % stream->num_transfers;
+	stream->in_flight--;
+
+	int result = LIBUSB_SUCCESS;
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		if (transfer->actual_length != transfer->length)
+			fprintf(stderr, "Incomplete transfer on EP%02x. length(%d), transferred(%d)\n",
+				stream->endpoint, transfer->length, transfer->actual_length);
+		else if (verbose_level > 2)
+			printf("Sent %d bytes to EP%02x\n", transfer->actual_length, stream->endpoint);
+		stream->sent++;
+		return LIBUSB_SUCCESS;
+	case LIBUSB_TRANSFER_STALL:
+		// Clear the halt so that the transfers queued behind this one
+		// (and everything the host sends next) can go through.
+		libusb_clear_halt(dev_handle, stream->endpoint);
+		stream->halts++;
+		result = LIBUSB_ERROR_PIPE;
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		result = LIBUSB_ERROR_TIMEOUT;
+		break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		result = LIBUSB_ERROR_NO_DEVICE;
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		result = LIBUSB_ERROR_INTERRUPTED;
+		break;
+	default:
+		result = LIBUSB_ERROR_IO;
+		break;
+	}
+
+	stream->errors++;
+	fprintf(stderr, "Transfer error sending on EP%02x: %s, dropped %d bytes\n",
+			stream->endpoint, libusb_strerror((libusb_error)result),
+			transfer->length);
+	return result;
+}
+
+int out_stream_submit(struct out_stream *stream, const uint8_t *data, int length) {
+	if (length > stream->buffer_length) {
+		fprintf(stderr, "Transfer of %d bytes too large for EP%02x\n",
+			length, stream->endpoint);
+		stream->errors++;
+		return LIBUSB_ERROR_OVERFLOW;
+	}
+
+	// Every transfer is busy, the oldest one has to complete first.
+	while (stream->in_flight == stream->num_transfers) {
+		int result = out_stream_reap(stream, IN_STREAM_POLL_TIMEOUT);
+		if (result == LIBUSB_ERROR_NO_DEVICE)
+			return result;
+		if (please_stop_eps)
+			return LIBUSB_ERROR_INTERRUPTED;
+	}
+
+	int i = stream->tail;
+	struct libusb_transfer *transfer = stream->transfers[i];
+	memcpy(transfer->buffer, data, length);
+	transfer->length = length;
+
+	stream->completed[i] = 0;
+	int result = libusb_submit_transfer(transfer);
+	if (result != LIBUSB_SUCCESS) {
+		stream->completed[i] = 1;
+		stream->errors++;
+		fprintf(stderr, "Transfer error sending on EP%02x: %s\n",
+				stream->endpoint, libusb_strerror((libusb_error)result));
+		return result;
+	}
+
+	stream->tail = (stream->tail + 1) % stream->num_transfers;
+	stream->in_flight++;
+	return LIBUSB_SUCCESS;
+}
+
+void out_stream_destroy(struct out_stream *stream) {
+	if (!stream)
+		return;
+
+	for (int i = 0; i < stream->num_transfers; i++) {
+		if (!stream->completed[i])
+			libusb_cancel_transfer(stream->transfers[i]);
+	}
+	for (int i = 0; i < stream->num_transfers; i++) {
+		while (!stream->completed[i])
+			libusb_handle_events_completed(context, &stream->completed[i]);
+		delete[] stream->transfers[i]->buffer;
+		libusb_free_transfer(stream->transfers[i]);
+	}
+
+	printf("EP%02x: %" PRIu64 " transfers sent, %" PRIu64 " errors, %" PRIu64 " halts\n",
+		stream->endpoint, stream->sent, stream->errors, stream->halts);
+	delete stream;
+}
+
+/*----------------------------------------------------------------------*/
+
+// Unlike stream_transfer_callback(), this never pokes the reactor:
+// isochronous endpoints are always served by their own threads.
+void iso_transfer_callback(struct libusb_transfer *transfer) {
+	int *iso_completed = (int *)transfer->user_data;
+	*iso_completed = 1;
+}
+
+struct iso_stream *iso_stream_create(uint8_t endpoint, int num_packets,
+			int num_transfers) {
+	// Accounts for high-bandwidth endpoints that move several packets
+	// per (micro)frame.
+	int packet_size = libusb_get_max_iso_packet_size(libusb_get_device(dev_handle),
+				endpoint);
+	if (packet_size <= 0) {
+		fprintf(stderr, "Failed to get isochronous packet size of EP%02x: %s\n",
+			endpoint, libusb_strerror((libusb_error)packet_size));
+		return NULL;
+	}
+
+	struct iso_stream *stream = new struct iso_stream;
+	stream->endpoint = endpoint;
+	stream->packet_size = packet_size;
+	stream->num_packets = num_packets;
+	stream->num_transfers = num_transfers;
+	stream->head = 0;
+	stream->tail = 0;
+	stream->in_flight = 0;
+	stream->fill = 0;
+	stream->fill_length = 0;
+	stream->packets = 0;
+	stream->errors = 0;
+
+	for (int i = 0; i < num_transfers; i++) {
+		stream->transfers[i] = libusb_alloc_transfer(num_packets);
+		if (!stream->transfers[i]) {
+			fprintf(stderr, "Failed to allocate libusb_transfer.\n");
+			exit(EXIT_FAILURE);
+		}
+		uint8_t *buffer = new uint8_t[packet_size * num_packets];
+
+		libusb_fill_iso_transfer(stream->transfers[i], dev_handle, endpoint,
+			buffer, packet_size * num_packets, num_packets,
+			iso_transfer_callback, &stream->completed[i], 0);
+		libusb_set_iso_packet_lengths(stream->transfers[i], packet_size);
+		stream->completed[i] = 1;
+	}
+
+	if (verbose_level)
+		printf("EP%02x: up to %d isochronous transfers of %d x %d bytes in flight\n",
+			endpoint, num_transfers, num_packets, packet_size);
+
+	return stream;
+}
+
+void iso_stream_destroy(struct iso_stream *stream) {
+	if (!stream)
+		return;
+
+	for (int i = 0; i < stream->num_transfers; i++) {
+		if (!stream->completed[i])
+			libusb_cancel_transfer(stream->transfers[i]);
+	}
+	for (int i = 0; i < stream->num_transfers; i++) {
+		while (!stream->completed[i])
+			libusb_handle_events_completed(context, &stream->completed[i]);
+		delete[] stream->transfers[i]->buffer;
+		libusb_free_transfer(stream->transfers[i]);
+	}
+
+	printf("EP%02x: %" PRIu64 " isochronous packets, %" PRIu64 " errors\n",
+		stream->endpoint, stream->packets, stream->errors);
+	delete stream;
+}
+
+static int iso_stream_submit_tail(struct iso_stream *stream) {
+	int i = stream->tail;
+	struct libusb_transfer *transfer = stream->transfers[i];
+
+	stream->completed[i] = 0;
+	int result = libusb_submit_transfer(transfer);
+	if (result != LIBUSB_SUCCESS) {
+		stream->completed[i] = 1;
+		fprintf(stderr, "Transfer error on isochronous EP%02x: %s\n",
+				stream->endpoint, libusb_strerror((libusb_error)result));
+		return result;
+	}
+
+	stream->tail = (stream->tail + 1) % stream->num_transfers;
+	stream->in_flight++;
+	return LIBUSB_SUCCESS;
+}
+
+// Waits up to timeout ms for the oldest transfer and accounts for its
+// result. The transfer stays at head until it is retired.
+static int iso_stream_wait_head(struct iso_stream *stream, int timeout) {
+	int i = stream->head;
+	struct libusb_transfer *transfer = stream->transfers[i];
+
+	if (stream->in_flight == 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	if (!stream->completed[i]) {
+		struct timeval tv = {
+			.tv_sec = timeout / 1000,
+			.tv_usec = (timeout % 1000) * 1000,
+		};
+		libusb_handle_events_timeout_completed(context, &tv, &stream->completed[i]);
+		if (!stream->completed[i])
+			return LIBUSB_ERROR_TIMEOUT;
+	}
+
+	int result;
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		// Individual packets fail on their own (missed microframes,
+		// CRC errors) without failing the whole transfer.
+		for (int p = 0; p < transfer->num_iso_packets; p++) {
+			if (transfer->iso_packet_desc[p].status == LIBUSB_TRANSFER_COMPLETED)
+				stream->packets++;
+			else
+				stream->errors++;
+		}
+		return LIBUSB_SUCCESS;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		result = LIBUSB_ERROR_NO_DEVICE;
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		result = LIBUSB_ERROR_INTERRUPTED;
+		break;
+	default:
+		result = LIBUSB_ERROR_IO;
+		break;
+	}
+
+	stream->errors += transfer->num_iso_packets;
+	fprintf(stderr, "Transfer error on isochronous EP%02x: %s\n",
+			stream->endpoint, libusb_strerror((libusb_error)result));
+	return result;
+}
+
+static void iso_stream_retire_head(struct iso_stream *stream) {
+	stream->head = (stream->head + 1) % stream->num_transfers;
+	stream->in_flight--;
+}
+
+// Submits every idle IN transfer.
+int iso_in_stream_fill(struct iso_stream *stream) {
+	while (stream->in_flight < stream->num_transfers) {
+		int result = iso_stream_submit_tail(stream);
+		if (result != LIBUSB_SUCCESS)
+			return result;
+	}
+	return LIBUSB_SUCCESS;
+}
+
+// Waits up to timeout ms for the oldest IN transfer and returns it. Its
+// packets stay valid until iso_in_stream_release(), which must follow
+// every call that did not return LIBUSB_ERROR_TIMEOUT or
+// LIBUSB_ERROR_NOT_FOUND.
+int iso_in_stream_next(struct iso_stream *stream, struct libusb_transfer **transfer,
+			int timeout) {
+	int result = iso_stream_wait_head(stream, timeout);
+	if (result != LIBUSB_ERROR_TIMEOUT && result != LIBUSB_ERROR_NOT_FOUND)
+		*transfer = stream->transfers[stream->head];
+	return result;
+}
+
+void iso_in_stream_release(struct iso_stream *stream) {
+	iso_stream_retire_head(stream);
+}
+
+// Reaps the oldest OUT transfer, see iso_stream_wait_head().
+int iso_out_stream_reap(struct iso_stream *stream, int timeout) {
+	if (stream->in_flight == 0)
+		return LIBUSB_SUCCESS;
+
+	int result = iso_stream_wait_head(stream, timeout);
+	if (result != LIBUSB_ERROR_TIMEOUT)
+		iso_stream_retire_head(stream);
+	return result;
+}
+
+// Appends one packet to the OUT transfer being gathered at tail and
+// submits it once every packet is used. The host sends one packet per
+// usb_raw_ep_read(), so this is where they are merged.
+int iso_out_stream_submit(struct iso_stream *stream, const uint8_t *data, int length) {
+	if (length > stream->packet_size) {
+		fprintf(stderr, "Isochronous packet of %d bytes too large for EP%02x\n",
+			length, stream->endpoint);
+		stream->errors++;
+		return LIBUSB_ERROR_OVERFLOW;
+	}
+
+	// Starting a new transfer, but every transfer is busy: the oldest
+	// one has to complete first.
+	while (stream->fill == 0 && stream->in_flight == stream->num_transfers) {
+		int result = iso_out_stream_reap(stream, IN_STREAM_POLL_TIMEOUT);
+		if (result == LIBUSB_ERROR_NO_DEVICE)
+			return result;
+		if (please_stop_eps)
+			return LIBUSB_ERROR_INTERRUPTED;
+	}
+
+	// libusb expects the packets back to back in the buffer.
+	struct libusb_transfer *transfer = stream->transfers[stream->tail];
+	memcpy(transfer->buffer + stream->fill_length, data, length);
+	transfer->iso_packet_desc[stream->fill].length = length;
+	stream->fill++;
+	stream->fill_length += length;
+
+	if (stream->fill == stream->num_packets)
+		return iso_out_stream_flush(stream);
+	return LIBUSB_SUCCESS;
+}
+
+// Submits the partially gathered OUT transfer, if any, so that data does
+// not linger while the host pauses.
+int iso_out_stream_flush(struct iso_stream *stream) {
+	if (stream->fill == 0)
+		return LIBUSB_SUCCESS;
+
+	struct libusb_transfer *transfer = stream->transfers[stream->tail];
+	transfer->num_iso_packets = stream->fill;
+	transfer->length = stream->fill_length;
+	int packets = stream->fill;
+	stream->fill = 0;
+	stream->fill_length = 0;
+
+	int result = iso_stream_submit_tail(stream);
+	if (result != LIBUSB_SUCCESS)
+		stream->errors += packets;
+	return result;
+}
@@ -6,6 +6,79 @@
 
 #define MAX_ATTEMPTS 5
 
+#define IN_STREAM_MAX_TRANSFERS	32
+#define IN_STREAM_POLL_TIMEOUT	100
+
+// A ring of asynchronous transfers kept in flight on one IN endpoint.
+// The owner submits transfers at tail into buffers it provides, each
+// tagged with an identifier of its choice, and consumes completions from
+// head; transfers complete in submission order.
+struct in_stream {
+	uint8_t			endpoint;
+	uint8_t			attributes;
+	int			length;
+	int			num_transfers;
+	int			head;
+	int			tail;
+	int			in_flight;
+	struct libusb_transfer	*transfers[IN_STREAM_MAX_TRANSFERS];
+	int			completed[IN_STREAM_MAX_TRANSFERS];
+	int			tags[IN_STREAM_MAX_TRANSFERS];
+};
+
+#define OUT_STREAM_MAX_TRANSFERS	32
+
+// A ring of asynchronous transfers used to pipeline host-to-device data.
+// Transfers are submitted at tail and reaped from head, so they reach the
+// device and are accounted for in the order the host sent them.
+struct out_stream {
+	uint8_t			endpoint;
+	uint8_t			attributes;
+	int			buffer_length;
+	int			num_transfers;
+	int			head;
+	int			tail;
+	int			in_flight;
+	struct libusb_transfer	*transfers[OUT_STREAM_MAX_TRANSFERS];
+	int			completed[OUT_STREAM_MAX_TRANSFERS];
+	uint64_t		sent;
+	uint64_t		errors;
+	uint64_t		halts;
+};
+
+#define ISO_STREAM_MAX_TRANSFERS	32
+#define ISO_STREAM_MAX_PACKETS		64
+
+// A ring of multi-packet isochronous transfers kept in flight on one
+// endpoint. IN transfers are all submitted up front and resubmitted as
+// soon as their packets have been taken out. OUT packets are gathered into
+// the transfer at tail, which is submitted once it is full or flushed.
+struct iso_stream {
+	uint8_t			endpoint;
+	int			packet_size;
+	int			num_packets;
+	int			num_transfers;
+	int			head;
+	int			tail;
+	int			in_flight;
+	int			fill;
+	int			fill_length;
+	struct libusb_transfer	*transfers[ISO_STREAM_MAX_TRANSFERS];
+	int			completed[ISO_STREAM_MAX_TRANSFERS];
+	uint64_t		packets;
+	uint64_t		errors;
+};
+
+extern int in_transfers;
+extern int out_transfers;
+extern int iso_transfers;
+extern int iso_packets;
+
+// eventfd written when a stream transfer completes on a thread that does
+// not have stream_notify_self set; -1 when nobody is listening.
+extern int stream_notify_fd;
+extern thread_local bool stream_notify_self;
+
 extern libusb_device			**devs;
 extern libusb_device_handle		*dev_handle;
 extern libusb_context			*context;
@@ -27,4 +100,27 @@ int control_request(const usb_ctrlrequest *setup_packet, int *nbytes,
 int send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
 			int length, int timeout);
 int receive_data(uint8_t endpoint, uint8_t attributes, uint16_t maxPacketSize,
-			uint8_t **dataptr, int *length, int timeout);
+			uint8_t *data, int *length, int timeout);
+
+struct in_stream *in_stream_create(uint8_t endpoint, uint8_t attributes,
+			int length, int num_transfers);
+int in_stream_submit(struct in_stream *stream, uint8_t *buffer, int tag);
+int in_stream_next(struct in_stream *stream, int *tag, int *length, int timeout);
+void in_stream_destroy(struct in_stream *stream);
+
+struct out_stream *out_stream_create(uint8_t endpoint, uint8_t attributes,
+			int buffer_length, int num_transfers);
+int out_stream_submit(struct out_stream *stream, const uint8_t *data, int length);
+int out_stream_reap(struct out_stream *stream, int timeout);
+void out_stream_destroy(struct out_stream *stream);
+
+struct iso_stream *iso_stream_create(uint8_t endpoint, int num_packets,
+			int num_transfers);
+void iso_stream_destroy(struct iso_stream *stream);
+int iso_in_stream_fill(struct iso_stream *stream);
+int iso_in_stream_next(struct iso_stream *stream, struct libusb_transfer **transfer,
+			int timeout);
+void iso_in_stream_release(struct iso_stream *stream);
+int iso_out_stream_submit(struct iso_stream *stream, const uint8_t *data, int length);
+int iso_out_stream_flush(struct iso_stream *stream);
+int iso_out_stream_reap(struct iso_stream *stream, int timeout);
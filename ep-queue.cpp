@@ -0,0 +1,428 @@
+#include <assert.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "ep-queue.h"
+
+int ep_queue_policy = EP_QUEUE_INTERLEAVE;
+
+static uint64_t ep_queue_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void ep_index_ring_init(struct ep_index_ring *ring, unsigned int size) {
+	unsigned int capacity = 1;
+	while (capacity < size)
+		capacity <<= 1;
+
+	ring->head.store(0, std::memory_order_relaxed);
+	ring->tail.store(0, std::memory_order_relaxed);
+	ring->mask = capacity - 1;
+	ring->entries = new uint32_t[capacity];
+}
+
+static bool ep_index_ring_push(struct ep_index_ring *ring, uint32_t entry) {
+	uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+	uint32_t head = ring->head.load(std::memory_order_acquire);
+
+	if (tail - head > ring->mask)
+		return false;
+
+	ring->entries[tail & ring->mask] = entry;
+	ring->tail.store(tail + 1, std::memory_order_release);
+	return true;
+}
+
+static bool ep_index_ring_peek(struct ep_index_ring *ring, uint32_t *entry) {
+	uint32_t head = ring->head.load(std::memory_order_relaxed);
+	uint32_t tail = ring->tail.load(std::memory_order_acquire);
+
+	if (head == tail)
+		return false;
+
+	*entry = ring->entries[head & ring->mask];
+	return true;
+}
+
+static void ep_index_ring_drop(struct ep_index_ring *ring) {
+	uint32_t head = ring->head.load(std::memory_order_relaxed);
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+static uint32_t ep_index_ring_size(struct ep_index_ring *ring) {
+	return ring->tail.load(std::memory_order_acquire) -
+		ring->head.load(std::memory_order_acquire);
+}
+
+static void ep_pool_init(struct ep_pool *pool, unsigned int num_slots,
+			unsigned int slot_size) {
+	size_t align = alignof(struct usb_raw_transfer_io);
+	pool->stride = (sizeof(struct usb_raw_ep_io) + slot_size + align - 1) & ~(align - 1);
+	pool->arena = new uint8_t[pool->stride * num_slots];
+	pool->slot_size = slot_size;
+	pool->num_slots = num_slots;
+	ep_index_ring_init(&pool->full, num_slots);
+	ep_index_ring_init(&pool->free, num_slots);
+	for (unsigned int i = 0; i < num_slots; i++)
+		ep_index_ring_push(&pool->free, i);
+	pool->spares = new uint32_t[num_slots];
+	pool->num_spares = 0;
+	pool->stamps = new uint64_t[num_slots];
+	pool->overflows.store(0, std::memory_order_relaxed);
+}
+
+static void ep_mpsc_ring_init(struct ep_mpsc_ring *ring, unsigned int capacity) {
+	ring->head.store(0, std::memory_order_relaxed);
+	ring->tail.store(0, std::memory_order_relaxed);
+	ring->overflows.store(0, std::memory_order_relaxed);
+	ring->mask = capacity - 1;
+	ring->cells = new struct ep_mpsc_cell[capacity];
+	for (unsigned int i = 0; i < capacity; i++)
+		ring->cells[i].seq.store(i, std::memory_order_relaxed);
+}
+
+struct ep_queue *ep_queue_create(unsigned int capacity, unsigned int reserve,
+				unsigned int slot_size) {
+	assert(capacity && (capacity & (capacity - 1)) == 0);
+
+	struct ep_queue *queue = new struct ep_queue;
+	ep_pool_init(&queue->data, capacity + reserve, slot_size);
+	ep_mpsc_ring_init(&queue->inject, capacity);
+	queue->policy = ep_queue_policy;
+	queue->next_lane = 0;
+	queue->front_lane = -1;
+	queue->front_ack = 0;
+	queue->front_length = 0;
+	queue->front_wait = 0;
+	for (int i = 0; i < 2; i++) {
+		struct ep_lane_stats *lane = &queue->lanes[i];
+		lane->transfers.store(0, std::memory_order_relaxed);
+		lane->wait_ns.store(0, std::memory_order_relaxed);
+		lane->max_wait_ns.store(0, std::memory_order_relaxed);
+		lane->max_depth.store(0, std::memory_order_relaxed);
+		lane->dropped.store(0, std::memory_order_relaxed);
+	}
+
+	queue->wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (queue->wake_fd < 0) {
+		perror("eventfd()");
+		exit(EXIT_FAILURE);
+	}
+	queue->waiting.store(false, std::memory_order_relaxed);
+	queue->wakeups.store(0, std::memory_order_relaxed);
+	queue->idle_wakeups.store(0, std::memory_order_relaxed);
+	queue->signals.store(0, std::memory_order_relaxed);
+	queue->bytes.store(0, std::memory_order_relaxed);
+	return queue;
+}
+
+void ep_queue_destroy(struct ep_queue *queue) {
+	if (!queue)
+		return;
+	close(queue->wake_fd);
+	delete[] queue->data.arena;
+	delete[] queue->data.full.entries;
+	delete[] queue->data.free.entries;
+	delete[] queue->data.spares;
+	delete[] queue->data.stamps;
+	delete[] queue->inject.cells;
+	delete queue;
+}
+
+/*----------------------------------------------------------------------*/
+
+// Returns a free slot index for the producer to fill, or -1 if all slots
+// are queued or in flight.
+int ep_queue_acquire(struct ep_queue *queue) {
+	struct ep_pool *pool = &queue->data;
+	uint32_t slot;
+
+	if (pool->num_spares)
+		return pool->spares[--pool->num_spares];
+
+	if (!ep_index_ring_peek(&pool->free, &slot))
+		return -1;
+	ep_index_ring_drop(&pool->free);
+	return slot;
+}
+
+void ep_queue_overflow(struct ep_queue *queue) {
+	queue->data.overflows.fetch_add(1, std::memory_order_relaxed);
+}
+
+static struct usb_raw_transfer_io *ep_pool_slot(struct ep_pool *pool, uint32_t slot) {
+	return (struct usb_raw_transfer_io *)(pool->arena + slot * pool->stride);
+}
+
+struct usb_raw_transfer_io *ep_queue_slot(struct ep_queue *queue, int slot) {
+	return ep_pool_slot(&queue->data, slot);
+}
+
+void ep_queue_publish(struct ep_queue *queue, int slot) {
+	queue->data.stamps[slot] = ep_queue_now();
+	// The full ring is as large as the pool, so this cannot fail.
+	ep_index_ring_push(&queue->data.full, slot);
+	ep_queue_signal(queue);
+}
+
+// Gives an acquired slot back without publishing it. The producer gets it
+// again from one of its next ep_queue_acquire() calls.
+void ep_queue_cancel(struct ep_queue *queue, int slot) {
+	struct ep_pool *pool = &queue->data;
+	assert(pool->num_spares < pool->num_slots);
+	pool->spares[pool->num_spares++] = slot;
+}
+
+struct usb_raw_transfer_io *ep_queue_inject_claim(struct ep_queue *queue, uint32_t *ticket) {
+	struct ep_mpsc_ring *ring = &queue->inject;
+	uint32_t pos = ring->tail.load(std::memory_order_relaxed);
+	struct ep_mpsc_cell *cell;
+
+	while (true) {
+		cell = &ring->cells[pos & ring->mask];
+		uint32_t seq = cell->seq.load(std::memory_order_acquire);
+		int32_t diff = (int32_t)(seq - pos);
+		if (diff == 0) {
+			if (ring->tail.compare_exchange_weak(pos, pos + 1,
+					std::memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0) {
+			ring->overflows.fetch_add(1, std::memory_order_relaxed);
+			return NULL;
+		}
+		else {
+			pos = ring->tail.load(std::memory_order_relaxed);
+		}
+	}
+
+	*ticket = pos;
+	cell->ack = 0;
+	return &cell->io;
+}
+
+void ep_queue_inject_commit(struct ep_queue *queue, uint32_t ticket, bool signal) {
+	struct ep_mpsc_ring *ring = &queue->inject;
+	struct ep_mpsc_cell *cell = &ring->cells[ticket & ring->mask];
+	cell->stamp = ep_queue_now();
+	cell->seq.store(ticket + 1, std::memory_order_release);
+	if (signal)
+		ep_queue_signal(queue);
+}
+
+void ep_queue_inject_tag(struct ep_queue *queue, uint32_t ticket, uint32_t ack) {
+	struct ep_mpsc_ring *ring = &queue->inject;
+	ring->cells[ticket & ring->mask].ack = ack;
+}
+
+bool ep_queue_inject(struct ep_queue *queue, const struct usb_raw_transfer_io &io) {
+	uint32_t ticket;
+	struct usb_raw_transfer_io *cell = ep_queue_inject_claim(queue, &ticket);
+	if (!cell)
+		return false;
+	memcpy(cell, &io, sizeof(io.inner) + io.inner.length);
+	ep_queue_inject_commit(queue, ticket, true);
+	return true;
+}
+
+/*----------------------------------------------------------------------*/
+
+static struct usb_raw_transfer_io *ep_pool_front(struct ep_pool *pool, uint64_t *stamp) {
+	uint32_t slot;
+	if (!ep_index_ring_peek(&pool->full, &slot))
+		return NULL;
+	*stamp = pool->stamps[slot];
+	return ep_pool_slot(pool, slot);
+}
+
+static void ep_pool_pop_front(struct ep_pool *pool) {
+	uint32_t slot;
+	if (!ep_index_ring_peek(&pool->full, &slot))
+		return;
+	ep_index_ring_drop(&pool->full);
+	ep_index_ring_push(&pool->free, slot);
+}
+
+static struct usb_raw_transfer_io *ep_mpsc_ring_front(struct ep_mpsc_ring *ring, uint64_t *stamp) {
+	uint32_t pos = ring->head.load(std::memory_order_relaxed);
+	struct ep_mpsc_cell *cell = &ring->cells[pos & ring->mask];
+	uint32_t seq = cell->seq.load(std::memory_order_acquire);
+
+	if ((int32_t)(seq - (pos + 1)) < 0)
+		return NULL;
+	*stamp = cell->stamp;
+	return &cell->io;
+}
+
+static void ep_mpsc_ring_pop_front(struct ep_mpsc_ring *ring) {
+	uint32_t pos = ring->head.load(std::memory_order_relaxed);
+	struct ep_mpsc_cell *cell = &ring->cells[pos & ring->mask];
+	cell->seq.store(pos + ring->mask + 1, std::memory_order_release);
+	ring->head.store(pos + 1, std::memory_order_relaxed);
+}
+
+static struct usb_raw_transfer_io *ep_queue_lane_front(struct ep_queue *queue, int lane,
+						uint64_t *stamp) {
+	if (lane == 0)
+		return ep_pool_front(&queue->data, stamp);
+	return ep_mpsc_ring_front(&queue->inject, stamp);
+}
+
+// Drops the real transfers that were published before an injected one
+// that is waiting.
+static void ep_queue_drop_older_real(struct ep_queue *queue, uint64_t inject_stamp) {
+	uint64_t stamp;
+	while (ep_pool_front(&queue->data, &stamp) && stamp < inject_stamp) {
+		ep_pool_pop_front(&queue->data);
+		queue->lanes[0].dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+struct usb_raw_transfer_io *ep_queue_front(struct ep_queue *queue) {
+	struct usb_raw_transfer_io *io = NULL;
+	uint64_t stamp = 0;
+	int lane = -1;
+
+	if (queue->policy == EP_QUEUE_INTERLEAVE) {
+		// Alternate between the lanes so that neither a burst of device
+		// traffic nor a flood of injections can starve the other one.
+		for (int i = 0; i < 2 && !io; i++) {
+			lane = queue->next_lane;
+			queue->next_lane ^= 1;
+			io = ep_queue_lane_front(queue, lane, &stamp);
+		}
+	}
+	else {
+		lane = 1;
+		io = ep_queue_lane_front(queue, lane, &stamp);
+		if (io && queue->policy == EP_QUEUE_DROP_OLDEST_REAL)
+			ep_queue_drop_older_real(queue, stamp);
+		if (!io) {
+			lane = 0;
+			io = ep_queue_lane_front(queue, lane, &stamp);
+		}
+	}
+	if (!io)
+		return NULL;
+
+	struct ep_lane_stats *stats = &queue->lanes[lane];
+	uint32_t depth = ep_queue_lane_size(queue, lane);
+	if (depth > stats->max_depth.load(std::memory_order_relaxed))
+		stats->max_depth.store(depth, std::memory_order_relaxed);
+
+	queue->front_lane = lane;
+	queue->front_ack = 0;
+	if (lane == 1) {
+		struct ep_mpsc_ring *ring = &queue->inject;
+		uint32_t pos = ring->head.load(std::memory_order_relaxed);
+		queue->front_ack = ring->cells[pos & ring->mask].ack;
+	}
+	queue->front_length = io->inner.length;
+	queue->front_wait = ep_queue_now() - stamp;
+	return io;
+}
+
+void ep_queue_pop_front(struct ep_queue *queue) {
+	assert(queue->front_lane >= 0);
+	if (queue->front_lane == 0)
+		ep_pool_pop_front(&queue->data);
+	else
+		ep_mpsc_ring_pop_front(&queue->inject);
+
+	// The stats reporter resets the maxima, so one may be lost now and
+	// then; the counters are only informational.
+	struct ep_lane_stats *stats = &queue->lanes[queue->front_lane];
+	stats->transfers.fetch_add(1, std::memory_order_relaxed);
+	stats->wait_ns.fetch_add(queue->front_wait, std::memory_order_relaxed);
+	if (queue->front_wait > stats->max_wait_ns.load(std::memory_order_relaxed))
+		stats->max_wait_ns.store(queue->front_wait, std::memory_order_relaxed);
+
+	queue->front_lane = -1;
+	queue->bytes.fetch_add(queue->front_length, std::memory_order_relaxed);
+}
+
+/*----------------------------------------------------------------------*/
+
+// Announces that the consumer is about to sleep on wake_fd and rechecks
+// the lanes, so a producer that published in between either sees the flag
+// or its transfer is seen here. Returns false if there is work already.
+bool ep_queue_arm(struct ep_queue *queue) {
+	queue->waiting.store(true, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (ep_queue_size(queue) > 0) {
+		queue->waiting.store(false, std::memory_order_relaxed);
+		return false;
+	}
+	return true;
+}
+
+bool ep_queue_arm_lane(struct ep_queue *queue, int lane) {
+	queue->waiting.store(true, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (ep_queue_lane_size(queue, lane) > 0) {
+		queue->waiting.store(false, std::memory_order_relaxed);
+		return false;
+	}
+	return true;
+}
+
+void ep_queue_disarm(struct ep_queue *queue) {
+	queue->waiting.store(false, std::memory_order_relaxed);
+}
+
+// Consumes a wakeup from an armed queue. Blocks until a producer signals
+// unless wake_fd is known to be readable.
+void ep_queue_ack(struct ep_queue *queue) {
+	uint64_t value;
+	int rv = read(queue->wake_fd, &value, sizeof(value));
+	queue->waiting.store(false, std::memory_order_relaxed);
+	if (rv < 0 && errno != EINTR) {
+		perror("read() eventfd");
+		exit(EXIT_FAILURE);
+	}
+
+	queue->wakeups.fetch_add(1, std::memory_order_relaxed);
+	if (ep_queue_size(queue) == 0)
+		queue->idle_wakeups.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ep_queue_wait(struct ep_queue *queue) {
+	if (ep_queue_arm(queue))
+		ep_queue_ack(queue);
+}
+
+void ep_queue_signal(struct ep_queue *queue) {
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (!queue->waiting.load(std::memory_order_relaxed))
+		return;
+	ep_queue_wake(queue);
+}
+
+void ep_queue_wake(struct ep_queue *queue) {
+	uint64_t value = 1;
+	if (write(queue->wake_fd, &value, sizeof(value)) < 0) {
+		perror("write() eventfd");
+		exit(EXIT_FAILURE);
+	}
+	queue->signals.fetch_add(1, std::memory_order_relaxed);
+}
+
+/*----------------------------------------------------------------------*/
+
+unsigned int ep_queue_lane_size(struct ep_queue *queue, int lane) {
+	if (lane == 0)
+		return ep_index_ring_size(&queue->data.full);
+	return queue->inject.tail.load(std::memory_order_acquire) -
+		queue->inject.head.load(std::memory_order_acquire);
+}
+
+unsigned int ep_queue_size(struct ep_queue *queue) {
+	return ep_queue_lane_size(queue, 0) + ep_queue_lane_size(queue, 1);
+}
+
+uint64_t ep_queue_overflows(struct ep_queue *queue) {
+	return queue->data.overflows.load(std::memory_order_relaxed) +
+		queue->inject.overflows.load(std::memory_order_relaxed);
+}
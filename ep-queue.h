@@ -0,0 +1,164 @@
+#ifndef EP_QUEUE_H
+#define EP_QUEUE_H
+
+#include <atomic>
+#include <stdint.h>
+
+#include "host-raw-gadget.h"
+
+/*----------------------------------------------------------------------*/
+
+// Number of transfers each lane can hold. Must be a power of two.
+#define EP_QUEUE_CAPACITY	32
+
+#define EP_QUEUE_CACHELINE	64
+
+// How the writer picks between a real and an injected transfer when both
+// lanes have one queued.
+enum ep_queue_policy {
+	EP_QUEUE_INTERLEAVE,		// alternate between the lanes
+	EP_QUEUE_PRIORITY,		// injected transfers always go first
+	EP_QUEUE_DROP_OLDEST_REAL,	// same, and real transfers queued before
+					// a waiting injection are dropped
+};
+
+// Applies to queues created afterwards.
+extern int ep_queue_policy;
+
+// Single-producer/single-consumer ring of slot indices. head is only
+// written by the consumer and tail only by the producer, each on its own
+// cache line.
+struct ep_index_ring {
+	alignas(EP_QUEUE_CACHELINE) std::atomic<uint32_t>	head;
+	alignas(EP_QUEUE_CACHELINE) std::atomic<uint32_t>	tail;
+	uint32_t						mask;
+	uint32_t						*entries;
+};
+
+// Data lane carrying device-originated transfers (ep_loop_read ->
+// ep_loop_write). The producer fills a pooled slot in place, libusb and
+// Raw Gadget read straight into it, and hands the slot index to the writer
+// through full. The writer sends the slot as is and gives the index back
+// through free. No transfer is ever copied or allocated on the way.
+//
+// Slots are laid out stride bytes apart and hold a usb_raw_ep_io header
+// followed by slot_size bytes of data, which may be more than the
+// MAX_TRANSFER_SIZE that usb_raw_transfer_io declares.
+struct ep_pool {
+	uint8_t							*arena;
+	size_t							stride;
+	unsigned int						slot_size;
+	unsigned int						num_slots;
+	struct ep_index_ring					full;
+	struct ep_index_ring					free;
+	uint32_t						*spares;
+	unsigned int						num_spares;
+	uint64_t						*stamps;
+	alignas(EP_QUEUE_CACHELINE) std::atomic<uint64_t>	overflows;
+};
+
+struct ep_mpsc_cell {
+	std::atomic<uint32_t>		seq;
+	uint64_t			stamp;
+	uint32_t			ack;
+	struct usb_raw_transfer_io	io;
+};
+
+// Bounded multi-producer/single-consumer ring for injected transfers.
+// Producers (UDP server and friends) claim a cell by advancing tail with
+// a CAS; each cell carries a sequence number that tells the consumer when
+// the payload has been published.
+struct ep_mpsc_ring {
+	alignas(EP_QUEUE_CACHELINE) std::atomic<uint32_t>	head;
+	alignas(EP_QUEUE_CACHELINE) std::atomic<uint32_t>	tail;
+	alignas(EP_QUEUE_CACHELINE) std::atomic<uint64_t>	overflows;
+	uint32_t						mask;
+	struct ep_mpsc_cell					*cells;
+};
+
+// Counters of one lane, updated by the consumer. Wait times run from when
+// a transfer is published to when the writer picks it, in nanoseconds.
+struct ep_lane_stats {
+	std::atomic<uint64_t>	transfers;
+	std::atomic<uint64_t>	wait_ns;
+	std::atomic<uint64_t>	max_wait_ns;
+	std::atomic<uint32_t>	max_depth;
+	std::atomic<uint64_t>	dropped;
+};
+
+// Per-endpoint transfer queue: one lane for the proxied data path and one
+// for injected packets. The writer thread is the only consumer of both.
+//
+// When both lanes are empty the writer blocks on wake_fd (an eventfd).
+// Producers only signal it while the writer has announced itself as
+// waiting, so a busy endpoint does not pay a syscall per packet.
+struct ep_queue {
+	struct ep_pool		data;
+	struct ep_mpsc_ring	inject;
+	int			policy;
+	unsigned int		next_lane;
+	int			front_lane;
+	uint32_t		front_ack;
+	uint32_t		front_length;
+	uint64_t		front_wait;
+	struct ep_lane_stats	lanes[2];
+
+	int						wake_fd;
+	alignas(EP_QUEUE_CACHELINE) std::atomic<bool>	waiting;
+	std::atomic<uint64_t>				wakeups;
+	std::atomic<uint64_t>				idle_wakeups;
+	std::atomic<uint64_t>				signals;
+	std::atomic<uint64_t>				bytes;
+};
+
+/*----------------------------------------------------------------------*/
+
+// capacity is the depth of each lane; reserve adds data slots for the
+// transfers a producer keeps in flight on top of what is queued. Data
+// slots hold slot_size bytes; injected transfers MAX_TRANSFER_SIZE.
+struct ep_queue *ep_queue_create(unsigned int capacity, unsigned int reserve,
+				unsigned int slot_size);
+void ep_queue_destroy(struct ep_queue *queue);
+
+// Data lane, producer side.
+int ep_queue_acquire(struct ep_queue *queue);
+struct usb_raw_transfer_io *ep_queue_slot(struct ep_queue *queue, int slot);
+void ep_queue_publish(struct ep_queue *queue, int slot);
+void ep_queue_cancel(struct ep_queue *queue, int slot);
+// Counts a packet the producer threw away because acquire() found no free
+// slot. A producer that retries later loses nothing and does not count.
+void ep_queue_overflow(struct ep_queue *queue);
+
+// Injection lane, any thread. claim() reserves a cell and returns it to be
+// filled in place (NULL if the lane is full); the cell must then be handed
+// to commit(), as the consumer takes cells strictly in order. A producer
+// committing a batch can pass signal = false and call ep_queue_signal()
+// once at the end.
+bool ep_queue_inject(struct ep_queue *queue, const struct usb_raw_transfer_io &io);
+struct usb_raw_transfer_io *ep_queue_inject_claim(struct ep_queue *queue, uint32_t *ticket);
+void ep_queue_inject_commit(struct ep_queue *queue, uint32_t ticket, bool signal);
+// Between claim() and commit(): the delivery acknowledgement (see
+// inject-ack.h) the writer completes once the cell is sent; front_ack
+// holds it while the cell is at the front.
+void ep_queue_inject_tag(struct ep_queue *queue, uint32_t ticket, uint32_t ack);
+
+// Consumer side: front() picks the next transfer from either lane and
+// returns it in place, pop_front() hands its storage back.
+struct usb_raw_transfer_io *ep_queue_front(struct ep_queue *queue);
+void ep_queue_pop_front(struct ep_queue *queue);
+
+void ep_queue_wait(struct ep_queue *queue);
+// The steps of ep_queue_wait(), for a consumer that polls wake_fd itself.
+bool ep_queue_arm(struct ep_queue *queue);
+// As arm(), but only transfers in lane keep it from arming.
+bool ep_queue_arm_lane(struct ep_queue *queue, int lane);
+void ep_queue_disarm(struct ep_queue *queue);
+void ep_queue_ack(struct ep_queue *queue);
+void ep_queue_signal(struct ep_queue *queue);
+void ep_queue_wake(struct ep_queue *queue);
+
+unsigned int ep_queue_size(struct ep_queue *queue);
+unsigned int ep_queue_lane_size(struct ep_queue *queue, int lane);
+uint64_t ep_queue_overflows(struct ep_queue *queue);
+
+#endif // EP_QUEUE_H
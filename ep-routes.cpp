@@ -0,0 +1,100 @@
+#include "ep-routes.h"
+
+std::atomic<struct ep_route_table *> ep_routes(NULL);
+struct rcu_domain ep_routes_rcu;
+
+static int ep_route_index(int address) {
+	return (address & USB_ENDPOINT_NUMBER_MASK) | ((address & USB_DIR_IN) ? 16 : 0);
+}
+
+static bool ep_route_is_int_in(const struct ep_route *route) {
+	return route->queue && route->type == USB_ENDPOINT_XFER_INT &&
+		(route->address & USB_DIR_IN);
+}
+
+static void ep_routes_find_roles(struct ep_route_table *table) {
+	int fallback = -1;
+
+	table->mouse = -1;
+	table->keyboard = -1;
+	for (int i = 0; i < 32; i++) {
+		const struct ep_route *route = &table->routes[i];
+		if (!ep_route_is_int_in(route))
+			continue;
+		if (route->role == EP_ROLE_MOUSE && table->mouse < 0)
+			table->mouse = route->address;
+		else if (route->role == EP_ROLE_KEYBOARD && table->keyboard < 0)
+			table->keyboard = route->address;
+		if (fallback < 0)
+			fallback = route->address;
+	}
+	if (table->mouse < 0)
+		table->mouse = fallback;
+}
+
+static struct ep_route_table *ep_routes_copy() {
+	struct ep_route_table *table = new struct ep_route_table;
+	struct ep_route_table *old = ep_routes.load();
+	if (old)
+		*table = *old;
+	else
+		memset(table, 0, sizeof(*table));
+	return table;
+}
+
+static void ep_routes_publish(struct ep_route_table *table) {
+	ep_routes_find_roles(table);
+	struct ep_route_table *old = ep_routes.exchange(table);
+	rcu_synchronize(&ep_routes_rcu);
+	delete old;
+}
+
+void ep_routes_add(struct raw_gadget_altsetting *alt) {
+	struct ep_route_table *table = ep_routes_copy();
+
+	// HID boot protocol: 1 is a keyboard, 2 a mouse.
+	int role = EP_ROLE_NONE;
+	if (alt->interface.bInterfaceClass == USB_CLASS_HID) {
+		if (alt->interface.bInterfaceProtocol == 1)
+			role = EP_ROLE_KEYBOARD;
+		else if (alt->interface.bInterfaceProtocol == 2)
+			role = EP_ROLE_MOUSE;
+	}
+
+	for (int i = 0; i < alt->interface.bNumEndpoints; i++) {
+		struct raw_gadget_endpoint *ep = &alt->endpoints[i];
+		struct ep_route *route = &table->routes[ep_route_index(ep->endpoint.bEndpointAddress)];
+		route->queue = ep->thread_info.data_queue;
+		route->fusion = ep->thread_info.fusion;
+		route->poll = ep->thread_info.poll;
+		route->keys = ep->thread_info.keys;
+		route->ep_num = ep->thread_info.ep_num;
+		route->interface = alt->interface.bInterfaceNumber;
+		route->address = ep->endpoint.bEndpointAddress;
+		route->type = usb_endpoint_type(&ep->endpoint);
+		route->role = role;
+	}
+
+	ep_routes_publish(table);
+}
+
+void ep_routes_remove(struct raw_gadget_altsetting *alt) {
+	struct ep_route_table *table = ep_routes_copy();
+
+	for (int i = 0; i < alt->interface.bNumEndpoints; i++) {
+		struct raw_gadget_endpoint *ep = &alt->endpoints[i];
+		memset(&table->routes[ep_route_index(ep->endpoint.bEndpointAddress)], 0,
+			sizeof(struct ep_route));
+	}
+
+	ep_routes_publish(table);
+}
+
+const struct ep_route *ep_route_lookup(const struct ep_route_table *table, int address) {
+	if (!table)
+		return NULL;
+	const struct ep_route *route = &table->routes[ep_route_index(address)];
+	if (!route->queue || route->address != address)
+		return NULL;
+	return route;
+}
@@ -0,0 +1,59 @@
+#ifndef EP_ROUTES_H
+#define EP_ROUTES_H
+
+#include <atomic>
+#include <stdint.h>
+
+#include "host-raw-gadget.h"
+#include "rcu.h"
+
+struct ep_queue;
+struct fusion_state;
+struct poll_estimator;
+struct key_state;
+
+enum ep_role {
+	EP_ROLE_NONE,
+	EP_ROLE_MOUSE,
+	EP_ROLE_KEYBOARD,
+};
+
+// Where transfers injected into an active endpoint go.
+struct ep_route {
+	struct ep_queue		*queue;
+	struct fusion_state	*fusion;
+	struct poll_estimator	*poll;
+	struct key_state	*keys;
+	int			ep_num;
+	// bInterfaceNumber, for hid_codec_get()
+	uint8_t			interface;
+	uint8_t			address;
+	uint8_t			type;
+	uint8_t			role;
+};
+
+// Active endpoints indexed by ep_route_index(); unused entries have no
+// queue. mouse and keyboard are the addresses of the interrupt IN endpoint
+// of the respective HID interface, -1 if there is none. Without a HID
+// mouse, the first interrupt IN endpoint stands in for it.
+struct ep_route_table {
+	struct ep_route		routes[32];
+	int			mouse;
+	int			keyboard;
+};
+
+// Rebuilt by ep0 whenever endpoints are enabled or disabled (on
+// SET_CONFIGURATION, SET_INTERFACE and reset). Injectors look routes up
+// between rcu_read_lock() and rcu_read_unlock() on ep_routes_rcu and may
+// use a route's queue until they unlock.
+extern std::atomic<struct ep_route_table *> ep_routes;
+extern struct rcu_domain ep_routes_rcu;
+
+// Called by ep0 once the endpoints of alt run, and before they are torn
+// down; ep_routes_remove() returns once no injector can reach them.
+void ep_routes_add(struct raw_gadget_altsetting *alt);
+void ep_routes_remove(struct raw_gadget_altsetting *alt);
+
+const struct ep_route *ep_route_lookup(const struct ep_route_table *table, int address);
+
+#endif // EP_ROUTES_H
@@ -0,0 +1,416 @@
+#include <time.h>
+#include <map>
+
+#include "filter.h"
+
+struct filter_mnemonic {
+	const char	*name;
+	int		code;
+};
+
+// Mnemonics whose operand decides the opcode (ld, ldx) are handled apart.
+static const struct filter_mnemonic filter_mnemonics[] = {
+	{"ldb", FILTER_LD_B},
+	{"ldh", FILTER_LD_H},
+	{"ldsb", FILTER_LD_SB},
+	{"ldsh", FILTER_LD_SH},
+	{"tax", FILTER_TAX},
+	{"txa", FILTER_TXA},
+	{"st", FILTER_ST},
+	{"stx", FILTER_STX},
+	{"stb", FILTER_STB},
+	{"sth", FILTER_STH},
+	{"add", FILTER_ADD},
+	{"sub", FILTER_SUB},
+	{"mul", FILTER_MUL},
+	{"div", FILTER_DIV},
+	{"mod", FILTER_MOD},
+	{"and", FILTER_AND},
+	{"or", FILTER_OR},
+	{"xor", FILTER_XOR},
+	{"lsh", FILTER_LSH},
+	{"rsh", FILTER_RSH},
+	{"neg", FILTER_NEG},
+	{"ja", FILTER_JA},
+	{"jeq", FILTER_JEQ},
+	{"jne", FILTER_JNE},
+	{"jgt", FILTER_JGT},
+	{"jge", FILTER_JGE},
+	{"jlt", FILTER_JLT},
+	{"jle", FILTER_JLE},
+	{"jsgt", FILTER_JSGT},
+	{"jsge", FILTER_JSGE},
+	{"jslt", FILTER_JSLT},
+	{"jsle", FILTER_JSLE},
+	{"jset", FILTER_JSET},
+	{"accept", FILTER_ACCEPT},
+	{"drop", FILTER_DROP},
+};
+
+static std::string filter_trim(const std::string &s) {
+	size_t start = s.find_first_not_of(" \t");
+	if (start == std::string::npos)
+		return "";
+	size_t end = s.find_last_not_of(" \t");
+	return s.substr(start, end - start + 1);
+}
+
+static bool filter_number(const std::string &s, uint32_t *value) {
+	if (s.empty())
+		return false;
+	char *end;
+	long long n = strtoll(s.c_str(), &end, 0);
+	if (*end != '\0' || n < INT32_MIN || n > UINT32_MAX)
+		return false;
+	*value = (uint32_t)n;
+	return true;
+}
+
+// Parses "[k]" into k, or "M[k]" if memory is set.
+static bool filter_address(const std::string &s, bool memory, uint32_t *k) {
+	std::string prefix = memory ? "M[" : "[";
+	if (s.compare(0, prefix.length(), prefix) != 0 || s.back() != ']')
+		return false;
+	return filter_number(s.substr(prefix.length(), s.length() - prefix.length() - 1), k);
+}
+
+// Parses the source operand of an ALU op or conditional jump: #k or x.
+static bool filter_source(const std::string &s, struct filter_insn *insn) {
+	if (s == "x") {
+		insn->src_x = 1;
+		return true;
+	}
+	return s.length() > 1 && s[0] == '#' && filter_number(s.substr(1), &insn->k);
+}
+
+static bool filter_assemble(const std::string &text, const std::map<std::string, int> &labels,
+			struct filter_insn *insn) {
+	std::string mnemonic = text, operand;
+	size_t space = text.find_first_of(" \t");
+	if (space != std::string::npos) {
+		mnemonic = text.substr(0, space);
+		operand = filter_trim(text.substr(space));
+	}
+
+	memset(insn, 0, sizeof(*insn));
+
+	if (mnemonic == "ld" || mnemonic == "ldx") {
+		bool x = mnemonic == "ldx";
+		if (operand.length() > 1 && operand[0] == '#') {
+			insn->code = x ? FILTER_LDX_IMM : FILTER_LD_IMM;
+			return filter_number(operand.substr(1), &insn->k);
+		}
+		if (operand == "len") {
+			insn->code = x ? FILTER_LDX_LEN : FILTER_LD_LEN;
+			return true;
+		}
+		if (operand[0] == 'M') {
+			insn->code = x ? FILTER_LDX_MEM : FILTER_LD_MEM;
+			return filter_address(operand, true, &insn->k);
+		}
+		if (x)
+			return false;
+		if (operand == "now") {
+			insn->code = FILTER_LD_NOW;
+			return true;
+		}
+		if (operand == "hash") {
+			insn->code = FILTER_LD_HASH;
+			return true;
+		}
+		insn->code = FILTER_LD_W;
+		return filter_address(operand, false, &insn->k);
+	}
+
+	insn->code = 0xff;
+	for (unsigned int i = 0; i < sizeof(filter_mnemonics) / sizeof(filter_mnemonics[0]); i++) {
+		if (mnemonic == filter_mnemonics[i].name)
+			insn->code = filter_mnemonics[i].code;
+	}
+
+	switch (insn->code) {
+	case FILTER_LD_B:
+	case FILTER_LD_H:
+	case FILTER_LD_SB:
+	case FILTER_LD_SH:
+	case FILTER_STB:
+	case FILTER_STH:
+		return filter_address(operand, false, &insn->k);
+	case FILTER_ST:
+	case FILTER_STX:
+		return filter_address(operand, true, &insn->k);
+	case FILTER_TAX:
+	case FILTER_TXA:
+	case FILTER_NEG:
+	case FILTER_ACCEPT:
+	case FILTER_DROP:
+		return operand.empty();
+	case FILTER_JA: {
+		auto it = labels.find(operand);
+		if (it == labels.end())
+			return false;
+		insn->jump = it->second;
+		return true;
+	}
+	case 0xff:
+		return false;
+	}
+
+	if (insn->code >= FILTER_JEQ && insn->code <= FILTER_JSET) {
+		size_t comma = operand.find(',');
+		if (comma == std::string::npos)
+			return false;
+		auto it = labels.find(filter_trim(operand.substr(comma + 1)));
+		if (it == labels.end())
+			return false;
+		insn->jump = it->second;
+		return filter_source(filter_trim(operand.substr(0, comma)), insn);
+	}
+
+	return filter_source(operand, insn);
+}
+
+// Checks what the interpreter relies on: every jump goes forward and stays
+// inside the program, the last instruction returns, memory indexes are in
+// range, and constant divisors and shifts are valid.
+static bool filter_verify(const struct filter_insn *insn, int pc, int n) {
+	if (pc == n - 1 && insn->code != FILTER_ACCEPT && insn->code != FILTER_DROP)
+		return false;
+
+	switch (insn->code) {
+	case FILTER_LD_MEM:
+	case FILTER_LDX_MEM:
+	case FILTER_ST:
+	case FILTER_STX:
+		return insn->k < FILTER_MEMORY_WORDS;
+	case FILTER_DIV:
+	case FILTER_MOD:
+		return insn->src_x || insn->k != 0;
+	case FILTER_LSH:
+	case FILTER_RSH:
+		return insn->src_x || insn->k < 32;
+	}
+	if (insn->code >= FILTER_JA && insn->code <= FILTER_JSET)
+		return insn->jump > pc && insn->jump < n;
+	return true;
+}
+
+bool filter_compile(const Json::Value &program, struct filter *filter) {
+	std::map<std::string, int> labels;
+	std::vector<std::string> texts;
+
+	filter->insns.clear();
+	memset(filter->memory, 0, sizeof(filter->memory));
+
+	if (!program.isArray() || program.size() == 0 || program.size() > FILTER_MAX_INSNS) {
+		printf("Filter must be a list of 1 to %d instructions\n", FILTER_MAX_INSNS);
+		return false;
+	}
+
+	for (unsigned int i = 0; i < program.size(); i++) {
+		std::string text = filter_trim(program[i].asString());
+		size_t colon = text.find(':');
+		if (colon != std::string::npos) {
+			labels[filter_trim(text.substr(0, colon))] = i;
+			text = filter_trim(text.substr(colon + 1));
+		}
+		texts.push_back(text);
+	}
+
+	for (unsigned int i = 0; i < texts.size(); i++) {
+		struct filter_insn insn;
+		if (!filter_assemble(texts[i], labels, &insn)) {
+			printf("Filter instruction %u: cannot parse \"%s\"\n", i, texts[i].c_str());
+			filter->insns.clear();
+			return false;
+		}
+		if (!filter_verify(&insn, i, texts.size())) {
+			printf("Filter instruction %u: \"%s\" rejected (bad operand, backward jump "
+				"or missing accept/drop at the end)\n", i, texts[i].c_str());
+			filter->insns.clear();
+			return false;
+		}
+		filter->insns.push_back(insn);
+	}
+	return true;
+}
+
+/*----------------------------------------------------------------------*/
+
+static uint32_t filter_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+// FNV-1a, to compare whole reports through a single word.
+static uint32_t filter_hash(const uint8_t *data, uint32_t length) {
+	uint32_t hash = 2166136261u;
+	for (uint32_t i = 0; i < length; i++) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+bool filter_run(struct filter *filter, uint8_t *data, uint32_t length) {
+	const struct filter_insn *insns = filter->insns.data();
+	int n = filter->insns.size();
+	uint32_t a = 0, x = 0;
+
+	for (int pc = 0; pc < n; pc++) {
+		const struct filter_insn *insn = &insns[pc];
+		uint32_t src = insn->src_x ? x : insn->k;
+		bool taken = false;
+
+		switch (insn->code) {
+		case FILTER_LD_IMM:
+			a = insn->k;
+			break;
+		case FILTER_LD_B:
+		case FILTER_LD_SB:
+			if (insn->k >= length)
+				return true;
+			a = data[insn->k];
+			if (insn->code == FILTER_LD_SB)
+				a = (int8_t)a;
+			break;
+		case FILTER_LD_H:
+		case FILTER_LD_SH:
+			if (insn->k + 2 > length || insn->k + 2 < insn->k)
+				return true;
+			a = data[insn->k] | data[insn->k + 1] << 8;
+			if (insn->code == FILTER_LD_SH)
+				a = (int16_t)a;
+			break;
+		case FILTER_LD_W:
+			if (insn->k + 4 > length || insn->k + 4 < insn->k)
+				return true;
+			a = data[insn->k] | data[insn->k + 1] << 8 |
+				data[insn->k + 2] << 16 | (uint32_t)data[insn->k + 3] << 24;
+			break;
+		case FILTER_LD_LEN:
+			a = length;
+			break;
+		case FILTER_LD_MEM:
+			a = filter->memory[insn->k];
+			break;
+		case FILTER_LD_NOW:
+			a = filter_now();
+			break;
+		case FILTER_LD_HASH:
+			a = filter_hash(data, length);
+			break;
+		case FILTER_LDX_IMM:
+			x = insn->k;
+			break;
+		case FILTER_LDX_MEM:
+			x = filter->memory[insn->k];
+			break;
+		case FILTER_LDX_LEN:
+			x = length;
+			break;
+		case FILTER_TAX:
+			x = a;
+			break;
+		case FILTER_TXA:
+			a = x;
+			break;
+		case FILTER_ST:
+			filter->memory[insn->k] = a;
+			break;
+		case FILTER_STX:
+			filter->memory[insn->k] = x;
+			break;
+		case FILTER_STB:
+			if (insn->k < length)
+				data[insn->k] = a;
+			break;
+		case FILTER_STH:
+			if (insn->k + 2 <= length && insn->k + 2 > insn->k) {
+				data[insn->k] = a;
+				data[insn->k + 1] = a >> 8;
+			}
+			break;
+		case FILTER_ADD:
+			a += src;
+			break;
+		case FILTER_SUB:
+			a -= src;
+			break;
+		case FILTER_MUL:
+			a *= src;
+			break;
+		case FILTER_DIV:
+			a = src ? a / src : 0;
+			break;
+		case FILTER_MOD:
+			a = src ? a % src : 0;
+			break;
+		case FILTER_AND:
+			a &= src;
+			break;
+		case FILTER_OR:
+			a |= src;
+			break;
+		case FILTER_XOR:
+			a ^= src;
+			break;
+		case FILTER_LSH:
+			a = src < 32 ? a << src : 0;
+			break;
+		case FILTER_RSH:
+			a = src < 32 ? a >> src : 0;
+			break;
+		case FILTER_NEG:
+			a = -a;
+			break;
+		case FILTER_JA:
+			taken = true;
+			break;
+		case FILTER_JEQ:
+			taken = a == src;
+			break;
+		case FILTER_JNE:
+			taken = a != src;
+			break;
+		case FILTER_JGT:
+			taken = a > src;
+			break;
+		case FILTER_JGE:
+			taken = a >= src;
+			break;
+		case FILTER_JLT:
+			taken = a < src;
+			break;
+		case FILTER_JLE:
+			taken = a <= src;
+			break;
+		case FILTER_JSGT:
+			taken = (int32_t)a > (int32_t)src;
+			break;
+		case FILTER_JSGE:
+			taken = (int32_t)a >= (int32_t)src;
+			break;
+		case FILTER_JSLT:
+			taken = (int32_t)a < (int32_t)src;
+			break;
+		case FILTER_JSLE:
+			taken = (int32_t)a <= (int32_t)src;
+			break;
+		case FILTER_JSET:
+			taken = (a & src) != 0;
+			break;
+		case FILTER_ACCEPT:
+			return true;
+		case FILTER_DROP:
+			return false;
+		}
+
+		if (taken)
+			pc = insn->jump - 1;
+	}
+
+	// Not reached for verified programs.
+	return true;
+}
@@ -0,0 +1,91 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <jsoncpp/json/json.h>
+
+// Longest program accepted. Jumps only go forward, so no packet ever runs
+// more instructions than this.
+#define FILTER_MAX_INSNS	256
+
+// Scratch words M[0..15]. They keep their values from one packet to the
+// next, e.g. to remember the previous report.
+#define FILTER_MEMORY_WORDS	16
+
+enum filter_code {
+	FILTER_LD_IMM,
+	FILTER_LD_B,
+	FILTER_LD_H,
+	FILTER_LD_W,
+	FILTER_LD_SB,
+	FILTER_LD_SH,
+	FILTER_LD_LEN,
+	FILTER_LD_MEM,
+	FILTER_LD_NOW,
+	FILTER_LD_HASH,
+	FILTER_LDX_IMM,
+	FILTER_LDX_MEM,
+	FILTER_LDX_LEN,
+	FILTER_TAX,
+	FILTER_TXA,
+	FILTER_ST,
+	FILTER_STX,
+	FILTER_STB,
+	FILTER_STH,
+	FILTER_ADD,
+	FILTER_SUB,
+	FILTER_MUL,
+	FILTER_DIV,
+	FILTER_MOD,
+	FILTER_AND,
+	FILTER_OR,
+	FILTER_XOR,
+	FILTER_LSH,
+	FILTER_RSH,
+	FILTER_NEG,
+	FILTER_JA,
+	FILTER_JEQ,
+	FILTER_JNE,
+	FILTER_JGT,
+	FILTER_JGE,
+	FILTER_JLT,
+	FILTER_JLE,
+	FILTER_JSGT,
+	FILTER_JSGE,
+	FILTER_JSLT,
+	FILTER_JSLE,
+	FILTER_JSET,
+	FILTER_ACCEPT,
+	FILTER_DROP,
+};
+
+// src_x selects X instead of k as the operand of ALU ops and conditional
+// jumps. jump is the index of the instruction a taken jump continues at.
+struct filter_insn {
+	uint8_t		code;
+	uint8_t		src_x;
+	uint16_t	jump;
+	uint32_t	k;
+};
+
+// A BPF-style program with an accumulator A and an index register X, all
+// 32-bit. Packet loads and stores are little-endian at absolute offsets.
+struct filter {
+	std::vector<struct filter_insn>	insns;
+	uint32_t			memory[FILTER_MEMORY_WORDS];
+};
+
+// Assembles and verifies one program given as a list of instructions,
+// e.g. ["ldh [3]", "jne #0, keep", "drop", "keep: accept"]. Prints what
+// is wrong and returns false if the program is rejected.
+bool filter_compile(const Json::Value &program, struct filter *filter);
+
+// Runs filter over a packet, possibly rewriting it in place. Returns false
+// if the packet is to be dropped. A load beyond the end of the packet ends
+// the program and keeps the packet.
+bool filter_run(struct filter *filter, uint8_t *data, uint32_t length);
+
+#endif // FILTER_H
@@ -0,0 +1,146 @@
+#include "fusion.h"
+#include "inject-ack.h"
+
+bool fusion_enabled = false;
+
+struct fusion_state *fusion_create(int step) {
+	struct fusion_state *fusion = new struct fusion_state;
+	fusion->dx.store(0, std::memory_order_relaxed);
+	fusion->dy.store(0, std::memory_order_relaxed);
+	fusion->wheel.store(0, std::memory_order_relaxed);
+	fusion->buttons.store(0, std::memory_order_relaxed);
+	fusion->pending.store(false, std::memory_order_relaxed);
+	fusion->ack.store(0, std::memory_order_relaxed);
+	fusion->step = step;
+	memset(fusion->last, 0, sizeof(fusion->last));
+	fusion->last_length = 0;
+	return fusion;
+}
+
+void fusion_destroy(struct fusion_state *fusion) {
+	delete fusion;
+}
+
+void fusion_add_motion(struct fusion_state *fusion, int dx, int dy, int wheel) {
+	fusion->dx.fetch_add(dx, std::memory_order_relaxed);
+	fusion->dy.fetch_add(dy, std::memory_order_relaxed);
+	fusion->wheel.fetch_add(wheel, std::memory_order_relaxed);
+	fusion->pending.store(true, std::memory_order_release);
+}
+
+void fusion_set_buttons(struct fusion_state *fusion, uint8_t buttons) {
+	fusion->buttons.store(buttons, std::memory_order_relaxed);
+	fusion->pending.store(true, std::memory_order_release);
+}
+
+bool fusion_add_ack(struct fusion_state *fusion, uint32_t ack) {
+	// The previous one is chained before ours becomes visible, so the
+	// writer either takes it alone or both together.
+	uint32_t prev = fusion->ack.load(std::memory_order_relaxed);
+	bool added;
+	do {
+		added = prev != ack;
+		if (added)
+			inject_ack_chain(ack, prev);
+	} while (!fusion->ack.compare_exchange_weak(prev, ack, std::memory_order_acq_rel));
+
+	// Make sure a report goes out to carry it.
+	fusion->pending.store(true, std::memory_order_release);
+	return added;
+}
+
+bool fusion_pending(struct fusion_state *fusion) {
+	return fusion->pending.load(std::memory_order_acquire);
+}
+
+// Adds what is pending in *acc, at most step of it, to a report field that
+// holds min..max and puts back what does not fit, for a later report.
+static int fusion_take(std::atomic<int32_t> *acc, int value, int step, int min, int max) {
+	int32_t delta = acc->exchange(0, std::memory_order_relaxed);
+	int32_t taken = delta;
+	if (step && taken > step)
+		taken = step;
+	if (step && taken < -step)
+		taken = -step;
+	int32_t sum = value + taken;
+	int32_t clamped = sum < min ? min : (sum > max ? max : sum);
+	if (clamped - value != delta)
+		acc->fetch_add(delta - (clamped - value), std::memory_order_relaxed);
+	return clamped;
+}
+
+static uint32_t fusion_fill(struct fusion_state *fusion, const struct hid_mouse_codec *mouse,
+			uint8_t *report) {
+	// Clear pending first: an injection racing with us sets it again
+	// and gets its own report.
+	fusion->pending.store(false, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	uint32_t ack = fusion->ack.exchange(0, std::memory_order_acq_rel);
+
+	int x = fusion_take(&fusion->dx, hid_get(report, &mouse->x),
+			fusion->step, mouse->x.min, mouse->x.max);
+	int y = fusion_take(&fusion->dy, hid_get(report, &mouse->y),
+			fusion->step, mouse->y.min, mouse->y.max);
+	hid_put(report, &mouse->x, x);
+	hid_put(report, &mouse->y, y);
+	// A mouse without a wheel keeps the wheel motion for good.
+	if (mouse->wheel.size)
+		hid_put(report, &mouse->wheel, fusion_take(&fusion->wheel,
+			hid_get(report, &mouse->wheel), 0, mouse->wheel.min, mouse->wheel.max));
+	else
+		fusion->wheel.store(0, std::memory_order_relaxed);
+	hid_put(report, &mouse->buttons, hid_get(report, &mouse->buttons) |
+		fusion->buttons.load(std::memory_order_relaxed));
+
+	// Motion that did not fit needs another report.
+	if (fusion->dx.load(std::memory_order_relaxed) ||
+	    fusion->dy.load(std::memory_order_relaxed) ||
+	    fusion->wheel.load(std::memory_order_relaxed))
+		fusion->pending.store(true, std::memory_order_relaxed);
+	return ack;
+}
+
+uint32_t fusion_merge(struct fusion_state *fusion, const struct hid_codec *codec,
+			struct usb_raw_transfer_io *io) {
+	uint8_t *report = (uint8_t *)io->data;
+	if (!hid_is_mouse_report(codec, report, io->inner.length))
+		return 0;
+
+	fusion->last_length = codec->mouse.length;
+	memcpy(fusion->last, report, fusion->last_length);
+	return fusion_fill(fusion, &codec->mouse, report);
+}
+
+uint32_t fusion_standalone(struct fusion_state *fusion, const struct hid_codec *codec,
+			int ep_num, struct usb_raw_transfer_io *io) {
+	const struct hid_mouse_codec *mouse = &codec->mouse;
+	uint8_t *report = (uint8_t *)io->data;
+
+	io->inner.ep = ep_num;
+	io->inner.flags = 0;
+	io->inner.length = mouse->length;
+	if (!mouse->present) {
+		// The descriptor has no report to carry the motion in.
+		fusion->pending.store(false, std::memory_order_relaxed);
+		fusion->dx.store(0, std::memory_order_relaxed);
+		fusion->dy.store(0, std::memory_order_relaxed);
+		fusion->wheel.store(0, std::memory_order_relaxed);
+		uint32_t ack = fusion->ack.exchange(0, std::memory_order_acq_rel);
+		if (ack)
+			inject_ack_written(ack, true);
+		return 0;
+	}
+	if (fusion->last_length == mouse->length) {
+		memcpy(report, fusion->last, mouse->length);
+		hid_put(report, &mouse->x, 0);
+		hid_put(report, &mouse->y, 0);
+		hid_put(report, &mouse->wheel, 0);
+	}
+	else {
+		// No real report yet to take the buttons from.
+		memset(report, 0, mouse->length);
+		if (codec->has_ids)
+			report[0] = mouse->id;
+	}
+	return fusion_fill(fusion, mouse, report);
+}
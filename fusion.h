@@ -0,0 +1,62 @@
+#ifndef FUSION_H
+#define FUSION_H
+
+#include <atomic>
+#include <stdint.h>
+
+#include "host-raw-gadget.h"
+#include "hid-report.h"
+
+// Whether injected mouse motion is merged into the reports of HID mouse
+// endpoints instead of being sent as reports of its own.
+extern bool fusion_enabled;
+
+// Injected motion and buttons waiting for the next report of one mouse
+// endpoint. Injectors add to it from any thread; the endpoint writer drains
+// it into the next real report, or sends it on its own when the device
+// has nothing queued when the host polls.
+struct fusion_state {
+	std::atomic<int32_t>	dx;
+	std::atomic<int32_t>	dy;
+	std::atomic<int32_t>	wheel;
+	// Buttons held by injection, added to every report until released.
+	std::atomic<uint8_t>	buttons;
+	std::atomic<bool>	pending;
+	// Acknowledgement of the latest injection not yet sent, see
+	// inject-ack.h. Earlier ones are chained to it.
+	std::atomic<uint32_t>	ack;
+	// Largest X/Y delta added to one report, 0 for no limit.
+	int			step;
+
+	// Writer only: the last real report, the template for standalone
+	// ones, last_length bytes long.
+	uint8_t			last[HID_REPORT_MAX];
+	int			last_length;
+};
+
+struct fusion_state *fusion_create(int step);
+void fusion_destroy(struct fusion_state *fusion);
+
+void fusion_add_motion(struct fusion_state *fusion, int dx, int dy, int wheel);
+void fusion_set_buttons(struct fusion_state *fusion, uint8_t buttons);
+// Called after the injection was added, so the acknowledgement never goes
+// out with an earlier report. Returns false if ack was already waiting, in
+// which case the caller's reference was not taken over.
+bool fusion_add_ack(struct fusion_state *fusion, uint32_t ack);
+
+bool fusion_pending(struct fusion_state *fusion);
+
+// Merges the pending motion and buttons into a real report about to be
+// sent, laid out as codec says. Anything that is not its mouse report is
+// left alone. Returns the acknowledgement to complete once the report is
+// written, 0 for none.
+uint32_t fusion_merge(struct fusion_state *fusion, const struct hid_codec *codec,
+			struct usb_raw_transfer_io *io);
+
+// Builds a report carrying only the pending motion, on top of the buttons
+// of the last real report. If codec has no mouse report, the motion is
+// dropped and io left empty.
+uint32_t fusion_standalone(struct fusion_state *fusion, const struct hid_codec *codec,
+			int ep_num, struct usb_raw_transfer_io *io);
+
+#endif // FUSION_H
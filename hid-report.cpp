@@ -0,0 +1,626 @@
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+
+#include "ep-routes.h"
+#include "hid-report.h"
+
+static std::atomic<struct hid_codec *> hid_codecs[HID_MAX_INTERFACES];
+
+// The 9-byte mouse report of the Logitech mice this proxy was written for:
+// report ID 2, 8 buttons, padding, 16-bit X and Y, wheel, padding.
+static const uint8_t hid_default_desc[] = {
+	0x05, 0x01,		// Usage Page (Generic Desktop)
+	0x09, 0x02,		// Usage (Mouse)
+	0xa1, 0x01,		// Collection (Application)
+	0x85, 0x02,		//   Report ID (2)
+	0x09, 0x01,		//   Usage (Pointer)
+	0xa1, 0x00,		//   Collection (Physical)
+	0x05, 0x09,		//     Usage Page (Button)
+	0x19, 0x01,		//     Usage Minimum (1)
+	0x29, 0x08,		//     Usage Maximum (8)
+	0x15, 0x00,		//     Logical Minimum (0)
+	0x25, 0x01,		//     Logical Maximum (1)
+	0x75, 0x01,		//     Report Size (1)
+	0x95, 0x08,		//     Report Count (8)
+	0x81, 0x02,		//     Input (Data, Variable, Absolute)
+	0x75, 0x08,		//     Report Size (8)
+	0x95, 0x01,		//     Report Count (1)
+	0x81, 0x03,		//     Input (Constant)
+	0x05, 0x01,		//     Usage Page (Generic Desktop)
+	0x09, 0x30,		//     Usage (X)
+	0x09, 0x31,		//     Usage (Y)
+	0x16, 0x00, 0x80,	//     Logical Minimum (-32768)
+	0x26, 0xff, 0x7f,	//     Logical Maximum (32767)
+	0x75, 0x10,		//     Report Size (16)
+	0x95, 0x02,		//     Report Count (2)
+	0x81, 0x06,		//     Input (Data, Variable, Relative)
+	0x09, 0x38,		//     Usage (Wheel)
+	0x15, 0x81,		//     Logical Minimum (-127)
+	0x25, 0x7f,		//     Logical Maximum (127)
+	0x75, 0x08,		//     Report Size (8)
+	0x95, 0x01,		//     Report Count (1)
+	0x81, 0x06,		//     Input (Data, Variable, Relative)
+	0x81, 0x03,		//     Input (Constant)
+	0xc0,			//   End Collection
+	0xc0,			// End Collection
+};
+
+/*----------------------------------------------------------------------*/
+
+struct hid_globals {
+	uint16_t	usage_page;
+	int32_t		logical_min;
+	int32_t		logical_max;
+	uint32_t	size;
+	uint32_t	count;
+	uint8_t		id;
+};
+
+// Usages with their page in the upper half: the one they were given
+// with, or the usage page current at the local item.
+struct hid_locals {
+	std::vector<uint32_t>	usages;
+	uint32_t		usage_min;
+	uint32_t		usage_max;
+	bool			has_range;
+};
+
+static struct hid_report *hid_report_for(struct hid_codec *codec, uint8_t id) {
+	for (size_t i = 0; i < codec->reports.size(); i++) {
+		if (codec->reports[i].id == id)
+			return &codec->reports[i];
+	}
+	struct hid_report report;
+	report.id = id;
+	report.bits = 0;
+	codec->reports.push_back(report);
+	return &codec->reports.back();
+}
+
+static void hid_add_input(struct hid_codec *codec, const struct hid_globals *globals,
+			const struct hid_locals *locals, uint8_t flags) {
+	struct hid_report *report = hid_report_for(codec, globals->id);
+	uint64_t bits = (uint64_t)globals->size * globals->count;
+
+	// Report Size and Count come straight from the device. Past
+	// HID_REPORT_MAX the report is of no use to the codecs, so it is
+	// marked too long, which hid_compile() skips, before a huge count
+	// pushes a field per element or the 16-bit offsets wrap.
+	if (report->bits + bits > 8 * HID_REPORT_MAX) {
+		report->bits = 8 * HID_REPORT_MAX + 1;
+		return;
+	}
+
+	if (!(flags & HID_FIELD_CONSTANT) && globals->size && globals->size <= 32 &&
+	    globals->count) {
+		struct hid_field field;
+		field.bit = report->bits;
+		field.size = globals->size;
+		field.flags = flags;
+		field.logical_min = globals->logical_min;
+		field.logical_max = globals->logical_max;
+
+		if (locals->usages.empty() || !(flags & HID_FIELD_VARIABLE)) {
+			// A usage range, or an array of usages
+			uint32_t min = locals->usage_min, max = locals->usage_max;
+			if (!locals->has_range && !locals->usages.empty()) {
+				min = max = locals->usages[0];
+				for (size_t i = 1; i < locals->usages.size(); i++) {
+					min = std::min(min, locals->usages[i]);
+					max = std::max(max, locals->usages[i]);
+				}
+			}
+			field.usage_page = min >> 16;
+			field.usage_min = min & 0xffff;
+			field.usage_max = max & 0xffff;
+			field.count = globals->count;
+			report->fields.push_back(field);
+		}
+		else {
+			// Usages listed one by one; the last one repeats for the
+			// remaining elements.
+			field.count = 1;
+			for (uint32_t i = 0; i < globals->count; i++) {
+				uint32_t usage = locals->usages[std::min<size_t>(i, locals->usages.size() - 1)];
+				field.usage_page = usage >> 16;
+				field.usage_min = field.usage_max = usage & 0xffff;
+				field.bit = report->bits + i * globals->size;
+				report->fields.push_back(field);
+			}
+		}
+	}
+	report->bits += bits;
+}
+
+/*----------------------------------------------------------------------*/
+
+static struct hid_value hid_value_at(const struct hid_codec *codec, uint32_t bit,
+				uint32_t size, int32_t min, int32_t max) {
+	struct hid_value value = {};
+	if (codec->has_ids)
+		bit += 8;
+	value.byte = bit / 8;
+	value.shift = bit % 8;
+	value.size = size;
+	value.bytes = (value.shift + size + 7) / 8;
+	value.mask = (1ULL << size) - 1;
+	value.is_signed = min < 0;
+	value.min = min;
+	value.max = max;
+	return value;
+}
+
+// The element of a variable field of report carrying page:usage.
+static const struct hid_field *hid_find(const struct hid_report *report,
+				uint16_t page, uint16_t usage, uint32_t *bit) {
+	for (size_t i = 0; i < report->fields.size(); i++) {
+		const struct hid_field *field = &report->fields[i];
+		if (field->usage_page != page || !(field->flags & HID_FIELD_VARIABLE) ||
+		    usage < field->usage_min || usage - field->usage_min >= field->count)
+			continue;
+		*bit = field->bit + (usage - field->usage_min) * field->size;
+		return field;
+	}
+	return NULL;
+}
+
+static struct hid_value hid_find_value(const struct hid_codec *codec,
+				const struct hid_report *report, uint16_t page, uint16_t usage,
+				uint8_t flags) {
+	uint32_t bit;
+	const struct hid_field *field = hid_find(report, page, usage, &bit);
+	if (!field || (field->flags & flags) != flags)
+		return hid_value_at(codec, 0, 0, 0, 0);
+	return hid_value_at(codec, bit, field->size, field->logical_min, field->logical_max);
+}
+
+// A run of count one-bit elements from page:first on, as one value.
+static struct hid_value hid_find_bits(const struct hid_codec *codec,
+				const struct hid_report *report, uint16_t page, uint16_t first,
+				uint32_t max_count, uint8_t *count) {
+	uint32_t bit;
+	const struct hid_field *field = hid_find(report, page, first, &bit);
+	*count = 0;
+	if (!field || field->size != 1)
+		return hid_value_at(codec, 0, 0, 0, 0);
+	uint32_t n = std::min<uint32_t>(field->count - (first - field->usage_min), max_count);
+	*count = n;
+	return hid_value_at(codec, bit, n, 0, (int32_t)((1ULL << n) - 1 > INT32_MAX ?
+				INT32_MAX : (1ULL << n) - 1));
+}
+
+static uint8_t hid_report_length(const struct hid_codec *codec, const struct hid_report *report) {
+	return (codec->has_ids ? 1 : 0) + (report->bits + 7) / 8;
+}
+
+static bool hid_compile_mouse(const struct hid_codec *codec, const struct hid_report *report,
+				struct hid_mouse_codec *mouse) {
+	struct hid_value x = hid_find_value(codec, report, HID_PAGE_GENERIC_DESKTOP,
+				HID_USAGE_X, HID_FIELD_RELATIVE);
+	struct hid_value y = hid_find_value(codec, report, HID_PAGE_GENERIC_DESKTOP,
+				HID_USAGE_Y, HID_FIELD_RELATIVE);
+	if (!x.size || !y.size)
+		return false;
+
+	mouse->present = true;
+	mouse->id = report->id;
+	mouse->length = hid_report_length(codec, report);
+	mouse->x = x;
+	mouse->y = y;
+	mouse->buttons = hid_find_bits(codec, report, HID_PAGE_BUTTON, 1, 32,
+				&mouse->button_count);
+	mouse->wheel = hid_find_value(codec, report, HID_PAGE_GENERIC_DESKTOP,
+				HID_USAGE_WHEEL, 0);
+	mouse->pan = hid_find_value(codec, report, HID_PAGE_CONSUMER,
+				HID_USAGE_AC_PAN, 0);
+	return true;
+}
+
+static void hid_add_key_range(struct hid_keyboard_codec *keyboard, uint16_t usage,
+				uint16_t count, uint16_t bit) {
+	for (int i = 0; i < count; i++)
+		keyboard->key_bit[usage + i] = bit + i + 1;
+
+	// Usages listed one by one come as fields of one element each.
+	if (keyboard->range_count) {
+		struct hid_key_range *last = &keyboard->ranges[keyboard->range_count - 1];
+		if (last->usage + last->count == usage && last->bit + last->count == bit) {
+			last->count += count;
+			return;
+		}
+	}
+	if (keyboard->range_count == HID_KEY_RANGES)
+		return;
+	struct hid_key_range *range = &keyboard->ranges[keyboard->range_count++];
+	range->usage = usage;
+	range->count = count;
+	range->bit = bit;
+}
+
+static bool hid_compile_keyboard(const struct hid_codec *codec, const struct hid_report *report,
+				struct hid_keyboard_codec *keyboard) {
+	uint8_t modifiers;
+	keyboard->modifiers = hid_find_bits(codec, report, HID_PAGE_KEYBOARD,
+				HID_USAGE_LEFT_CONTROL, 8, &modifiers);
+
+	for (size_t i = 0; i < report->fields.size(); i++) {
+		const struct hid_field *field = &report->fields[i];
+		if (field->usage_page != HID_PAGE_KEYBOARD)
+			continue;
+
+		if ((field->flags & HID_FIELD_VARIABLE) && field->size == 1) {
+			if (field->usage_min > 0xff)
+				continue;
+			uint16_t count = std::min<uint16_t>(field->count, 0x100 - field->usage_min);
+			hid_add_key_range(keyboard, field->usage_min, count,
+				(codec->has_ids ? 8 : 0) + field->bit);
+		}
+		else if (!(field->flags & HID_FIELD_VARIABLE) && field->size <= 16 &&
+			 !keyboard->key_count) {
+			keyboard->keys = hid_value_at(codec, field->bit, field->size,
+						field->logical_min, field->logical_max);
+			keyboard->key_count = std::min<uint16_t>(field->count, 255);
+			keyboard->key_min = field->usage_min;
+			keyboard->key_max = field->usage_max;
+		}
+	}
+	if (!keyboard->range_count && !keyboard->key_count)
+		return false;
+
+	keyboard->present = true;
+	keyboard->id = report->id;
+	keyboard->length = hid_report_length(codec, report);
+	return true;
+}
+
+static bool hid_compile_consumer(const struct hid_codec *codec, const struct hid_report *report,
+				struct hid_consumer_codec *consumer) {
+	for (size_t i = 0; i < report->fields.size(); i++) {
+		const struct hid_field *field = &report->fields[i];
+		if (field->usage_page != HID_PAGE_CONSUMER)
+			continue;
+
+		if ((field->flags & HID_FIELD_VARIABLE) && field->size == 1) {
+			for (int j = 0; j < field->count && consumer->bit_count < HID_CONSUMER_BITS; j++) {
+				struct hid_usage_bit *bit = &consumer->bits[consumer->bit_count++];
+				bit->usage = field->usage_min + j;
+				bit->bit = (codec->has_ids ? 8 : 0) + field->bit + j;
+			}
+		}
+		else if (!(field->flags & HID_FIELD_VARIABLE) && field->size <= 16 &&
+			 !consumer->usage_count) {
+			consumer->usages = hid_value_at(codec, field->bit, field->size,
+						field->logical_min, field->logical_max);
+			consumer->usage_count = std::min<uint16_t>(field->count, 255);
+			consumer->usage_min = field->usage_min;
+			consumer->usage_max = field->usage_max;
+		}
+	}
+	if (!consumer->bit_count && !consumer->usage_count)
+		return false;
+
+	consumer->present = true;
+	consumer->id = report->id;
+	consumer->length = hid_report_length(codec, report);
+	return true;
+}
+
+// Picks the first input report carrying relative X and Y as the mouse
+// report, and among the others the first one with keyboard keys as the
+// keyboard report and the first one with media keys as the consumer
+// report.
+static void hid_compile(struct hid_codec *codec) {
+	memset(&codec->mouse, 0, sizeof(codec->mouse));
+	memset(&codec->keyboard, 0, sizeof(codec->keyboard));
+	memset(&codec->consumer, 0, sizeof(codec->consumer));
+
+	for (size_t i = 0; i < codec->reports.size(); i++) {
+		const struct hid_report *report = &codec->reports[i];
+		if ((codec->has_ids ? 8 : 0) + report->bits > 8 * HID_REPORT_MAX)
+			continue;
+
+		if (!codec->mouse.present && hid_compile_mouse(codec, report, &codec->mouse))
+			continue;
+		if (!codec->keyboard.present) {
+			if (hid_compile_keyboard(codec, report, &codec->keyboard))
+				continue;
+			memset(&codec->keyboard, 0, sizeof(codec->keyboard));
+		}
+		if (!codec->consumer.present &&
+		    !hid_compile_consumer(codec, report, &codec->consumer))
+			memset(&codec->consumer, 0, sizeof(codec->consumer));
+	}
+}
+
+bool hid_parse(const uint8_t *desc, int length, struct hid_codec *codec) {
+	struct hid_globals globals = {};
+	std::vector<struct hid_globals> stack;
+	struct hid_locals locals = {};
+	bool ok = true;
+
+	codec->has_ids = false;
+	codec->reports.clear();
+
+	int i = 0;
+	while (i < length) {
+		uint8_t prefix = desc[i++];
+
+		// Long items carry nothing we use.
+		if (prefix == 0xfe) {
+			if (i + 2 > length) {
+				ok = false;
+				break;
+			}
+			i += 2 + desc[i];
+			continue;
+		}
+
+		int size = prefix & 0x03;
+		if (size == 3)
+			size = 4;
+		if (i + size > length) {
+			ok = false;
+			break;
+		}
+		uint32_t data = 0;
+		for (int j = 0; j < size; j++)
+			data |= (uint32_t)desc[i + j] << (8 * j);
+		int32_t sdata = data;
+		if (size && size < 4 && (data >> (8 * size - 1)) & 1)
+			sdata = data | (~0U << (8 * size));
+		i += size;
+
+		int type = (prefix >> 2) & 0x03;
+		int tag = prefix >> 4;
+		if (type == 0) {
+			// Main: Input, Output, Feature, Collection, End Collection
+			if (tag == 0x8)
+				hid_add_input(codec, &globals, &locals, data);
+			locals = hid_locals();
+		}
+		else if (type == 1) {
+			switch (tag) {
+			case 0x0: globals.usage_page = data; break;
+			case 0x1: globals.logical_min = sdata; break;
+			// Some devices give an unsigned maximum
+			// with its top bit set.
+			case 0x2: globals.logical_max = globals.logical_min >= 0 ? (int32_t)data : sdata; break;
+			case 0x7: globals.size = data; break;
+			case 0x8:
+				globals.id = data;
+				codec->has_ids = true;
+				break;
+			case 0x9: globals.count = data; break;
+			case 0xa: stack.push_back(globals); break;
+			case 0xb:
+				if (stack.empty()) {
+					ok = false;
+					break;
+				}
+				globals = stack.back();
+				stack.pop_back();
+				break;
+			}
+		}
+		else if (type == 2) {
+			uint32_t usage = size == 4 ? data : data | (uint32_t)globals.usage_page << 16;
+			switch (tag) {
+			case 0x0: locals.usages.push_back(usage); break;
+			case 0x1:
+				locals.usage_min = usage;
+				locals.has_range = true;
+				break;
+			case 0x2: locals.usage_max = usage; break;
+			}
+		}
+		if (!ok)
+			break;
+	}
+
+	hid_compile(codec);
+	return ok;
+}
+
+/*----------------------------------------------------------------------*/
+
+static inline void hid_set_bit(uint8_t *report, int bit) {
+	report[bit / 8] |= 1 << (bit % 8);
+}
+
+static inline void hid_clear_bit(uint8_t *report, int bit) {
+	report[bit / 8] &= ~(1 << (bit % 8));
+}
+
+static inline bool hid_test_bit(const uint8_t *report, int bit) {
+	return (report[bit / 8] >> (bit % 8)) & 1;
+}
+
+int hid_keyboard_encode(const struct hid_codec *codec, const uint64_t *keys, uint8_t *report) {
+	const struct hid_keyboard_codec *keyboard = &codec->keyboard;
+	int n = 0;
+	bool rollover = false;
+
+	for (int i = 0; i < keyboard->range_count; i++) {
+		const struct hid_key_range *range = &keyboard->ranges[i];
+		for (int j = 0; j < range->count; j++)
+			hid_clear_bit(report, range->bit + j);
+	}
+	for (int i = 0; i < keyboard->key_count; i++) {
+		struct hid_value element = hid_element(&keyboard->keys, i);
+		hid_put(report, &element, keyboard->keys.min);
+	}
+
+	for (int i = 0; i < 4; i++) {
+		for (uint64_t word = keys[i]; word; word &= word - 1) {
+			int usage = i * 64 + __builtin_ctzll(word);
+			if (keyboard->key_bit[usage]) {
+				hid_set_bit(report, keyboard->key_bit[usage] - 1);
+				continue;
+			}
+			if (usage < keyboard->key_min || usage > keyboard->key_max)
+				continue;
+			if (n == keyboard->key_count) {
+				rollover = true;
+				continue;
+			}
+			struct hid_value element = hid_element(&keyboard->keys, n++);
+			hid_put(report, &element, usage - keyboard->key_min + keyboard->keys.min);
+		}
+	}
+
+	if (rollover) {
+		for (int i = 0; i < keyboard->key_count; i++) {
+			struct hid_value element = hid_element(&keyboard->keys, i);
+			hid_put(report, &element, HID_USAGE_ERROR_ROLLOVER - keyboard->key_min +
+				keyboard->keys.min);
+		}
+	}
+	return keyboard->length;
+}
+
+bool hid_keyboard_decode(const struct hid_codec *codec, const uint8_t *report, uint64_t *keys) {
+	const struct hid_keyboard_codec *keyboard = &codec->keyboard;
+
+	memset(keys, 0, 4 * sizeof(uint64_t));
+	for (int i = 0; i < keyboard->key_count; i++) {
+		struct hid_value element = hid_element(&keyboard->keys, i);
+		int usage = hid_get(report, &element) - keyboard->keys.min + keyboard->key_min;
+		if (usage == HID_USAGE_ERROR_ROLLOVER) {
+			memset(keys, 0, 4 * sizeof(uint64_t));
+			return false;
+		}
+		// 0 is no key, 1..3 are the other error codes.
+		if (usage > 3 && usage <= keyboard->key_max && usage < 256)
+			keys[usage / 64] |= 1ULL << (usage % 64);
+	}
+	for (int i = 0; i < keyboard->range_count; i++) {
+		const struct hid_key_range *range = &keyboard->ranges[i];
+		for (int j = 0; j < range->count; j++) {
+			int usage = range->usage + j;
+			if (hid_test_bit(report, range->bit + j))
+				keys[usage / 64] |= 1ULL << (usage % 64);
+		}
+	}
+	return true;
+}
+
+int hid_consumer_encode(const struct hid_codec *codec, const uint16_t *usages, int count,
+			uint8_t *report) {
+	const struct hid_consumer_codec *consumer = &codec->consumer;
+	int n = 0;
+
+	for (int i = 0; i < consumer->bit_count; i++)
+		hid_clear_bit(report, consumer->bits[i].bit);
+	for (int i = 0; i < consumer->usage_count; i++) {
+		struct hid_value element = hid_element(&consumer->usages, i);
+		hid_put(report, &element, consumer->usages.min);
+	}
+
+	for (int i = 0; i < count; i++) {
+		int j;
+		for (j = 0; j < consumer->bit_count; j++) {
+			if (consumer->bits[j].usage == usages[i])
+				break;
+		}
+		if (j < consumer->bit_count)
+			hid_set_bit(report, consumer->bits[j].bit);
+		else if (usages[i] >= consumer->usage_min && usages[i] <= consumer->usage_max &&
+			 n < consumer->usage_count) {
+			struct hid_value element = hid_element(&consumer->usages, n++);
+			hid_put(report, &element, usages[i] - consumer->usage_min + consumer->usages.min);
+		}
+	}
+	return consumer->length;
+}
+
+int hid_consumer_decode(const struct hid_codec *codec, const uint8_t *report,
+			uint16_t *usages, int max) {
+	const struct hid_consumer_codec *consumer = &codec->consumer;
+	int n = 0;
+
+	for (int i = 0; i < consumer->usage_count && n < max; i++) {
+		struct hid_value element = hid_element(&consumer->usages, i);
+		int usage = hid_get(report, &element) - consumer->usages.min + consumer->usage_min;
+		if (usage > 0 && usage <= consumer->usage_max)
+			usages[n++] = usage;
+	}
+	for (int i = 0; i < consumer->bit_count && n < max; i++) {
+		if (hid_test_bit(report, consumer->bits[i].bit))
+			usages[n++] = consumer->bits[i].usage;
+	}
+	return n;
+}
+
+/*----------------------------------------------------------------------*/
+
+static void hid_print(const struct hid_codec *codec) {
+	printf("[HID] Interface %d: %zu input reports\n", codec->interface,
+		codec->reports.size());
+
+	const struct hid_mouse_codec *mouse = &codec->mouse;
+	if (mouse->present)
+		printf("[HID] Interface %d: mouse report %d, %d bytes: %d buttons, "
+			"X/Y %d/%d bits, wheel %d bits, pan %d bits\n", codec->interface,
+			mouse->id, mouse->length, mouse->button_count, mouse->x.size,
+			mouse->y.size, mouse->wheel.size, mouse->pan.size);
+
+	const struct hid_keyboard_codec *keyboard = &codec->keyboard;
+	if (keyboard->present)
+		printf("[HID] Interface %d: keyboard report %d, %d bytes: %d modifiers, "
+			"%d keys of %d bits, %d bitmap ranges\n", codec->interface, keyboard->id,
+			keyboard->length, keyboard->modifiers.size, keyboard->key_count,
+			keyboard->keys.size, keyboard->range_count);
+
+	const struct hid_consumer_codec *consumer = &codec->consumer;
+	if (consumer->present)
+		printf("[HID] Interface %d: consumer report %d, %d bytes: %d usages of %d bits, "
+			"%d usage bits\n", codec->interface, consumer->id, consumer->length,
+			consumer->usage_count, consumer->usages.size, consumer->bit_count);
+}
+
+void hid_capture(int interface, const uint8_t *desc, int length) {
+	if (interface < 0 || interface >= HID_MAX_INTERFACES)
+		return;
+
+	struct hid_codec *codec = new struct hid_codec;
+	codec->interface = interface;
+	if (!hid_parse(desc, length, codec))
+		printf("[HID] Interface %d: malformed report descriptor, using what was parsed\n",
+			interface);
+	hid_print(codec);
+
+	// Injectors and endpoint threads read codecs under ep_routes_rcu.
+	struct hid_codec *old = hid_codecs[interface].exchange(codec);
+	if (old) {
+		rcu_synchronize(&ep_routes_rcu);
+		delete old;
+	}
+}
+
+static const struct hid_codec *hid_default_codec() {
+	static struct hid_codec *codec = NULL;
+	static std::once_flag once;
+	std::call_once(once, [] {
+		codec = new struct hid_codec;
+		codec->interface = -1;
+		hid_parse(hid_default_desc, sizeof(hid_default_desc), codec);
+	});
+	return codec;
+}
+
+const struct hid_codec *hid_codec_get(int interface) {
+	if (interface >= 0 && interface < HID_MAX_INTERFACES) {
+		const struct hid_codec *codec = hid_codecs[interface].load();
+		if (codec)
+			return codec;
+	}
+	return hid_default_codec();
+}
+
+void hid_codecs_cleanup() {
+	for (int i = 0; i < HID_MAX_INTERFACES; i++)
+		delete hid_codecs[i].exchange(NULL);
+}
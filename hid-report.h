@@ -0,0 +1,241 @@
+#ifndef HID_REPORT_H
+#define HID_REPORT_H
+
+#include <stdint.h>
+#include <vector>
+
+// Class descriptor type of the HID report descriptor.
+#define HID_DT_REPORT		0x22
+
+// Interfaces whose report descriptors are kept, by bInterfaceNumber.
+#define HID_MAX_INTERFACES	32
+
+// Longest report the codecs build or take apart, report ID included.
+#define HID_REPORT_MAX		64
+
+// Usage pages and usages the codecs look for.
+#define HID_PAGE_GENERIC_DESKTOP	0x01
+#define HID_PAGE_KEYBOARD		0x07
+#define HID_PAGE_BUTTON			0x09
+#define HID_PAGE_CONSUMER		0x0c
+
+#define HID_USAGE_X		0x30
+#define HID_USAGE_Y		0x31
+#define HID_USAGE_WHEEL		0x38
+#define HID_USAGE_AC_PAN	0x238
+#define HID_USAGE_ERROR_ROLLOVER	0x01
+#define HID_USAGE_LEFT_CONTROL	0xe0
+
+// Runs of Keyboard page usages reported one bit each, and Consumer page
+// usages reported that way, a codec keeps.
+#define HID_KEY_RANGES		16
+#define HID_CONSUMER_BITS	32
+
+// Main item flags.
+#define HID_FIELD_CONSTANT	0x01
+#define HID_FIELD_VARIABLE	0x02
+#define HID_FIELD_RELATIVE	0x04
+
+// One Input main item, or one element of it when its usages were listed
+// one by one. Element i of a field sits at bit + i * size and has usage
+// usage_min + i if the field is variable; an array field's elements each
+// hold one usage of usage_min..usage_max, or 0.
+struct hid_field {
+	uint16_t	usage_page;
+	uint16_t	usage_min;
+	uint16_t	usage_max;
+	uint16_t	bit;
+	uint8_t		size;
+	uint8_t		flags;
+	uint16_t	count;
+	int32_t		logical_min;
+	int32_t		logical_max;
+};
+
+// Input report layout. bit offsets do not count the report ID byte.
+struct hid_report {
+	uint8_t				id;
+	uint16_t			bits;
+	std::vector<struct hid_field>	fields;
+};
+
+// Where one value lives in a report, report ID byte included, compiled
+// down to the bytes to touch. size 0: the report has no such value.
+struct hid_value {
+	uint16_t	byte;
+	uint8_t		shift;
+	uint8_t		size;
+	uint8_t		bytes;
+	bool		is_signed;
+	uint64_t	mask;
+	int32_t		min;
+	int32_t		max;
+};
+
+// Buttons are a single value of button_count bits, button 1 lowest.
+struct hid_mouse_codec {
+	bool			present;
+	uint8_t			id;
+	uint8_t			length;
+	uint8_t			button_count;
+	struct hid_value	buttons;
+	struct hid_value	x;
+	struct hid_value	y;
+	struct hid_value	wheel;
+	struct hid_value	pan;
+};
+
+struct hid_key_range {
+	uint16_t	usage;
+	uint16_t	count;
+	uint16_t	bit;
+};
+
+// Modifiers are the 8 bits of Left Control..Right GUI. keys is the first
+// element of the key array, the others follow every keys.size bits; an
+// element holding v stands for usage key_min + v - keys.min.
+//
+// key_bit[] is the usage-to-bit table of the keys that have a bit of
+// their own (the modifiers, and every key on keyboards reporting a
+// bitmap): the bit, report ID byte included, plus one, 0 for the keys
+// that go into the array. ranges[] lists the same bits by run, to read
+// them back.
+struct hid_keyboard_codec {
+	bool			present;
+	uint8_t			id;
+	uint8_t			length;
+	uint8_t			key_count;
+	uint16_t		key_min;
+	uint16_t		key_max;
+	struct hid_value	modifiers;
+	struct hid_value	keys;
+	uint16_t		key_bit[256];
+	uint8_t			range_count;
+	struct hid_key_range	ranges[HID_KEY_RANGES];
+};
+
+struct hid_usage_bit {
+	uint16_t	usage;
+	uint16_t	bit;
+};
+
+// Media keys: an array of usage_count elements like the key array, and
+// usages with a bit of their own.
+struct hid_consumer_codec {
+	bool			present;
+	uint8_t			id;
+	uint8_t			length;
+	uint8_t			usage_count;
+	uint8_t			bit_count;
+	uint16_t		usage_min;
+	uint16_t		usage_max;
+	struct hid_value	usages;
+	struct hid_usage_bit	bits[HID_CONSUMER_BITS];
+};
+
+// An interface's report descriptor, parsed into per-report field tables
+// and compiled into fixed-layout encoders for the reports the UDP
+// commands build and the proxy reads state from.
+struct hid_codec {
+	int				interface;
+	bool				has_ids;
+	std::vector<struct hid_report>	reports;
+	struct hid_mouse_codec		mouse;
+	struct hid_keyboard_codec	keyboard;
+	struct hid_consumer_codec	consumer;
+};
+
+// Parses desc into codec. Returns false if it is malformed; what was
+// parsed up to the error is kept.
+bool hid_parse(const uint8_t *desc, int length, struct hid_codec *codec);
+
+// Called by ep0 with each report descriptor passed to the host; wIndex of
+// the request is the interface.
+void hid_capture(int interface, const uint8_t *desc, int length);
+
+// The codec of interface, or, until its descriptor was seen, a default one
+// for the Logitech report the UDP commands always produced (see README).
+// Codecs are replaced under ep_routes_rcu: only use one between
+// rcu_read_lock() and rcu_read_unlock() on it.
+const struct hid_codec *hid_codec_get(int interface);
+
+void hid_codecs_cleanup();
+
+// Key sets are 256-bit masks of Keyboard page usages, 4 words of 64.
+
+// Sets the keys of a keyboard report to keys, leaving its other fields
+// alone, and returns its length. When the key array cannot hold them all,
+// every element reports ErrorRollOver, as a keyboard does. To build a
+// report from scratch, zero it and set the report ID first.
+int hid_keyboard_encode(const struct hid_codec *codec, const uint64_t *keys, uint8_t *report);
+// Returns false if the report is in ErrorRollOver, leaving keys empty.
+bool hid_keyboard_decode(const struct hid_codec *codec, const uint8_t *report, uint64_t *keys);
+
+// The same for the usages of the consumer report. Usages beyond what the
+// report holds are left out. Decoding returns how many there were, at
+// most max.
+int hid_consumer_encode(const struct hid_codec *codec, const uint16_t *usages, int count,
+			uint8_t *report);
+int hid_consumer_decode(const struct hid_codec *codec, const uint8_t *report,
+			uint16_t *usages, int max);
+
+static inline uint64_t hid_load(const uint8_t *report, const struct hid_value *value) {
+	uint64_t word = 0;
+	for (int i = 0; i < value->bytes; i++)
+		word |= (uint64_t)report[value->byte + i] << (8 * i);
+	return word;
+}
+
+static inline int32_t hid_get(const uint8_t *report, const struct hid_value *value) {
+	if (!value->size)
+		return 0;
+	uint64_t raw = (hid_load(report, value) >> value->shift) & value->mask;
+	if (value->is_signed && (raw >> (value->size - 1)) & 1)
+		raw |= ~value->mask;
+	return (int32_t)raw;
+}
+
+// Stores v clamped to the logical range of value.
+static inline void hid_put(uint8_t *report, const struct hid_value *value, int32_t v) {
+	if (!value->size)
+		return;
+	if (v < value->min)
+		v = value->min;
+	if (v > value->max)
+		v = value->max;
+	uint64_t word = hid_load(report, value);
+	word &= ~(value->mask << value->shift);
+	word |= ((uint64_t)(uint32_t)v & value->mask) << value->shift;
+	for (int i = 0; i < value->bytes; i++)
+		report[value->byte + i] = word >> (8 * i);
+}
+
+// Element i of the array whose first element is first.
+static inline struct hid_value hid_element(const struct hid_value *first, int i) {
+	struct hid_value value = *first;
+	uint32_t bit = first->byte * 8 + first->shift + i * first->size;
+	value.byte = bit / 8;
+	value.shift = bit % 8;
+	value.bytes = (value.shift + value.size + 7) / 8;
+	return value;
+}
+
+static inline bool hid_is_mouse_report(const struct hid_codec *codec,
+				const uint8_t *report, int length) {
+	return codec->mouse.present && length >= codec->mouse.length &&
+		(!codec->has_ids || report[0] == codec->mouse.id);
+}
+
+static inline bool hid_is_keyboard_report(const struct hid_codec *codec,
+				const uint8_t *report, int length) {
+	return codec->keyboard.present && length >= codec->keyboard.length &&
+		(!codec->has_ids || report[0] == codec->keyboard.id);
+}
+
+static inline bool hid_is_consumer_report(const struct hid_codec *codec,
+				const uint8_t *report, int length) {
+	return codec->consumer.present && length >= codec->consumer.length &&
+		(!codec->has_ids || report[0] == codec->consumer.id);
+}
+
+#endif // HID_REPORT_H
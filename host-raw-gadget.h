@@ -1,7 +1,7 @@
+#ifndef HOST_RAW_GADGET_H
+#define HOST_RAW_GADGET_H
+
 #include <pthread.h>
-#include <mutex>
-#include <condition_variable>
-#include <deque>
 
 #include "misc.h"
 
@@ -31,6 +31,8 @@ struct usb_raw_event {
 	__u8		data[0];
 };
 
+#define USB_RAW_IO_FLAGS_ZERO	0x0001
+
 struct usb_raw_ep_io {
 	__u16		ep;
 	__u16		flags;
@@ -87,8 +89,13 @@ struct usb_raw_eps_info {
 
 /*----------------------------------------------------------------------*/
 
+// Raw Gadget moves at most a page per EP_READ/EP_WRITE ioctl.
 #define MAX_TRANSFER_SIZE 4096
 
+// Largest transfer requested from the device on a bulk or interrupt IN
+// endpoint; it is written to the host in MAX_TRANSFER_SIZE chunks.
+#define MAX_BULK_TRANSFER_SIZE 65536
+
 struct usb_raw_control_event {
 	struct usb_raw_event		inner;
 	struct usb_ctrlrequest		ctrl;
@@ -101,15 +108,23 @@ struct usb_raw_transfer_io {
 
 /*----------------------------------------------------------------------*/
 
+struct ep_queue;
+struct fusion_state;
+struct poll_estimator;
+struct key_state;
+
 struct thread_info {
 	int				fd;
 	int				ep_num;
+	int				interface;
 	struct usb_endpoint_descriptor 	endpoint;
 	std::string			transfer_type;
 	std::string			dir;
-	std::deque<usb_raw_transfer_io> *data_queue;
-	std::mutex			*data_mutex;
-	std::condition_variable		*data_cond;
+	int				transfer_size;
+	struct ep_queue			*data_queue;
+	struct fusion_state		*fusion;
+	struct poll_estimator		*poll;
+	struct key_state		*keys;
 };
 
 struct raw_gadget_endpoint {
@@ -173,3 +188,5 @@ void usb_raw_ep_set_halt(int fd, int ep);
 void log_control_request(struct usb_ctrlrequest *ctrl);
 void log_event(struct usb_raw_event *event);
 void print_eps_info(int fd);
+
+#endif // HOST_RAW_GADGET_H
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/socket.h>
+
+#include "inject-ack.h"
+#include "udp_protocol.h"
+
+int inject_ack_fd = -1;
+
+static struct inject_ack inject_acks[INJECT_ACK_SLOTS];
+static std::atomic<uint32_t> inject_ack_next(1);
+
+uint64_t inject_ack_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// NULL once the slot has been reused for a newer acknowledgement.
+static struct inject_ack *inject_ack_get(uint32_t id) {
+	struct inject_ack *ack = &inject_acks[id & (INJECT_ACK_SLOTS - 1)];
+	if (ack->id.load(std::memory_order_acquire) != id)
+		return NULL;
+	return ack;
+}
+
+uint32_t inject_ack_begin(uint32_t seq, bool binary, const struct sockaddr_in *addr,
+			uint64_t received_ns) {
+	uint32_t id = inject_ack_next.fetch_add(1, std::memory_order_relaxed);
+	if (id == 0)
+		id = inject_ack_next.fetch_add(1, std::memory_order_relaxed);
+
+	struct inject_ack *ack = &inject_acks[id & (INJECT_ACK_SLOTS - 1)];
+	ack->id.store(0, std::memory_order_relaxed);
+	ack->seq = seq;
+	ack->binary = binary;
+	ack->addr = *addr;
+	ack->received_ns = received_ns;
+	ack->enqueued_ns.store(0, std::memory_order_relaxed);
+	ack->written_ns.store(0, std::memory_order_relaxed);
+	ack->refs.store(1, std::memory_order_relaxed);
+	ack->failed.store(false, std::memory_order_relaxed);
+	ack->chain.store(0, std::memory_order_relaxed);
+	ack->id.store(id, std::memory_order_release);
+	return id;
+}
+
+static void inject_ack_reply(struct inject_ack *ack) {
+	uint64_t enqueued = ack->enqueued_ns.load(std::memory_order_relaxed);
+	uint64_t written = ack->written_ns.load(std::memory_order_relaxed);
+	int status = INJECT_ACK_WRITTEN;
+	if (ack->failed.load(std::memory_order_relaxed))
+		status = INJECT_ACK_FAILED;
+	else if (!written)
+		status = INJECT_ACK_NOTHING;
+
+	char text[128];
+	struct udp_msg_ack msg = {};
+	const void *reply = &msg;
+	size_t length = sizeof(msg);
+	if (ack->binary) {
+		msg.header.magic = UDP_MSG_MAGIC;
+		msg.header.version = UDP_MSG_VERSION;
+		msg.header.op = UDP_MSG_ACK;
+		msg.status = status;
+		msg.seq = htole32(ack->seq);
+		msg.received = htole64(ack->received_ns);
+		msg.enqueued = htole64(enqueued);
+		msg.written = htole64(written);
+	}
+	else {
+		static const char *names[] = {"ok", "none", "failed"};
+		length = snprintf(text, sizeof(text), "#%u %s %llu %llu %llu\n", ack->seq,
+				names[status], (unsigned long long)ack->received_ns,
+				(unsigned long long)enqueued, (unsigned long long)written);
+		reply = text;
+	}
+
+	if (sendto(inject_ack_fd, reply, length, MSG_DONTWAIT,
+		   (const struct sockaddr *)&ack->addr, sizeof(ack->addr)) < 0)
+		perror("sendto() injection ack");
+}
+
+// Drops one reference, and replies once the last one is gone. Merged
+// acknowledgements complete with the one they were merged into.
+static void inject_ack_put(uint32_t id, uint64_t written, bool failed) {
+	while (id) {
+		struct inject_ack *ack = inject_ack_get(id);
+		if (!ack)
+			return;
+		if (failed)
+			ack->failed.store(true, std::memory_order_relaxed);
+		if (written)
+			ack->written_ns.store(written, std::memory_order_relaxed);
+		if (ack->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+			return;
+
+		inject_ack_reply(ack);
+		id = ack->chain.load(std::memory_order_relaxed);
+		written = ack->written_ns.load(std::memory_order_relaxed);
+		failed = ack->failed.load(std::memory_order_relaxed);
+		ack->id.store(0, std::memory_order_release);
+	}
+}
+
+void inject_ack_release(uint32_t id) {
+	inject_ack_put(id, 0, false);
+}
+
+void inject_ack_queued(uint32_t id) {
+	struct inject_ack *ack = inject_ack_get(id);
+	if (!ack)
+		return;
+	ack->refs.fetch_add(1, std::memory_order_relaxed);
+	ack->enqueued_ns.store(inject_ack_now(), std::memory_order_relaxed);
+}
+
+void inject_ack_dropped(uint32_t id) {
+	inject_ack_queued(id);
+	inject_ack_put(id, 0, true);
+}
+
+void inject_ack_written(uint32_t id, bool failed) {
+	inject_ack_put(id, failed ? 0 : inject_ack_now(), failed);
+}
+
+void inject_ack_chain(uint32_t id, uint32_t prev) {
+	struct inject_ack *ack = inject_ack_get(id);
+	if (ack)
+		ack->chain.store(prev, std::memory_order_relaxed);
+}
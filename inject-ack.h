@@ -0,0 +1,62 @@
+#ifndef INJECT_ACK_H
+#define INJECT_ACK_H
+
+#include <atomic>
+#include <stdint.h>
+#include <netinet/in.h>
+
+// Acknowledgements in flight at once; older ones are forgotten.
+#define INJECT_ACK_SLOTS	1024
+
+enum inject_ack_status {
+	INJECT_ACK_WRITTEN	= 0,	// every injection reached the host
+	INJECT_ACK_NOTHING	= 1,	// the command injected nothing
+	INJECT_ACK_FAILED	= 2,	// an injection was dropped
+};
+
+// Delivery acknowledgement of one UDP command that carried a sequence
+// number. It counts a reference for the command being handled and one per
+// injection it queued; when the last one is dropped the reply goes out to
+// addr, with the receive time, the last enqueue time and the last
+// usb_raw_ep_write() completion time, all CLOCK_MONOTONIC ns.
+//
+// Acknowledgements live in a ring of slots and are named by an id that
+// also picks the slot. Ids are never 0.
+struct inject_ack {
+	std::atomic<uint32_t>	id;
+	uint32_t		seq;
+	bool			binary;
+	struct sockaddr_in	addr;
+	uint64_t		received_ns;
+	std::atomic<uint64_t>	enqueued_ns;
+	std::atomic<uint64_t>	written_ns;
+	std::atomic<int>	refs;
+	std::atomic<bool>	failed;
+	// Acknowledgement whose injection was merged into this one's and is
+	// completed along with it.
+	std::atomic<uint32_t>	chain;
+};
+
+// Socket the replies are sent from.
+extern int inject_ack_fd;
+
+uint64_t inject_ack_now();
+
+uint32_t inject_ack_begin(uint32_t seq, bool binary, const struct sockaddr_in *addr,
+			uint64_t received_ns);
+
+// The command is done queueing injections.
+void inject_ack_release(uint32_t id);
+
+// An injection was queued, or dropped before reaching the queue.
+void inject_ack_queued(uint32_t id);
+void inject_ack_dropped(uint32_t id);
+
+// Called by endpoint writers once an injection has been written.
+void inject_ack_written(uint32_t id, bool failed);
+
+// Makes id complete prev (0: nothing) when it completes, replacing what
+// an earlier call chained. Must happen before id is visible to a writer.
+void inject_ack_chain(uint32_t id, uint32_t prev);
+
+#endif // INJECT_ACK_H
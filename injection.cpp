@@ -0,0 +1,712 @@
+#include <algorithm>
+#include <deque>
+#include <math.h>
+#include <thread>
+#include <poll.h>
+#include <libgen.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#include "injection.h"
+
+std::atomic<struct injection_rules *> injection_rules(NULL);
+struct rcu_domain injection_rcu;
+
+/*----------------------------------------------------------------------*/
+
+// Among patterns ending at the same byte the one of the earliest rule
+// wins, then the longest one.
+static bool injection_pattern_better(const struct injection_matcher *matcher,
+				int a, int b) {
+	if (b < 0)
+		return true;
+	const struct injection_pattern *pa = &matcher->patterns[a];
+	const struct injection_pattern *pb = &matcher->patterns[b];
+	if (pa->rule != pb->rule)
+		return pa->rule < pb->rule;
+	return pa->bytes.length() > pb->bytes.length();
+}
+
+static int injection_matcher_new_state(struct injection_matcher *matcher) {
+	int state = matcher->match.size();
+	matcher->next.resize(matcher->next.size() + 256, -1);
+	matcher->match.push_back(-1);
+	return state;
+}
+
+static void injection_matcher_build(struct injection_matcher *matcher) {
+	injection_matcher_new_state(matcher);
+
+	// Trie of all patterns.
+	for (size_t k = 0; k < matcher->patterns.size(); k++) {
+		const std::string &bytes = matcher->patterns[k].bytes;
+		int state = 0;
+		for (size_t i = 0; i < bytes.length(); i++) {
+			int c = (uint8_t)bytes[i];
+			if (matcher->next[state * 256 + c] < 0) {
+				int child = injection_matcher_new_state(matcher);
+				matcher->next[state * 256 + c] = child;
+			}
+			state = matcher->next[state * 256 + c];
+		}
+		if (injection_pattern_better(matcher, k, matcher->match[state]))
+			matcher->match[state] = k;
+	}
+
+	// Breadth-first pass computing the failure links, folded straight
+	// into the transition table so that matching never backtracks.
+	std::vector<int32_t> fail(matcher->match.size(), 0);
+	std::deque<int> queue;
+	for (int c = 0; c < 256; c++) {
+		int child = matcher->next[c];
+		if (child < 0)
+			matcher->next[c] = 0;
+		else
+			queue.push_back(child);
+	}
+	while (!queue.empty()) {
+		int state = queue.front();
+		queue.pop_front();
+		for (int c = 0; c < 256; c++) {
+			int child = matcher->next[state * 256 + c];
+			int fallback = matcher->next[fail[state] * 256 + c];
+			if (child < 0) {
+				matcher->next[state * 256 + c] = fallback;
+				continue;
+			}
+			fail[child] = fallback;
+			if (matcher->match[fallback] >= 0 &&
+			    injection_pattern_better(matcher, matcher->match[fallback],
+						matcher->match[child]))
+				matcher->match[child] = matcher->match[fallback];
+			queue.push_back(child);
+		}
+	}
+}
+
+// Adds the patterns of one rule. Empty patterns would match everywhere
+// and are skipped.
+static void injection_matcher_add_rule(struct injection_matcher *matcher,
+				const Json::Value &rule) {
+	int index = matcher->replacements.size();
+	std::string replacement_hex = rule["replacement"].asString();
+	matcher->replacements.push_back(hexToAscii(replacement_hex));
+	matcher->replacements_hex.push_back(replacement_hex);
+
+	Json::Value patterns = rule["content_pattern"];
+	for (unsigned int j = 0; j < patterns.size(); j++) {
+		struct injection_pattern pattern;
+		pattern.hex = patterns[j].asString();
+		pattern.bytes = hexToAscii(pattern.hex);
+		pattern.rule = index;
+		if (!pattern.bytes.empty())
+			matcher->patterns.push_back(pattern);
+	}
+}
+
+static struct injection_matcher *injection_matcher_finish(struct injection_matcher *matcher) {
+	if (matcher->patterns.empty()) {
+		delete matcher;
+		return NULL;
+	}
+	injection_matcher_build(matcher);
+	return matcher;
+}
+
+/*----------------------------------------------------------------------*/
+
+static bool injection_field_parse(const Json::Value &spec, struct injection_field *field) {
+	static const char *ops[] = {
+		"set", "add", "scale", "negate", "clamp", "and", "or", "xor", "remap",
+	};
+
+	memset(field, 0, sizeof(*field));
+	field->offset = spec["offset"].asUInt();
+	field->width = spec.get("width", 1).asUInt();
+	field->is_signed = spec["signed"].asBool();
+	if (field->width != 1 && field->width != 2 && field->width != 4) {
+		printf("Field rule at offset %u: width must be 1, 2 or 4\n", field->offset);
+		return false;
+	}
+
+	uint64_t all = (1ULL << (field->width * 8)) - 1;
+	const Json::Value &mask = spec["mask"];
+	if (mask.isString())
+		field->mask = strtoul(mask.asCString(), NULL, 0) & all;
+	else if (mask.isNull())
+		field->mask = all;
+	else
+		field->mask = mask.asUInt() & all;
+	if (!field->mask) {
+		printf("Field rule at offset %u: empty mask\n", field->offset);
+		return false;
+	}
+	field->shift = __builtin_ctz(field->mask);
+	field->bits = __builtin_popcount(field->mask);
+	if ((field->mask >> field->shift) != (uint32_t)((1ULL << field->bits) - 1)) {
+		printf("Field rule at offset %u: mask must be contiguous\n", field->offset);
+		return false;
+	}
+
+	if (field->is_signed) {
+		field->min = -(1LL << (field->bits - 1));
+		field->max = (1LL << (field->bits - 1)) - 1;
+	}
+	else {
+		field->min = 0;
+		field->max = (1LL << field->bits) - 1;
+	}
+
+	std::string op = spec["op"].asString();
+	field->op = -1;
+	for (unsigned int i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+		if (op == ops[i])
+			field->op = i;
+	}
+	switch (field->op) {
+	case INJECTION_FIELD_SCALE:
+		field->value = llround(spec["value"].asDouble() * 65536);
+		break;
+	case INJECTION_FIELD_CLAMP:
+		field->min = std::max(field->min, spec.get("min", (Json::Int64)field->min).asInt64());
+		field->max = std::min(field->max, spec.get("max", (Json::Int64)field->max).asInt64());
+		break;
+	case INJECTION_FIELD_REMAP: {
+		const Json::Value &remap = spec["map"];
+		for (int i = 0; i < 32; i++)
+			field->remap[i] = i < (int)remap.size() ? remap[i].asInt() : i;
+		for (int i = 0; i < field->bits; i++) {
+			if (field->remap[i] < 0 || field->remap[i] >= field->bits) {
+				printf("Field rule at offset %u: map entry out of range\n", field->offset);
+				return false;
+			}
+		}
+		break;
+	}
+	case INJECTION_FIELD_NEGATE:
+		break;
+	case -1:
+		printf("Field rule at offset %u: unknown op \"%s\"\n", field->offset, op.c_str());
+		return false;
+	default:
+		field->value = spec["value"].asInt64();
+		break;
+	}
+	return true;
+}
+
+static void injection_fields_add_rule(std::vector<struct injection_field> *fields,
+				const Json::Value &rule) {
+	const Json::Value &specs = rule["fields"];
+	for (unsigned int i = 0; i < specs.size(); i++) {
+		struct injection_field field;
+		if (injection_field_parse(specs[i], &field))
+			fields->push_back(field);
+	}
+}
+
+void injection_fields_apply(const std::vector<struct injection_field> &fields,
+			char *data, uint32_t length) {
+	uint8_t *bytes = (uint8_t *)data;
+
+	for (size_t i = 0; i < fields.size(); i++) {
+		const struct injection_field *field = &fields[i];
+		if (field->offset + field->width > length)
+			continue;
+
+		uint32_t raw = 0;
+		for (int b = 0; b < field->width; b++)
+			raw |= (uint32_t)bytes[field->offset + b] << (8 * b);
+		uint32_t bits = (raw & field->mask) >> field->shift;
+
+		int64_t value = bits;
+		if (field->is_signed && (bits >> (field->bits - 1)) & 1)
+			value -= 1LL << field->bits;
+
+		switch (field->op) {
+		case INJECTION_FIELD_SET:
+			value = field->value;
+			break;
+		case INJECTION_FIELD_ADD:
+			value += field->value;
+			break;
+		case INJECTION_FIELD_SCALE:
+			// Rounds half away from zero so that small deltas do not
+			// all collapse to zero or drift to one side.
+			value *= field->value;
+			value = value < 0 ? -((-value + 32768) >> 16) : (value + 32768) >> 16;
+			break;
+		case INJECTION_FIELD_NEGATE:
+			value = -value;
+			break;
+		case INJECTION_FIELD_CLAMP:
+			break;
+		case INJECTION_FIELD_AND:
+			value = bits & field->value;
+			break;
+		case INJECTION_FIELD_OR:
+			value = bits | field->value;
+			break;
+		case INJECTION_FIELD_XOR:
+			value = bits ^ field->value;
+			break;
+		case INJECTION_FIELD_REMAP:
+			value = 0;
+			for (int b = 0; b < field->bits; b++)
+				value |= (int64_t)((bits >> field->remap[b]) & 1) << b;
+			break;
+		}
+
+		// Bitwise results are written back as they are.
+		if (field->op < INJECTION_FIELD_AND) {
+			if (value < field->min)
+				value = field->min;
+			else if (value > field->max)
+				value = field->max;
+		}
+
+		raw = (raw & ~field->mask) | (((uint32_t)value << field->shift) & field->mask);
+		for (int b = 0; b < field->width; b++)
+			bytes[field->offset + b] = raw >> (8 * b);
+	}
+}
+
+/*----------------------------------------------------------------------*/
+
+static int injection_type_index(int type) {
+	switch (type) {
+	case USB_ENDPOINT_XFER_ISOC:
+		return 0;
+	case USB_ENDPOINT_XFER_BULK:
+		return 1;
+	case USB_ENDPOINT_XFER_INT:
+		return 2;
+	default:
+		return -1;
+	}
+}
+
+static int injection_address_index(int address) {
+	return (address & USB_ENDPOINT_NUMBER_MASK) | ((address & USB_DIR_IN) ? 16 : 0);
+}
+
+uint64_t injection_control_key(const struct usb_ctrlrequest *ctrl) {
+	return (uint64_t)ctrl->bRequestType << 56 |
+		(uint64_t)ctrl->bRequest << 48 |
+		(uint64_t)ctrl->wValue << 32 |
+		(uint64_t)ctrl->wIndex << 16 |
+		(uint64_t)ctrl->wLength;
+}
+
+// Reads one setup field of a control rule into its place in key and mask.
+// A field that is left out, null or "*" matches any value.
+static void injection_control_field(const Json::Value &rule, const char *name,
+				int shift, uint64_t field_mask,
+				uint64_t *key, uint64_t *mask) {
+	const Json::Value &value = rule[name];
+	if (value.isNull() || (value.isString() && value.asString() == "*"))
+		return;
+	*key |= ((uint64_t)hexToDecimal(value.asInt()) & field_mask) << shift;
+	*mask |= field_mask << shift;
+}
+
+static void injection_control_index_add(struct injection_rules *rules, int i) {
+	const struct injection_control_rule *rule = &rules->control[i];
+
+	for (size_t m = 0; m < rules->control_index.size(); m++) {
+		struct injection_control_index *index = &rules->control_index[m];
+		if (index->mask == rule->mask) {
+			index->rules[rule->key].push_back(i);
+			return;
+		}
+	}
+
+	struct injection_control_index index;
+	index.mask = rule->mask;
+	index.rules[rule->key].push_back(i);
+	rules->control_index.push_back(index);
+}
+
+// Everything allocated so far is reachable from rules, so that it can be
+// freed if a value of the wrong type throws half-way through.
+static void injection_compile_rules(const Json::Value &config,
+				struct injection_rules *rules) {
+	const char *transfer_types[] = {"isoc", "bulk", "int"};
+	for (int t = 0; t < 3; t++) {
+		const Json::Value &list = config[transfer_types[t]];
+		for (unsigned int i = 0; i < list.size(); i++) {
+			const Json::Value &rule = list[i];
+			if (rule["enable"].asBool() != true)
+				continue;
+
+			int address = hexToDecimal(rule["ep_address"].asInt());
+			struct injection_matcher **matcher =
+				&rules->endpoints[t][injection_address_index(address)];
+			if (!*matcher)
+				*matcher = new struct injection_matcher;
+			injection_matcher_add_rule(*matcher, rule);
+			injection_fields_add_rule(&rules->fields[t][injection_address_index(address)], rule);
+			if (rule.isMember("filter")) {
+				struct filter filter;
+				if (filter_compile(rule["filter"], &filter))
+					rules->filters[t][injection_address_index(address)].push_back(filter);
+				else
+					printf("Ignoring the filter of %s rule %u\n", transfer_types[t], i);
+			}
+			rules->num_rules++;
+		}
+		for (int a = 0; a < 32; a++) {
+			if (rules->endpoints[t][a])
+				rules->endpoints[t][a] = injection_matcher_finish(rules->endpoints[t][a]);
+		}
+	}
+
+	const char *control_types[] = {"modify", "ignore", "stall"};
+	const int control_actions[] = {
+		USB_INJECTION_FLAG_NONE,
+		USB_INJECTION_FLAG_IGNORE,
+		USB_INJECTION_FLAG_STALL,
+	};
+	for (int t = 0; t < 3; t++) {
+		const Json::Value &list = config["control"][control_types[t]];
+		for (unsigned int j = 0; j < list.size(); j++) {
+			const Json::Value &rule = list[j];
+			if (rule["enable"].asBool() != true)
+				continue;
+
+			struct injection_control_rule control;
+			control.action = control_actions[t];
+			control.type = control_types[t];
+			control.index = j;
+			control.key = 0;
+			control.mask = 0;
+			injection_control_field(rule, "bRequestType", 56, 0xff, &control.key, &control.mask);
+			injection_control_field(rule, "bRequest", 48, 0xff, &control.key, &control.mask);
+			injection_control_field(rule, "wValue", 32, 0xffff, &control.key, &control.mask);
+			injection_control_field(rule, "wIndex", 16, 0xffff, &control.key, &control.mask);
+			injection_control_field(rule, "wLength", 0, 0xffff, &control.key, &control.mask);
+			control.matcher = NULL;
+			rules->control.push_back(control);
+			if (control.action == USB_INJECTION_FLAG_NONE) {
+				struct injection_matcher **matcher = &rules->control.back().matcher;
+				*matcher = new struct injection_matcher;
+				injection_matcher_add_rule(*matcher, rule);
+				*matcher = injection_matcher_finish(*matcher);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < rules->control.size(); i++)
+		injection_control_index_add(rules, i);
+	rules->num_rules += rules->control.size();
+}
+
+struct injection_rules *injection_compile(const Json::Value &config) {
+	struct injection_rules *rules = new struct injection_rules;
+	rules->num_rules = 0;
+	memset(rules->endpoints, 0, sizeof(rules->endpoints));
+
+	try {
+		injection_compile_rules(config, rules);
+	} catch (const Json::Exception &e) {
+		printf("Error compiling injection rules: %s\n", e.what());
+		injection_free(rules);
+		return NULL;
+	}
+	return rules;
+}
+
+void injection_free(struct injection_rules *rules) {
+	if (!rules)
+		return;
+	for (int t = 0; t < 3; t++) {
+		for (int a = 0; a < 32; a++)
+			delete rules->endpoints[t][a];
+	}
+	for (size_t i = 0; i < rules->control.size(); i++)
+		delete rules->control[i].matcher;
+	delete rules;
+}
+
+const struct injection_matcher *injection_endpoint_matcher(
+			const struct injection_rules *rules,
+			const struct usb_endpoint_descriptor *ep) {
+	int t = injection_type_index(usb_endpoint_type(ep));
+	if (!rules || t < 0)
+		return NULL;
+	return rules->endpoints[t][injection_address_index(ep->bEndpointAddress)];
+}
+
+std::vector<struct filter> *injection_endpoint_filters(
+			struct injection_rules *rules,
+			const struct usb_endpoint_descriptor *ep) {
+	int t = injection_type_index(usb_endpoint_type(ep));
+	if (!rules || t < 0)
+		return NULL;
+	std::vector<struct filter> *filters =
+		&rules->filters[t][injection_address_index(ep->bEndpointAddress)];
+	return filters->empty() ? NULL : filters;
+}
+
+const std::vector<struct injection_field> *injection_endpoint_fields(
+			const struct injection_rules *rules,
+			const struct usb_endpoint_descriptor *ep) {
+	int t = injection_type_index(usb_endpoint_type(ep));
+	if (!rules || t < 0)
+		return NULL;
+	const std::vector<struct injection_field> *fields =
+		&rules->fields[t][injection_address_index(ep->bEndpointAddress)];
+	return fields->empty() ? NULL : fields;
+}
+
+int injection_control_lookup(const struct injection_rules *rules,
+			const struct usb_ctrlrequest *ctrl, int *matches) {
+	uint64_t key = injection_control_key(ctrl);
+	int num_matches = 0;
+
+	if (!rules)
+		return 0;
+
+	for (size_t m = 0; m < rules->control_index.size(); m++) {
+		const struct injection_control_index *index = &rules->control_index[m];
+		auto it = index->rules.find(key & index->mask);
+		if (it == index->rules.end())
+			continue;
+		for (size_t i = 0; i < it->second.size() &&
+				num_matches < INJECTION_MAX_CONTROL_MATCHES; i++)
+			matches[num_matches++] = it->second[i];
+	}
+
+	// Rules found under different masks still apply in config order.
+	if (rules->control_index.size() > 1)
+		std::sort(matches, matches + num_matches);
+	return num_matches;
+}
+
+/*----------------------------------------------------------------------*/
+
+struct injection_match {
+	uint32_t	start;
+	int		pattern;
+};
+
+bool injection_apply(const struct injection_matcher *matcher, char *data,
+			uint32_t *length, uint32_t capacity) {
+	struct injection_match matches[INJECTION_MAX_MATCHES];
+	int num_matches = 0;
+	int rule = -1;
+	uint32_t end = 0;
+
+	if (!matcher)
+		return false;
+
+	// Like before, only the first rule that matches modifies the data, so
+	// find it before collecting matches: a match of a later rule must not
+	// use up bytes that one of the winning rule overlaps. match[state] is
+	// the pattern of the lowest rule ending at a position, and the first
+	// one seen of the winning rule is the first match to replace.
+	const int32_t *next = matcher->next.data();
+	const int32_t *match = matcher->match.data();
+	int state = 0;
+	for (uint32_t i = 0; i < *length && rule != 0; i++) {
+		state = next[state * 256 + (uint8_t)data[i]];
+		int k = match[state];
+		if (k < 0 || (rule >= 0 && matcher->patterns[k].rule >= rule))
+			continue;
+		rule = matcher->patterns[k].rule;
+		matches[0].start = i + 1 - matcher->patterns[k].bytes.length();
+		matches[0].pattern = k;
+		end = i + 1;
+	}
+
+	if (rule < 0)
+		return false;
+	num_matches = 1;
+
+	// The non-overlapping matches of that rule after the first: the
+	// automaton restarts right behind each.
+	state = 0;
+	for (uint32_t i = end; i < *length && num_matches < INJECTION_MAX_MATCHES; i++) {
+		state = next[state * 256 + (uint8_t)data[i]];
+		int k = match[state];
+		if (k < 0 || matcher->patterns[k].rule != rule)
+			continue;
+		matches[num_matches].start = i + 1 - matcher->patterns[k].bytes.length();
+		matches[num_matches].pattern = k;
+		num_matches++;
+		state = 0;
+	}
+
+	// The result is built in a per-thread buffer that is allocated once.
+	static thread_local std::vector<char> scratch;
+	if (scratch.size() < capacity)
+		scratch.resize(capacity);
+
+	const std::string &replacement = matcher->replacements[rule];
+	uint32_t in = 0, out = 0;
+	bool modified = false;
+	for (int m = 0; m < num_matches; m++) {
+		const struct injection_pattern *pattern = &matcher->patterns[matches[m].pattern];
+		uint32_t start = matches[m].start;
+		uint32_t grown = out + (start - in) + replacement.length() + (*length - start - pattern->bytes.length());
+		if (grown > capacity)
+			break;
+
+		memcpy(&scratch[out], data + in, start - in);
+		out += start - in;
+		memcpy(&scratch[out], replacement.data(), replacement.length());
+		printf("Modified from %s to %s at Index %u\n", pattern->hex.c_str(),
+			matcher->replacements_hex[rule].c_str(), out);
+		out += replacement.length();
+		in = start + pattern->bytes.length();
+		modified = true;
+	}
+
+	if (!modified)
+		return false;
+
+	memcpy(&scratch[out], data + in, *length - in);
+	out += *length - in;
+	memcpy(data, scratch.data(), out);
+	*length = out;
+	return true;
+}
+
+/*----------------------------------------------------------------------*/
+
+bool injection_load(const std::string &file, Json::Value &config) {
+	Json::Reader jsonReader;
+	std::ifstream ifs(file.c_str());
+	if (!ifs.is_open()) {
+		printf("Injection file %s not found\n", file.c_str());
+		return false;
+	}
+	if (!jsonReader.parse(ifs, config)) {
+		printf("Error parsing injection file: %s\n", file.c_str());
+		return false;
+	}
+	return true;
+}
+
+static std::thread injection_watch_thread;
+static int injection_wake_fd = -1;
+static std::atomic<bool> injection_please_stop(false);
+
+static void injection_reload() {
+	auto start = std::chrono::steady_clock::now();
+
+	// A file that is still being written fails to parse; the write that
+	// completes it triggers another reload.
+	Json::Value config;
+	if (!injection_load(injection_file, config)) {
+		printf("Keeping the current injection rules\n");
+		return;
+	}
+	struct injection_rules *rules = injection_compile(config);
+	if (!rules) {
+		printf("Keeping the current injection rules\n");
+		return;
+	}
+	struct injection_rules *old = injection_rules.exchange(rules);
+	rcu_synchronize(&injection_rcu);
+	injection_free(old);
+
+	double ms = std::chrono::duration<double, std::milli>(
+			std::chrono::steady_clock::now() - start).count();
+	printf("Reloaded injection file %s: %d rules in %.3f ms\n",
+		injection_file.c_str(), rules->num_rules, ms);
+}
+
+static void injection_watch_loop(int inotify_fd, std::string name) {
+	printf("Start injection watch thread, thread id(%d)\n", gettid());
+
+	struct pollfd fds[2];
+	fds[0].fd = injection_wake_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = inotify_fd;
+	fds[1].events = POLLIN;
+
+	while (true) {
+		if (poll(fds, inotify_fd < 0 ? 1 : 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll()");
+			break;
+		}
+
+		bool reload = false;
+		if (fds[0].revents & POLLIN) {
+			uint64_t value;
+			if (read(injection_wake_fd, &value, sizeof(value)) < 0 && errno != EINTR) {
+				perror("read() injection eventfd");
+				break;
+			}
+			if (injection_please_stop.load())
+				break;
+			reload = true;
+		}
+
+		if (inotify_fd >= 0 && (fds[1].revents & POLLIN)) {
+			char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+			ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+			for (char *p = buffer; len > 0 && p < buffer + len; ) {
+				struct inotify_event *event = (struct inotify_event *)p;
+				if (event->len && name == event->name)
+					reload = true;
+				p += sizeof(struct inotify_event) + event->len;
+			}
+		}
+
+		if (reload)
+			injection_reload();
+	}
+
+	if (inotify_fd >= 0)
+		close(inotify_fd);
+	printf("End injection watch thread, thread id(%d)\n", gettid());
+}
+
+void injection_watch_start() {
+	injection_wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (injection_wake_fd < 0) {
+		perror("eventfd()");
+		exit(EXIT_FAILURE);
+	}
+
+	// Watch the directory rather than the file, so that editors that save
+	// by renaming a new file over the old one are noticed too.
+	std::string path = injection_file;
+	std::string dir = dirname(&path[0]);
+	path = injection_file;
+	std::string name = basename(&path[0]);
+
+	int inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (inotify_fd < 0)
+		perror("inotify_init1() (non-fatal)");
+	else if (inotify_add_watch(inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		perror("inotify_add_watch() (non-fatal)");
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+
+	injection_watch_thread = std::thread(injection_watch_loop, inotify_fd, name);
+}
+
+void injection_watch_stop() {
+	if (!injection_watch_thread.joinable())
+		return;
+	injection_please_stop.store(true);
+	injection_request_reload();
+	injection_watch_thread.join();
+	close(injection_wake_fd);
+	injection_wake_fd = -1;
+}
+
+void injection_request_reload() {
+	uint64_t value = 1;
+	if (injection_wake_fd >= 0 &&
+	    write(injection_wake_fd, &value, sizeof(value)) < 0) {
+		// Nothing to report from a signal handler; the counter can only
+		// overflow with a reload pending anyway.
+	}
+}
@@ -0,0 +1,147 @@
+#ifndef INJECTION_H
+#define INJECTION_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "host-raw-gadget.h"
+#include "rcu.h"
+#include "filter.h"
+
+// Replacements applied by one call stop after this many matches.
+#define INJECTION_MAX_MATCHES	64
+
+// Control rules applied to one setup packet.
+#define INJECTION_MAX_CONTROL_MATCHES	32
+
+struct injection_pattern {
+	std::string	bytes;
+	std::string	hex;
+	int		rule;
+};
+
+// Aho-Corasick automaton over the content patterns of the rules of one
+// endpoint, flattened into a DFA: next[state * 256 + byte] is the next
+// state and match[state] the pattern reported there (-1 if none). Matching
+// every pattern is a single pass over the payload.
+struct injection_matcher {
+	std::vector<struct injection_pattern>	patterns;
+	std::vector<std::string>		replacements;
+	std::vector<std::string>		replacements_hex;
+	std::vector<int32_t>			next;
+	std::vector<int32_t>			match;
+};
+
+enum injection_field_op {
+	INJECTION_FIELD_SET,
+	INJECTION_FIELD_ADD,
+	INJECTION_FIELD_SCALE,
+	INJECTION_FIELD_NEGATE,
+	INJECTION_FIELD_CLAMP,
+	INJECTION_FIELD_AND,
+	INJECTION_FIELD_OR,
+	INJECTION_FIELD_XOR,
+	INJECTION_FIELD_REMAP,
+};
+
+// One field of a fixed-format report: the bits in mask of the width-byte
+// little-endian integer at offset. Arithmetic results saturate to what the
+// field can hold (min..max); scale is value / 65536.
+struct injection_field {
+	uint16_t	offset;
+	uint8_t		width;
+	uint8_t		shift;
+	uint8_t		bits;
+	bool		is_signed;
+	uint32_t	mask;
+	int		op;
+	int64_t		value;
+	int64_t		min;
+	int64_t		max;
+	int8_t		remap[32];
+};
+
+// The five setup packet fields packed into one 64-bit key, see
+// injection_control_key(). mask has the bits of wildcard fields cleared.
+struct injection_control_rule {
+	int				action;
+	const char			*type;
+	int				index;
+	uint64_t			key;
+	uint64_t			mask;
+	struct injection_matcher	*matcher;
+};
+
+// Control rules sharing one wildcard mask, hashed on their masked key.
+// Values are indexes into injection_rules::control.
+struct injection_control_index {
+	uint64_t						mask;
+	std::unordered_map<uint64_t, std::vector<int>>		rules;
+};
+
+// Injection rules compiled from injection_config. Endpoint matchers are
+// indexed by transfer type (isoc, bulk, int) and endpoint address. Control
+// rules are kept in config order (modify, ignore, stall) and found through
+// one hash lookup per distinct wildcard mask, at most 32 of them.
+struct injection_rules {
+	int					num_rules;
+	struct injection_matcher		*endpoints[3][32];
+	std::vector<struct injection_field>	fields[3][32];
+	std::vector<struct filter>		filters[3][32];
+	std::vector<struct injection_control_rule>	control;
+	std::vector<struct injection_control_index>	control_index;
+};
+
+// The rule set in use. Readers load it between rcu_read_lock() and
+// rcu_read_unlock() on injection_rcu; a reload publishes a new set and
+// frees the old one after rcu_synchronize().
+extern std::atomic<struct injection_rules *> injection_rules;
+extern struct rcu_domain injection_rcu;
+
+bool injection_load(const std::string &file, Json::Value &config);
+// Returns NULL if a rule has a value of the wrong type.
+struct injection_rules *injection_compile(const Json::Value &config);
+void injection_free(struct injection_rules *rules);
+
+// Reloads injection_file on SIGHUP, a "+reload" UDP command or whenever
+// the file is written, from a thread of its own.
+void injection_watch_start();
+void injection_watch_stop();
+
+// Async-signal-safe.
+void injection_request_reload();
+
+const struct injection_matcher *injection_endpoint_matcher(
+			const struct injection_rules *rules,
+			const struct usb_endpoint_descriptor *ep);
+
+const std::vector<struct injection_field> *injection_endpoint_fields(
+			const struct injection_rules *rules,
+			const struct usb_endpoint_descriptor *ep);
+
+// Filters keep state between packets and are run by the one thread that
+// handles the endpoint.
+std::vector<struct filter> *injection_endpoint_filters(
+			struct injection_rules *rules,
+			const struct usb_endpoint_descriptor *ep);
+
+// Rewrites the fields that lie within length bytes of data in place.
+void injection_fields_apply(const std::vector<struct injection_field> &fields,
+			char *data, uint32_t length);
+
+uint64_t injection_control_key(const struct usb_ctrlrequest *ctrl);
+
+// Stores the indexes of the control rules matching ctrl in matches, in
+// config order, and returns how many there are.
+int injection_control_lookup(const struct injection_rules *rules,
+			const struct usb_ctrlrequest *ctrl, int *matches);
+
+// Rewrites data in place, growing it up to capacity bytes. Returns whether
+// anything was replaced.
+bool injection_apply(const struct injection_matcher *matcher, char *data,
+			uint32_t *length, uint32_t capacity);
+
+#endif // INJECTION_H
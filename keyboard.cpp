@@ -0,0 +1,221 @@
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+
+#include "keyboard.h"
+
+struct key_name {
+	const char	*name;
+	int		usage;
+};
+
+static const struct key_name key_names[] = {
+	{ "enter", 0x28 }, { "return", 0x28 }, { "esc", 0x29 }, { "escape", 0x29 },
+	{ "backspace", 0x2a }, { "tab", 0x2b }, { "space", 0x2c }, { "capslock", 0x39 },
+	{ "f1", 0x3a }, { "f2", 0x3b }, { "f3", 0x3c }, { "f4", 0x3d }, { "f5", 0x3e },
+	{ "f6", 0x3f }, { "f7", 0x40 }, { "f8", 0x41 }, { "f9", 0x42 }, { "f10", 0x43 },
+	{ "f11", 0x44 }, { "f12", 0x45 }, { "printscreen", 0x46 }, { "scrolllock", 0x47 },
+	{ "pause", 0x48 }, { "insert", 0x49 }, { "home", 0x4a }, { "pageup", 0x4b },
+	{ "delete", 0x4c }, { "end", 0x4d }, { "pagedown", 0x4e }, { "right", 0x4f },
+	{ "left", 0x50 }, { "down", 0x51 }, { "up", 0x52 }, { "numlock", 0x53 },
+	{ "menu", 0x65 },
+	{ "ctrl", 0xe0 }, { "lctrl", 0xe0 }, { "shift", 0xe1 }, { "lshift", 0xe1 },
+	{ "alt", 0xe2 }, { "lalt", 0xe2 }, { "gui", 0xe3 }, { "lgui", 0xe3 },
+	{ "win", 0xe3 }, { "rctrl", 0xe4 }, { "rshift", 0xe5 }, { "ralt", 0xe6 },
+	{ "altgr", 0xe6 }, { "rgui", 0xe7 },
+};
+
+static const struct key_name consumer_names[] = {
+	{ "playpause", 0xcd }, { "next", 0xb5 }, { "prev", 0xb6 }, { "previous", 0xb6 },
+	{ "stop", 0xb7 }, { "mute", 0xe2 }, { "volup", 0xe9 }, { "voldown", 0xea },
+	{ "brightnessup", 0x6f }, { "brightnessdown", 0x70 }, { "mail", 0x18a },
+	{ "calculator", 0x192 }, { "browser", 0x196 }, { "search", 0x221 },
+	{ "homepage", 0x223 }, { "back", 0x224 }, { "forward", 0x225 },
+};
+
+// Printable ASCII from ' ' on: usage and Shift on a US layout.
+static const uint8_t key_ascii[][2] = {
+	{ 0x2c, 0 }, { 0x1e, 1 }, { 0x34, 1 }, { 0x20, 1 }, { 0x21, 1 }, { 0x22, 1 }, { 0x24, 1 }, { 0x34, 0 },	//  !"#$%&'
+	{ 0x26, 1 }, { 0x27, 1 }, { 0x25, 1 }, { 0x2e, 1 }, { 0x36, 0 }, { 0x2d, 0 }, { 0x37, 0 }, { 0x38, 0 },	// ()*+,-./
+	{ 0x27, 0 }, { 0x1e, 0 }, { 0x1f, 0 }, { 0x20, 0 }, { 0x21, 0 }, { 0x22, 0 }, { 0x23, 0 }, { 0x24, 0 },	// 01234567
+	{ 0x25, 0 }, { 0x26, 0 }, { 0x33, 1 }, { 0x33, 0 }, { 0x36, 1 }, { 0x2e, 0 }, { 0x37, 1 }, { 0x38, 1 },	// 89:;<=>?
+	{ 0x1f, 1 }, { 0x04, 1 }, { 0x05, 1 }, { 0x06, 1 }, { 0x07, 1 }, { 0x08, 1 }, { 0x09, 1 }, { 0x0a, 1 },	// @ABCDEFG
+	{ 0x0b, 1 }, { 0x0c, 1 }, { 0x0d, 1 }, { 0x0e, 1 }, { 0x0f, 1 }, { 0x10, 1 }, { 0x11, 1 }, { 0x12, 1 },	// HIJKLMNO
+	{ 0x13, 1 }, { 0x14, 1 }, { 0x15, 1 }, { 0x16, 1 }, { 0x17, 1 }, { 0x18, 1 }, { 0x19, 1 }, { 0x1a, 1 },	// PQRSTUVW
+	{ 0x1b, 1 }, { 0x1c, 1 }, { 0x1d, 1 }, { 0x2f, 0 }, { 0x31, 0 }, { 0x30, 0 }, { 0x23, 1 }, { 0x2d, 1 },	// XYZ[\]^_
+	{ 0x35, 0 }, { 0x04, 0 }, { 0x05, 0 }, { 0x06, 0 }, { 0x07, 0 }, { 0x08, 0 }, { 0x09, 0 }, { 0x0a, 0 },	// `abcdefg
+	{ 0x0b, 0 }, { 0x0c, 0 }, { 0x0d, 0 }, { 0x0e, 0 }, { 0x0f, 0 }, { 0x10, 0 }, { 0x11, 0 }, { 0x12, 0 },	// hijklmno
+	{ 0x13, 0 }, { 0x14, 0 }, { 0x15, 0 }, { 0x16, 0 }, { 0x17, 0 }, { 0x18, 0 }, { 0x19, 0 }, { 0x1a, 0 },	// pqrstuvw
+	{ 0x1b, 0 }, { 0x1c, 0 }, { 0x1d, 0 }, { 0x2f, 1 }, { 0x31, 1 }, { 0x30, 1 }, { 0x35, 1 },		// xyz{|}~
+};
+
+struct key_state *key_state_create() {
+	struct key_state *keys = new struct key_state;
+	for (int i = 0; i < 4; i++) {
+		keys->held[i].store(0, std::memory_order_relaxed);
+		keys->physical[i] = 0;
+	}
+	for (int i = 0; i < KEY_CONSUMER_MAX; i++) {
+		keys->consumer[i].store(0, std::memory_order_relaxed);
+		keys->physical_consumer[i] = 0;
+	}
+	keys->physical_consumers = 0;
+	return keys;
+}
+
+void key_state_destroy(struct key_state *keys) {
+	delete keys;
+}
+
+void key_state_press(struct key_state *keys, int usage, bool down) {
+	if (!usage && !down) {
+		for (int i = 0; i < 4; i++)
+			keys->held[i].store(0, std::memory_order_relaxed);
+		return;
+	}
+	if (usage <= 0 || usage > 0xff)
+		return;
+	uint64_t bit = 1ULL << (usage % 64);
+	if (down)
+		keys->held[usage / 64].fetch_or(bit, std::memory_order_relaxed);
+	else
+		keys->held[usage / 64].fetch_and(~bit, std::memory_order_relaxed);
+}
+
+bool key_state_press_consumer(struct key_state *keys, int usage, bool down) {
+	int free_slot = -1;
+	for (int i = 0; i < KEY_CONSUMER_MAX; i++) {
+		uint16_t held = keys->consumer[i].load(std::memory_order_relaxed);
+		if (held == usage) {
+			if (!down)
+				keys->consumer[i].store(0, std::memory_order_relaxed);
+			return true;
+		}
+		if (!held && free_slot < 0)
+			free_slot = i;
+	}
+	if (!down)
+		return true;
+	if (free_slot < 0)
+		return false;
+	keys->consumer[free_slot].store(usage, std::memory_order_relaxed);
+	return true;
+}
+
+void key_state_held(struct key_state *keys, uint64_t *held) {
+	for (int i = 0; i < 4; i++)
+		held[i] = keys->held[i].load(std::memory_order_relaxed);
+}
+
+int key_state_held_consumer(struct key_state *keys, uint16_t *usages) {
+	int n = 0;
+	for (int i = 0; i < KEY_CONSUMER_MAX; i++) {
+		uint16_t usage = keys->consumer[i].load(std::memory_order_relaxed);
+		if (usage)
+			usages[n++] = usage;
+	}
+	return n;
+}
+
+// Appends the usages of add missing from usages, up to max in all.
+static int key_union(uint16_t *usages, int n, const uint16_t *add, int count, int max) {
+	for (int i = 0; i < count && n < max; i++) {
+		int j;
+		for (j = 0; j < n && usages[j] != add[i]; j++)
+			;
+		if (j == n)
+			usages[n++] = add[i];
+	}
+	return n;
+}
+
+void key_state_merge(struct key_state *keys, const struct hid_codec *codec,
+			struct usb_raw_transfer_io *io, bool injected) {
+	uint8_t *report = (uint8_t *)io->data;
+	int length = io->inner.length;
+
+	if (hid_is_keyboard_report(codec, report, length)) {
+		uint64_t set[4], merged[4];
+		// A report in ErrorRollOver goes out as it is.
+		if (!hid_keyboard_decode(codec, report, set))
+			return;
+		bool changed = false;
+		for (int i = 0; i < 4; i++) {
+			if (injected)
+				merged[i] = set[i] | keys->physical[i];
+			else {
+				keys->physical[i] = set[i];
+				merged[i] = set[i] | keys->held[i].load(std::memory_order_relaxed);
+			}
+			changed |= merged[i] != set[i];
+		}
+		if (changed)
+			hid_keyboard_encode(codec, merged, report);
+	}
+	else if (hid_is_consumer_report(codec, report, length)) {
+		uint16_t usages[2 * KEY_CONSUMER_MAX], held[KEY_CONSUMER_MAX];
+		int n = hid_consumer_decode(codec, report, usages, KEY_CONSUMER_MAX);
+		int merged;
+		if (injected)
+			merged = key_union(usages, n, keys->physical_consumer,
+					keys->physical_consumers, 2 * KEY_CONSUMER_MAX);
+		else {
+			memcpy(keys->physical_consumer, usages, n * sizeof(usages[0]));
+			keys->physical_consumers = n;
+			merged = key_union(usages, n, held, key_state_held_consumer(keys, held),
+					2 * KEY_CONSUMER_MAX);
+		}
+		if (merged != n)
+			hid_consumer_encode(codec, usages, merged, report);
+	}
+}
+
+/*----------------------------------------------------------------------*/
+
+static int key_hex_usage(const std::string& name, int max) {
+	if (name.size() < 3 || name[0] != '0' || (name[1] != 'x' && name[1] != 'X'))
+		return -1;
+	char *end;
+	long usage = strtol(name.c_str() + 2, &end, 16);
+	if (*end || usage <= 0 || usage > max)
+		return -1;
+	return usage;
+}
+
+int key_usage(const std::string& name) {
+	int usage;
+	bool shift;
+	if (name.size() == 1 && key_from_char(name[0], &usage, &shift))
+		return usage;
+	for (size_t i = 0; i < sizeof(key_names) / sizeof(key_names[0]); i++) {
+		if (!strcasecmp(name.c_str(), key_names[i].name))
+			return key_names[i].usage;
+	}
+	return key_hex_usage(name, 0xff);
+}
+
+int key_consumer_usage(const std::string& name) {
+	for (size_t i = 0; i < sizeof(consumer_names) / sizeof(consumer_names[0]); i++) {
+		if (!strcasecmp(name.c_str(), consumer_names[i].name))
+			return consumer_names[i].usage;
+	}
+	return key_hex_usage(name, 0xffff);
+}
+
+bool key_from_char(char c, int *usage, bool *shift) {
+	if (c == '\n') {
+		*usage = 0x28;
+		*shift = false;
+		return true;
+	}
+	if (c == '\t') {
+		*usage = 0x2b;
+		*shift = false;
+		return true;
+	}
+	if (c < ' ' || c > '~')
+		return false;
+	*usage = key_ascii[c - ' '][0];
+	*shift = key_ascii[c - ' '][1];
+	return true;
+}
@@ -0,0 +1,57 @@
+#ifndef KEYBOARD_H
+#define KEYBOARD_H
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+#include "host-raw-gadget.h"
+#include "hid-report.h"
+
+// Media keys injection holds down at once.
+#define KEY_CONSUMER_MAX	4
+
+// Keyboard and media keys held down by injection on one HID interrupt IN
+// endpoint. The UDP server changes held and consumer; the endpoint writer
+// adds them to every keyboard and consumer report the device sends, and
+// adds the keys held on the device to every injected one, so that neither
+// side releases the other's keys. Key sets are as in hid-report.h.
+struct key_state {
+	std::atomic<uint64_t>	held[4];
+	std::atomic<uint16_t>	consumer[KEY_CONSUMER_MAX];
+
+	// Writer only: keys held in the last real reports written.
+	uint64_t		physical[4];
+	uint16_t		physical_consumer[KEY_CONSUMER_MAX];
+	int			physical_consumers;
+};
+
+struct key_state *key_state_create();
+void key_state_destroy(struct key_state *keys);
+
+// UDP server side. usage 0 with down false releases every key.
+void key_state_press(struct key_state *keys, int usage, bool down);
+// Returns false if KEY_CONSUMER_MAX media keys are held already.
+bool key_state_press_consumer(struct key_state *keys, int usage, bool down);
+void key_state_held(struct key_state *keys, uint64_t *held);
+int key_state_held_consumer(struct key_state *keys, uint16_t *usages);
+
+// Writer side, for every report about to be written on the endpoint;
+// injected tells whether it came from the injection lane.
+void key_state_merge(struct key_state *keys, const struct hid_codec *codec,
+			struct usb_raw_transfer_io *io, bool injected);
+
+// Keyboard page usage of a key name: a character ("a", "5", "/"), a
+// named key ("enter", "lshift", "f5") or a hex usage ("0x04"). -1 if
+// unknown.
+int key_usage(const std::string& name);
+
+// Consumer page usage of a media key name ("playpause", "volup") or a hex
+// usage. -1 if unknown.
+int key_consumer_usage(const std::string& name);
+
+// Key and Shift state that type c on a US layout. Returns false if c
+// cannot be typed.
+bool key_from_char(char c, int *usage, bool *shift);
+
+#endif // KEYBOARD_H
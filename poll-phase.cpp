@@ -0,0 +1,117 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "ep-queue.h"
+#include "poll-phase.h"
+
+int poll_move_step = 0;
+
+uint64_t poll_clock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct poll_estimator *poll_estimator_create(const struct usb_endpoint_descriptor *ep) {
+	struct poll_estimator *poll = new struct poll_estimator;
+
+	// The gadget runs at high speed, where bInterval counts 2^(n-1)
+	// microframes. It only seeds the estimate: a full-speed descriptor
+	// passed through as is gets polled at whatever rate the host picks.
+	int interval = ep->bInterval;
+	if (interval < 1)
+		interval = 1;
+	if (interval > 16)
+		interval = 16;
+	poll->nominal_ns = 125000ULL << (interval - 1);
+	poll->last_ns = 0;
+	poll->period_ns.store(poll->nominal_ns, std::memory_order_relaxed);
+	poll->phase_error_ns.store(0, std::memory_order_relaxed);
+	poll->samples.store(0, std::memory_order_relaxed);
+	return poll;
+}
+
+void poll_estimator_destroy(struct poll_estimator *poll) {
+	delete poll;
+}
+
+void poll_estimator_update(struct poll_estimator *poll, uint64_t issued, uint64_t done) {
+	uint64_t last = poll->last_ns;
+	poll->last_ns = done;
+	if (!last || issued < last)
+		return;
+
+	uint64_t period = poll->period_ns.load(std::memory_order_relaxed);
+	uint64_t interval = done - last;
+	uint64_t samples = poll->samples.load(std::memory_order_relaxed);
+
+	// A write issued in the first half of the interval was waiting for
+	// the next poll: had the host polled in between, that poll would have
+	// been at least half an interval after the write.
+	if (issued - last < interval / 2) {
+		int64_t delta = (int64_t)interval - (int64_t)period;
+		period += samples < POLL_LOCK_SAMPLES ? delta / 2 : delta / 8;
+		poll->period_ns.store(period, std::memory_order_relaxed);
+		poll->samples.store(samples + 1, std::memory_order_relaxed);
+	}
+
+	// Phase error: how far the completion was from the first poll
+	// expected after the write was issued.
+	uint64_t predicted = last + ((issued - last) / period + 1) * period;
+	uint64_t error = done > predicted ? done - predicted : predicted - done;
+	if (error > period / 2)
+		return;
+	uint64_t phase_error = poll->phase_error_ns.load(std::memory_order_relaxed);
+	phase_error += ((int64_t)error - (int64_t)phase_error) / 8;
+	poll->phase_error_ns.store(phase_error, std::memory_order_relaxed);
+}
+
+uint64_t poll_estimator_release(struct poll_estimator *poll, uint64_t now) {
+	uint64_t period = poll->period_ns.load(std::memory_order_relaxed);
+	if (poll->samples.load(std::memory_order_relaxed) < POLL_LOCK_SAMPLES ||
+	    !poll->last_ns || now < poll->last_ns || period > POLL_MAX_PERIOD)
+		return 0;
+
+	uint64_t next = poll->last_ns + ((now - poll->last_ns) / period + 1) * period;
+	uint64_t lead = POLL_RELEASE_LEAD +
+		2 * poll->phase_error_ns.load(std::memory_order_relaxed);
+	if (lead > period / 2)
+		lead = period / 2;
+	return next - lead;
+}
+
+bool poll_estimator_hold(struct poll_estimator *poll, struct ep_queue *queue) {
+	uint64_t now = poll_clock();
+	uint64_t release = poll_estimator_release(poll, now);
+	if (!release || release <= now)
+		return false;
+
+	// Wait on the queue rather than sleep, so that a real report ends the
+	// hold as soon as it is published. Injections wake us too; the caller
+	// then simply holds again.
+	if (!ep_queue_arm_lane(queue, 0))
+		return true;
+
+	struct pollfd fd;
+	fd.fd = queue->wake_fd;
+	fd.events = POLLIN;
+	while (now < release) {
+		struct timespec ts;
+		ts.tv_sec = (release - now) / 1000000000;
+		ts.tv_nsec = (release - now) % 1000000000;
+		int rv = ppoll(&fd, 1, &ts, NULL);
+		if (rv > 0) {
+			ep_queue_ack(queue);
+			return true;
+		}
+		if (rv < 0 && errno != EINTR) {
+			perror("ppoll()");
+			break;
+		}
+		now = poll_clock();
+	}
+	ep_queue_disarm(queue);
+	return true;
+}
@@ -0,0 +1,58 @@
+#ifndef POLL_PHASE_H
+#define POLL_PHASE_H
+
+#include <atomic>
+#include <stdint.h>
+
+#include "host-raw-gadget.h"
+
+struct ep_queue;
+
+// Samples needed before the estimate is used for scheduling.
+#define POLL_LOCK_SAMPLES	8
+
+// Injections are released this long before the expected poll, plus twice
+// the phase error, to cover the ioctl and wakeup latency.
+#define POLL_RELEASE_LEAD	50000
+
+// Endpoints polled more slowly than this are never held back.
+#define POLL_MAX_PERIOD		16000000
+
+// Largest X/Y delta one injected mouse report carries; bigger moves are
+// split into one report per poll. 0 disables splitting.
+extern int poll_move_step;
+
+// Learns when the host polls an interrupt IN endpoint. Every
+// usb_raw_ep_write() on such an endpoint returns right after the host
+// polled it, so completion times are poll times; the period is learnt
+// from writes that were already queued when the previous one completed
+// and thus went out on the very next poll.
+//
+// Only the endpoint writer updates it; the stats reporter and injectors
+// read the atomics.
+struct poll_estimator {
+	uint64_t		nominal_ns;
+	uint64_t		last_ns;
+	std::atomic<uint64_t>	period_ns;
+	std::atomic<uint64_t>	phase_error_ns;
+	std::atomic<uint64_t>	samples;
+};
+
+uint64_t poll_clock();
+
+struct poll_estimator *poll_estimator_create(const struct usb_endpoint_descriptor *ep);
+void poll_estimator_destroy(struct poll_estimator *poll);
+
+// Records a write issued at issued that completed at done.
+void poll_estimator_update(struct poll_estimator *poll, uint64_t issued, uint64_t done);
+
+// Time at which a report should be released to make the next expected
+// poll, 0 while the estimate is not usable.
+uint64_t poll_estimator_release(struct poll_estimator *poll, uint64_t now);
+
+// Sleeps until the release time of the next poll if that is still ahead,
+// or until a real report is published on queue's data lane. Returns
+// whether it held.
+bool poll_estimator_hold(struct poll_estimator *poll, struct ep_queue *queue);
+
+#endif // POLL_PHASE_H
@@ -1,104 +1,172 @@
+#include <cinttypes>
 #include <vector>
 
 #include "host-raw-gadget.h"
 #include "device-libusb.h"
+#include "ep-queue.h"
+#include "stats.h"
+#include "reactor.h"
+#include "injection.h"
+#include "ep-routes.h"
+#include "fusion.h"
+#include "poll-phase.h"
+#include "inject-ack.h"
+#include "report-tap.h"
+#include "hid-report.h"
+#include "keyboard.h"
 #include "proxy.h"
 #include "misc.h"
 #include "udp_server.h"
 
-void injection(struct usb_raw_transfer_io &io, Json::Value patterns, std::string replacement_hex, bool &data_modified) {
-	std::string data(io.data, io.inner.length);
-	std::string replacement = hexToAscii(replacement_hex);
-	for (unsigned int j = 0; j < patterns.size(); j++) {
-		std::string pattern_hex = patterns[j].asString();
-		std::string pattern = hexToAscii(pattern_hex);
-
-		std::string::size_type pos = data.find(pattern);
-		while (pos != std::string::npos) {
-			if (data.length() - pattern.length() + replacement.length() > 1023)
-				break;
-
-			data = data.replace(pos, pattern.length(), replacement);
-			printf("Modified from %s to %s at Index %ld\n", pattern_hex.c_str(), replacement_hex.c_str(), pos);
-			data_modified = true;
-
-			pos = data.find(pattern);
+void injection(struct usb_raw_control_event &event, struct usb_raw_transfer_io &io, int &injection_flags) {
+	int matches[INJECTION_MAX_CONTROL_MATCHES];
+	int rcu = rcu_read_lock(&injection_rcu);
+	const struct injection_rules *rules = injection_rules.load();
+	int num_matches = injection_control_lookup(rules, &event.ctrl, matches);
+
+	for (int i = 0; i < num_matches; i++) {
+		const struct injection_control_rule *rule = &rules->control[matches[i]];
+
+		printf("Matched injection rule: %s, index: %d\n", rule->type, rule->index);
+		switch (rule->action) {
+		case USB_INJECTION_FLAG_NONE:
+			injection_apply(rule->matcher, io.data, &io.inner.length, sizeof(io.data));
+			if (!(event.ctrl.bRequestType & USB_DIR_IN))
+				event.ctrl.wLength = io.inner.length;
+			break;
+		case USB_INJECTION_FLAG_IGNORE:
+			printf("Ignore this control transfer\n");
+			injection_flags = USB_INJECTION_FLAG_IGNORE;
+			break;
+		case USB_INJECTION_FLAG_STALL:
+			injection_flags = USB_INJECTION_FLAG_STALL;
+			break;
 		}
 	}
+	rcu_read_unlock(&injection_rcu, rcu);
+}
 
-	if (data_modified) {
-		io.inner.length = data.length();
-		for (size_t j = 0; j < data.length(); j++) {
-			io.data[j] = data[j];
+// Applies the compiled rules of ep to a transfer whose buffer holds
+// capacity bytes. Returns false if a filter drops the transfer.
+bool injection(struct usb_raw_transfer_io &io, const struct usb_endpoint_descriptor &ep, uint32_t capacity) {
+	int rcu = rcu_read_lock(&injection_rcu);
+	struct injection_rules *rules = injection_rules.load();
+	// Filters and field rewrites see the report in its original layout,
+	// before any pattern replacement.
+	std::vector<struct filter> *filters = injection_endpoint_filters(rules, &ep);
+	if (filters) {
+		for (size_t i = 0; i < filters->size(); i++) {
+			if (!filter_run(&(*filters)[i], (uint8_t *)io.data, io.inner.length)) {
+				rcu_read_unlock(&injection_rcu, rcu);
+				return false;
+			}
 		}
 	}
+	const std::vector<struct injection_field> *fields =
+		injection_endpoint_fields(rules, &ep);
+	if (fields)
+		injection_fields_apply(*fields, io.data, io.inner.length);
+	const struct injection_matcher *matcher = injection_endpoint_matcher(rules, &ep);
+	if (matcher)
+		injection_apply(matcher, io.data, &io.inner.length, capacity);
+	rcu_read_unlock(&injection_rcu, rcu);
+	return true;
 }
 
-void injection(struct usb_raw_control_event &event, struct usb_raw_transfer_io &io, int &injection_flags) {
-	// This is just a simple injection function for control transfer.
-	std::vector<std::string> injection_type{"modify", "ignore", "stall"};
-	std::string transfer_type = "control";
-
-	for (unsigned int i = 0; i < injection_type.size(); i++) {
-		for (unsigned int j = 0; j < injection_config[transfer_type][injection_type[i]].size(); j++) {
-			Json::Value rule = injection_config[transfer_type][injection_type[i]][j];
-			if (rule["enable"].asBool() != true)
-				continue;
+void printData(const struct usb_raw_transfer_io &io, __u8 bEndpointAddress, std::string transfer_type, std::string dir) {
+	printf("Sending data to EP%x(%s_%s):", bEndpointAddress,
+		transfer_type.c_str(), dir.c_str());
+	for (unsigned int i = 0; i < io.inner.length; i++) {
+		printf(" %02hhx", (unsigned)io.data[i]);
+	}
+	printf("\n");
+}
 
-			if (event.ctrl.bRequestType != hexToDecimal(rule["bRequestType"].asInt()) ||
-			    event.ctrl.bRequest     != hexToDecimal(rule["bRequest"].asInt()) ||
-			    event.ctrl.wValue       != hexToDecimal(rule["wValue"].asInt()) ||
-			    event.ctrl.wIndex       != hexToDecimal(rule["wIndex"].asInt()) ||
-			    event.ctrl.wLength      != hexToDecimal(rule["wLength"].asInt()))
-				continue;
+int bulk_transfer_size = 0;
+static int ep_transfer_sizes[32];
 
-			printf("Matched injection rule: %s, index: %d\n", injection_type[i].c_str(), j);
-			if (injection_type[i] == "modify") {
-				Json::Value patterns = rule["content_pattern"];
-				std::string replacement_hex = rule["replacement"].asString();
-				bool data_modified = false;
+static int ep_transfer_size_index(int address) {
+	return (address & USB_ENDPOINT_NUMBER_MASK) | ((address & USB_DIR_IN) ? 16 : 0);
+}
 
-				injection(io, patterns, replacement_hex, data_modified);
-				if (!(event.ctrl.bRequestType & USB_DIR_IN))
-					event.ctrl.wLength = io.inner.length;
-			}
-			else if (injection_type[i] == "ignore") {
-				printf("Ignore this control transfer\n");
-				injection_flags = USB_INJECTION_FLAG_IGNORE;
-			}
-			else if (injection_type[i] == "stall") {
-				injection_flags = USB_INJECTION_FLAG_STALL;
-			}
+// Parses a --transfer_size argument: either SIZE, the default for all
+// bulk endpoints, or EP=SIZE (EP in hex, e.g. 81=65536) for one endpoint.
+bool parse_transfer_size(const char *arg) {
+	std::string value(arg);
+	int address = -1;
+
+	try {
+		std::string::size_type eq = value.find('=');
+		if (eq != std::string::npos) {
+			address = std::stoi(value.substr(0, eq), nullptr, 16);
+			value = value.substr(eq + 1);
 		}
+		int size = std::stoi(value);
+		if (size < 0 || size > MAX_BULK_TRANSFER_SIZE ||
+		    address > 0xff || (address & 0x70))
+			return false;
+
+		if (address < 0)
+			bulk_transfer_size = size;
+		else
+			ep_transfer_sizes[ep_transfer_size_index(address)] = size;
+	}
+	catch (const std::exception &) {
+		return false;
 	}
+	return true;
 }
 
-void injection(struct usb_raw_transfer_io &io, struct usb_endpoint_descriptor ep, std::string transfer_type) {
-	// This is just a simple injection function for int and bulk transfer.
-	for (unsigned int i = 0; i < injection_config[transfer_type].size(); i++) {
-		Json::Value rule = injection_config[transfer_type][i];
-		if (rule["enable"].asBool() != true ||
-		    hexToDecimal(rule["ep_address"].asInt()) != ep.bEndpointAddress)
-			continue;
-
-		Json::Value patterns = rule["content_pattern"];
-		std::string replacement_hex = rule["replacement"].asString();
-		bool data_modified = false;
-
-		injection(io, patterns, replacement_hex, data_modified);
+// Bytes requested per IN transfer from the device. Defaults to one packet,
+// so that a device which stops after a full packet is never kept waiting
+// for more; larger sizes pay off for devices that stream (mass storage).
+int ep_transfer_size(const struct usb_endpoint_descriptor *ep) {
+	int maxp = usb_endpoint_maxp(ep);
+	if (usb_endpoint_type(ep) == USB_ENDPOINT_XFER_ISOC ||
+	    !usb_endpoint_dir_in(ep))
+		return maxp;
+
+	int size = ep_transfer_sizes[ep_transfer_size_index(ep->bEndpointAddress)];
+	if (!size && usb_endpoint_type(ep) == USB_ENDPOINT_XFER_BULK)
+		size = bulk_transfer_size;
+	return std::max(size, maxp);
+}
 
-		if (data_modified)
+// Raw Gadget moves at most MAX_TRANSFER_SIZE bytes per ioctl, so larger
+// transfers are written in chunks of whole packets. The host then receives
+// exactly the packets the device sent: only the last chunk may end with a
+// short packet or carry the ZLP flag.
+static int ep_write_chunked(int fd, struct usb_raw_transfer_io *io, int maxp) {
+	if (io->inner.length <= MAX_TRANSFER_SIZE)
+		return usb_raw_ep_write(fd, (struct usb_raw_ep_io *)io);
+
+	uint32_t chunk = (MAX_TRANSFER_SIZE / maxp) * maxp;
+	struct usb_raw_ep_io inner = io->inner;
+	int written = 0;
+	int rv = 0;
+
+	for (uint32_t offset = 0; offset < inner.length; offset += chunk) {
+		// Each chunk gets its header right in front of its data. Past
+		// the first one that overlays bytes that were already sent,
+		// which are saved and put back afterwards.
+		struct usb_raw_ep_io *header =
+			(struct usb_raw_ep_io *)(io->data + offset) - 1;
+		uint8_t saved[sizeof(*header)];
+		memcpy(saved, header, sizeof(saved));
+
+		header->ep = inner.ep;
+		header->length = std::min(chunk, inner.length - offset);
+		header->flags = (offset + header->length == inner.length) ? inner.flags : 0;
+		rv = usb_raw_ep_write(fd, header);
+
+		memcpy(header, saved, sizeof(saved));
+		if (rv < 0)
 			break;
+		written += rv;
 	}
-}
 
-void printData(struct usb_raw_transfer_io io, __u8 bEndpointAddress, std::string transfer_type, std::string dir) {
-	printf("Sending data to EP%x(%s_%s):", bEndpointAddress,
-		transfer_type.c_str(), dir.c_str());
-	for (unsigned int i = 0; i < io.inner.length; i++) {
-		printf(" %02hhx", (unsigned)io.data[i]);
-	}
-	printf("\n");
+	io->inner = inner;
+	return rv < 0 ? rv : written;
 }
 
 void noop_signal_handler(int) { }
@@ -110,8 +178,13 @@ void *ep_loop_write(void *arg) {
 	struct usb_endpoint_descriptor ep = thread_info.endpoint;
 	std::string transfer_type = thread_info.transfer_type;
 	std::string dir = thread_info.dir;
-	std::deque<usb_raw_transfer_io> *data_queue = thread_info.data_queue;
-	std::mutex *data_mutex = thread_info.data_mutex;
+	struct ep_queue *data_queue = thread_info.data_queue;
+	struct fusion_state *fusion = thread_info.fusion;
+	struct poll_estimator *poll = thread_info.poll;
+	struct key_state *keys = thread_info.keys;
+	struct usb_raw_transfer_io *fusion_io = NULL;
+	struct out_stream *stream = NULL;
+	struct iso_stream *iso = NULL;
 
 	printf("Start writing thread for EP%02x, thread id(%d)\n",
 		ep.bEndpointAddress, gettid());
@@ -120,28 +193,109 @@ void *ep_loop_write(void *arg) {
 	// will thus interrupt a blocking ioctl call without other side-effects.
 	signal(SIGUSR1, noop_signal_handler);
 
+	// Pipeline host-to-device data on bulk and interrupt OUT endpoints
+	// instead of waiting for the device to finish each transfer.
+	// Isochronous packets are merged into multi-packet transfers.
+	if (!(ep.bEndpointAddress & USB_DIR_IN) &&
+	    usb_endpoint_type(&ep) == USB_ENDPOINT_XFER_ISOC)
+		iso = iso_stream_create(ep.bEndpointAddress, iso_packets, iso_transfers);
+	else if (!(ep.bEndpointAddress & USB_DIR_IN))
+		stream = out_stream_create(ep.bEndpointAddress, ep.bmAttributes,
+				MAX_TRANSFER_SIZE, out_transfers);
+	if (fusion)
+		fusion_io = new struct usb_raw_transfer_io;
+
 	while (!please_stop_eps) {
 		assert(ep_num != -1);
-		
-		std::unique_lock<std::mutex> lock(*data_mutex);
-		// Wait for data with 100µs timeout - wakes immediately on notify or after timeout
-		thread_info.data_cond->wait_for(lock, std::chrono::microseconds(100), 
-			[&]{ return data_queue->size() > 0 || please_stop_eps; });
-		
-		if (data_queue->size() == 0) {
-			lock.unlock();
+
+		// The transfer is sent straight from its queue slot, which is
+		// only handed back with ep_queue_pop_front() once we are done.
+		struct usb_raw_transfer_io *io = ep_queue_front(data_queue);
+		bool standalone = false;
+		uint32_t fused_ack = 0;
+
+		// Hold injected reports until just before the host polls, so
+		// that real reports arriving meanwhile are not stuck behind
+		// them. Real reports are never held.
+		if (poll && io && data_queue->front_lane == 1 &&
+		    !ep_queue_lane_size(data_queue, 0) && poll_estimator_hold(poll, data_queue))
 			continue;
+
+		if (fusion && io) {
+			int rcu = rcu_read_lock(&ep_routes_rcu);
+			fused_ack = fusion_merge(fusion, hid_codec_get(thread_info.interface), io);
+			rcu_read_unlock(&ep_routes_rcu, rcu);
+		}
+		else if (fusion && fusion_pending(fusion)) {
+			// Gather the motion injected until just before the poll.
+			if (poll && poll_estimator_hold(poll, data_queue))
+				continue;
+			// Nothing from the device for this poll, so the injected
+			// motion goes out on its own.
+			int rcu = rcu_read_lock(&ep_routes_rcu);
+			fused_ack = fusion_standalone(fusion, hid_codec_get(thread_info.interface),
+					ep_num, fusion_io);
+			rcu_read_unlock(&ep_routes_rcu, rcu);
+			if (fusion_io->inner.length) {
+				io = fusion_io;
+				standalone = true;
+			}
 		}
+		if (!io) {
+			// Reap the outstanding OUT transfers before going to sleep,
+			// so their errors are reported while the queue is idle.
+			if (stream && stream->in_flight) {
+				int rv = out_stream_reap(stream, IN_STREAM_POLL_TIMEOUT);
+				if (rv == LIBUSB_ERROR_NO_DEVICE) {
+					printf("EP%x(%s_%s): device likely reset, stopping thread\n",
+						ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
+					break;
+				}
+				continue;
+			}
 
-		struct usb_raw_transfer_io io = data_queue->front();
-		data_queue->pop_front();
-		lock.unlock();
+			// Keep gathering isochronous packets while the device has
+			// enough transfers queued, and only submit a partial one
+			// when it is about to run dry.
+			if (iso && iso->fill && iso->in_flight <= iso->num_transfers / 2)
+				iso_out_stream_flush(iso);
+			if (iso && iso->in_flight) {
+				int rv = iso_out_stream_reap(iso, iso->fill ? 1 : IN_STREAM_POLL_TIMEOUT);
+				if (rv == LIBUSB_ERROR_NO_DEVICE) {
+					printf("EP%x(%s_%s): device likely reset, stopping thread\n",
+						ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
+					break;
+				}
+				continue;
+			}
+
+			// Sleep until a producer signals the queue. Idle endpoints
+			// stay blocked here and cost no CPU. Injected motion is
+			// not queued, so recheck it once armed.
+			if (ep_queue_arm(data_queue)) {
+				if (fusion && fusion_pending(fusion))
+					ep_queue_disarm(data_queue);
+				else
+					ep_queue_ack(data_queue);
+			}
+			continue;
+		}
+
+		// Keys held by injection and on the device are merged into
+		// each other's reports.
+		if (keys && !standalone) {
+			int rcu = rcu_read_lock(&ep_routes_rcu);
+			key_state_merge(keys, hid_codec_get(thread_info.interface), io,
+					data_queue->front_lane == 1);
+			rcu_read_unlock(&ep_routes_rcu, rcu);
+		}
 
 		if (verbose_level >= 2)
-			printData(io, ep.bEndpointAddress, transfer_type, dir);
+			printData(*io, ep.bEndpointAddress, transfer_type, dir);
 
 		if (ep.bEndpointAddress & USB_DIR_IN) {
-			int rv = usb_raw_ep_write(fd, (struct usb_raw_ep_io *)&io);
+			uint64_t issued = poll ? poll_clock() : 0;
+			int rv = ep_write_chunked(fd, io, usb_endpoint_maxp(&ep));
 			if (rv < 0 && errno == ESHUTDOWN) {
 				printf("EP%x(%s_%s): device likely reset, stopping thread\n",
 					ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
@@ -155,17 +309,25 @@ void *ep_loop_write(void *arg) {
 			if (rv < 0 && (errno == EXDEV || errno == ENODATA)) {
 				printf("EP%x(%s_%s): missed isochronous timing, ignoring transfer\n",
 					ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
+				if (!standalone && data_queue->front_ack)
+					inject_ack_written(data_queue->front_ack, true);
+				if (fused_ack)
+					inject_ack_written(fused_ack, true);
+				if (!standalone)
+					ep_queue_pop_front(data_queue);
 				continue;
 			}
 			if (rv < 0) {
 				perror("usb_raw_ep_write()");
 				exit(EXIT_FAILURE);
 			}
+			if (poll)
+				poll_estimator_update(poll, issued, poll_clock());
 			if (debug_level >= 3) {
 				printf("EP%x(%s_%s): wrote %d bytes to host: ", ep.bEndpointAddress,
 					transfer_type.c_str(), dir.c_str(), rv);
-				for (int i = 0; i < rv && i < (int)io.inner.length; i++) {
-					printf("%02x ", (unsigned char)io.data[i]);
+				for (int i = 0; i < rv && i < (int)io->inner.length; i++) {
+					printf("%02x ", (unsigned char)io->data[i]);
 				}
 				printf("\n");
 			} else {
@@ -173,27 +335,157 @@ void *ep_loop_write(void *arg) {
 					transfer_type.c_str(), dir.c_str(), rv);
 			}
 		}
+		else if (iso) {
+			int rv = iso_out_stream_submit(iso, (uint8_t *)io->data, io->inner.length);
+			if (rv == LIBUSB_ERROR_NO_DEVICE) {
+				printf("EP%x(%s_%s): device likely reset, stopping thread\n",
+					ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
+				break;
+			}
+		}
+		else if (stream) {
+			int rv = out_stream_submit(stream, (uint8_t *)io->data, io->inner.length);
+			if (rv == LIBUSB_ERROR_NO_DEVICE) {
+				printf("EP%x(%s_%s): device likely reset, stopping thread\n",
+					ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
+				break;
+			}
+		}
 		else {
-			int length = io.inner.length;
-			unsigned char *data = new unsigned char[length];
-			memcpy(data, io.data, length);
-			int rv = send_data(ep.bEndpointAddress, ep.bmAttributes, data, length, USB_REQUEST_TIMEOUT);
+			int rv = send_data(ep.bEndpointAddress, ep.bmAttributes,
+					(uint8_t *)io->data, io->inner.length, USB_REQUEST_TIMEOUT);
 			if (rv == LIBUSB_ERROR_NO_DEVICE) {
 				printf("EP%x(%s_%s): device likely reset, stopping thread\n",
 					ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
 				break;
 			}
-
-			if (data)
-				delete[] data;
 		}
+
+		// Acknowledge delivered injections to whoever asked.
+		if (!standalone && data_queue->front_ack)
+			inject_ack_written(data_queue->front_ack, false);
+		if (fused_ack)
+			inject_ack_written(fused_ack, false);
+
+		if (!standalone)
+			ep_queue_pop_front(data_queue);
 	}
 
+	out_stream_destroy(stream);
+	iso_stream_destroy(iso);
+	delete fusion_io;
+
 	printf("End writing thread for EP%02x, thread id(%d)\n",
 		ep.bEndpointAddress, gettid());
 	return NULL;
 }
 
+// Keeps stream topped up with free queue slots. The queue reserves
+// in_transfers extra slots for this, so a full queue only throttles the
+// reads and never drops data that was already received.
+void ep_fill_in_stream(struct in_stream *stream, struct ep_queue *queue) {
+	while (stream->in_flight < stream->num_transfers) {
+		int slot = ep_queue_acquire(queue);
+		if (slot < 0)
+			break;
+		struct usb_raw_transfer_io *io = ep_queue_slot(queue, slot);
+		if (in_stream_submit(stream, (uint8_t *)io->data, slot) != LIBUSB_SUCCESS) {
+			ep_queue_cancel(queue, slot);
+			break;
+		}
+	}
+}
+
+// Completes a transfer that the device wrote into slot and hands it over
+// to the writer.
+void ep_publish_in(struct thread_info *info, int slot, int nbytes) {
+	struct usb_endpoint_descriptor *ep = &info->endpoint;
+	struct usb_raw_transfer_io *io = ep_queue_slot(info->data_queue, slot);
+
+	io->inner.ep = info->ep_num;
+	io->inner.flags = 0;
+	io->inner.length = nbytes;
+
+	// A transfer that came back short yet a whole number of packets was
+	// ended by a zero-length packet. Have the UDC send one as well, so
+	// that the host sees the same transfer boundary.
+	int maxp = usb_endpoint_maxp(ep);
+	if (usb_endpoint_type(ep) != USB_ENDPOINT_XFER_ISOC &&
+	    nbytes > 0 && nbytes < info->transfer_size && nbytes % maxp == 0)
+		io->inner.flags = USB_RAW_IO_FLAGS_ZERO;
+
+	// Subscribers get the report as the device sent it.
+	if (report_tap_wanted(ep->bEndpointAddress))
+		report_tap_push(ep->bEndpointAddress, io->data, nbytes);
+
+	if (injection_enabled &&
+	    !injection(*io, *ep, info->data_queue->data.slot_size)) {
+		ep_queue_cancel(info->data_queue, slot);
+		if (verbose_level)
+			printf("EP%x(%s_%s): filter dropped %d bytes\n", ep->bEndpointAddress,
+				info->transfer_type.c_str(), info->dir.c_str(), nbytes);
+		return;
+	}
+
+	// Track the buttons held on the physical mouse, wherever the
+	// interface's report descriptor puts them.
+	if ((ep->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_INT) {
+		int rcu = rcu_read_lock(&ep_routes_rcu);
+		const struct hid_codec *codec = hid_codec_get(info->interface);
+		if (hid_is_mouse_report(codec, (uint8_t *)io->data, nbytes))
+			update_real_mouse_state(hid_get((uint8_t *)io->data, &codec->mouse.buttons));
+		rcu_read_unlock(&ep_routes_rcu, rcu);
+	}
+
+	ep_queue_publish(info->data_queue, slot);
+	if (verbose_level)
+		printf("EP%x(%s_%s): enqueued %d bytes to queue\n", ep->bEndpointAddress,
+				info->transfer_type.c_str(), info->dir.c_str(), nbytes);
+}
+
+// Takes the oldest isochronous IN transfer off stream and queues each of
+// its packets separately, as Raw Gadget sends one packet per
+// usb_raw_ep_write().
+static int ep_read_iso(struct thread_info *info, struct iso_stream *stream) {
+	struct ep_queue *queue = info->data_queue;
+	struct libusb_transfer *transfer;
+
+	iso_in_stream_fill(stream);
+	if (stream->in_flight == 0) {
+		usleep(200);
+		return LIBUSB_SUCCESS;
+	}
+
+	int rv = iso_in_stream_next(stream, &transfer, IN_STREAM_POLL_TIMEOUT);
+	if (rv == LIBUSB_ERROR_TIMEOUT)
+		return LIBUSB_SUCCESS;
+	if (rv == LIBUSB_ERROR_NO_DEVICE)
+		return rv;
+
+	for (int p = 0; rv == LIBUSB_SUCCESS && p < transfer->num_iso_packets; p++) {
+		struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[p];
+		if (desc->status != LIBUSB_TRANSFER_COMPLETED || desc->actual_length == 0)
+			continue;
+		if (desc->actual_length > MAX_TRANSFER_SIZE)
+			continue;
+
+		// Isochronous data that cannot be sent on time is useless, so
+		// drop the packet (counted as an overflow) rather than wait.
+		int slot = ep_queue_acquire(queue);
+		if (slot < 0) {
+			ep_queue_overflow(queue);
+			continue;
+		}
+		memcpy(ep_queue_slot(queue, slot)->data,
+			libusb_get_iso_packet_buffer_simple(transfer, p),
+			desc->actual_length);
+		ep_publish_in(info, slot, desc->actual_length);
+	}
+
+	iso_in_stream_release(stream);
+	return LIBUSB_SUCCESS;
+}
+
 void *ep_loop_read(void *arg) {
 	struct thread_info thread_info = *((struct thread_info*) arg);
 	int fd = thread_info.fd;
@@ -201,8 +493,9 @@ void *ep_loop_read(void *arg) {
 	struct usb_endpoint_descriptor ep = thread_info.endpoint;
 	std::string transfer_type = thread_info.transfer_type;
 	std::string dir = thread_info.dir;
-	std::deque<usb_raw_transfer_io> *data_queue = thread_info.data_queue;
-	std::mutex *data_mutex = thread_info.data_mutex;
+	struct ep_queue *data_queue = thread_info.data_queue;
+	struct in_stream *stream = NULL;
+	struct iso_stream *iso = NULL;
 
 	printf("Start reading thread for EP%02x, thread id(%d)\n",
 		ep.bEndpointAddress, gettid());
@@ -211,92 +504,111 @@ void *ep_loop_read(void *arg) {
 	// will thus interrupt a blocking ioctl call without other side-effects.
 	signal(SIGUSR1, noop_signal_handler);
 
+	// Keep several transfers queued on IN endpoints, so the device always
+	// has a request to answer while the previous one is being handed over
+	// to the writer.
+	if ((ep.bEndpointAddress & USB_DIR_IN) &&
+	    usb_endpoint_type(&ep) == USB_ENDPOINT_XFER_ISOC)
+		iso = iso_stream_create(ep.bEndpointAddress, iso_packets, iso_transfers);
+	else if (ep.bEndpointAddress & USB_DIR_IN)
+		stream = in_stream_create(ep.bEndpointAddress, ep.bmAttributes,
+				thread_info.transfer_size, in_transfers);
+
 	while (!please_stop_eps) {
 		assert(ep_num != -1);
-		struct usb_raw_transfer_io io;
 
+		// Every transfer is received straight into a queue slot (or,
+		// for isochronous packets, copied once out of the transfer
+		// they arrived in) and handed to the writer by index.
 		if (ep.bEndpointAddress & USB_DIR_IN) {
-			unsigned char *data = NULL;
-			int nbytes = -1;
-
-			if (data_queue->size() >= 32) {
-				usleep(200);
-				continue;
-			}
-
-			int rv = receive_data(ep.bEndpointAddress, ep.bmAttributes, usb_endpoint_maxp(&ep),
-						&data, &nbytes, USB_REQUEST_TIMEOUT);
-			if (rv == LIBUSB_ERROR_NO_DEVICE) {
-				printf("EP%x(%s_%s): device likely reset, stopping thread\n",
-					ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
-				break;
-			}
-
-			if (nbytes >= 0) {
-				memcpy(io.data, data, nbytes);
-				io.inner.ep = ep_num;
-				io.inner.flags = 0;
-				io.inner.length = nbytes;
-
-				if (injection_enabled)
-					injection(io, ep, transfer_type);
-				
-				// Track real mouse button state from physical mouse (HID Mouse = protocol 2)
-				// Mouse report: byte 0 = magic (0x02), byte 1 = button state
-				if ((ep.bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_INT &&
-				    (ep.bEndpointAddress & USB_DIR_IN) &&
-				    nbytes >= 2 && io.data[0] == 0x02) {
-					// This looks like a mouse packet, extract button state from byte 1
-					update_real_mouse_state(io.data[1]);
+			int rv;
+			if (iso)
+				rv = ep_read_iso(&thread_info, iso);
+			else if (stream) {
+				ep_fill_in_stream(stream, data_queue);
+				if (stream->in_flight == 0) {
+					usleep(200);
+					continue;
 				}
 
-				data_mutex->lock();
-				data_queue->push_back(io);
-				data_mutex->unlock();
-				if (verbose_level)
-					printf("EP%x(%s_%s): enqueued %d bytes to queue\n", ep.bEndpointAddress,
-							transfer_type.c_str(), dir.c_str(), nbytes);
+				int slot, nbytes;
+				rv = in_stream_next(stream, &slot, &nbytes, IN_STREAM_POLL_TIMEOUT);
+				if (rv == LIBUSB_SUCCESS)
+					ep_publish_in(&thread_info, slot, nbytes);
+				else if (rv != LIBUSB_ERROR_TIMEOUT)
+					ep_queue_cancel(data_queue, slot);
 			}
+			else
+				rv = LIBUSB_ERROR_NOT_SUPPORTED;
 
-			if (data)
-				delete[] data;
-		}
-		else {
-			io.inner.ep = ep_num;
-			io.inner.flags = 0;
-			io.inner.length = sizeof(io.data);
-
-			int rv = usb_raw_ep_read(fd, (struct usb_raw_ep_io *)&io);
-			if (rv < 0 && errno == ESHUTDOWN) {
+			if (rv == LIBUSB_ERROR_NO_DEVICE) {
 				printf("EP%x(%s_%s): device likely reset, stopping thread\n",
 					ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
 				break;
 			}
-			if (rv < 0 && errno == EINTR) {
-				printf("EP%x(%s_%s): interface likely changing, stopping thread\n",
+			if (rv == LIBUSB_ERROR_NOT_SUPPORTED) {
+				printf("EP%x(%s_%s): cannot read from device, stopping thread\n",
 					ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
 				break;
 			}
-			if (rv < 0) {
-				perror("usb_raw_ep_read()");
-				exit(EXIT_FAILURE);
-			}
-			printf("EP%x(%s_%s): read %d bytes from host\n", ep.bEndpointAddress,
-					transfer_type.c_str(), dir.c_str(), rv);
-			io.inner.length = rv;
+			continue;
+		}
 
-			if (injection_enabled)
-				injection(io, ep, transfer_type);
+		// Host-to-device data must not be lost: a slot is taken before
+		// reading, so the host is simply held off while the writer
+		// catches up.
+		int slot = ep_queue_acquire(data_queue);
+		if (slot < 0) {
+			usleep(200);
+			continue;
+		}
 
-			data_mutex->lock();
-			data_queue->push_back(io);
-			data_mutex->unlock();
+		struct usb_raw_transfer_io *io = ep_queue_slot(data_queue, slot);
+		io->inner.ep = ep_num;
+		io->inner.flags = 0;
+		io->inner.length = sizeof(io->data);
+
+		int rv = usb_raw_ep_read(fd, (struct usb_raw_ep_io *)io);
+		if (rv < 0 && errno == ESHUTDOWN) {
+			printf("EP%x(%s_%s): device likely reset, stopping thread\n",
+				ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
+			ep_queue_cancel(data_queue, slot);
+			break;
+		}
+		if (rv < 0 && errno == EINTR) {
+			printf("EP%x(%s_%s): interface likely changing, stopping thread\n",
+				ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
+			ep_queue_cancel(data_queue, slot);
+			break;
+		}
+		if (rv < 0) {
+			perror("usb_raw_ep_read()");
+			exit(EXIT_FAILURE);
+		}
+		printf("EP%x(%s_%s): read %d bytes from host\n", ep.bEndpointAddress,
+				transfer_type.c_str(), dir.c_str(), rv);
+		if (report_tap_wanted(ep.bEndpointAddress))
+			report_tap_push(ep.bEndpointAddress, io->data, rv);
+		io->inner.length = rv;
+
+		if (injection_enabled &&
+		    !injection(*io, ep, data_queue->data.slot_size)) {
+			ep_queue_cancel(data_queue, slot);
 			if (verbose_level)
-				printf("EP%x(%s_%s): enqueued %d bytes to queue\n", ep.bEndpointAddress,
-						transfer_type.c_str(), dir.c_str(), rv);
+				printf("EP%x(%s_%s): filter dropped %d bytes\n", ep.bEndpointAddress,
+					transfer_type.c_str(), dir.c_str(), rv);
+			continue;
 		}
+
+		ep_queue_publish(data_queue, slot);
+		if (verbose_level)
+			printf("EP%x(%s_%s): enqueued %d bytes to queue\n", ep.bEndpointAddress,
+					transfer_type.c_str(), dir.c_str(), rv);
 	}
 
+	in_stream_destroy(stream);
+	iso_stream_destroy(iso);
+
 	printf("End reading thread for EP%02x, thread id(%d)\n",
 		ep.bEndpointAddress, gettid());
 	return NULL;
@@ -315,10 +627,40 @@ void process_eps(int fd, int config, int interface, int altsetting) {
 		assert(addr != 0);
 
 		ep->thread_info.fd = fd;
+		ep->thread_info.interface = alt->interface.bInterfaceNumber;
 		ep->thread_info.endpoint = ep->endpoint;
-		ep->thread_info.data_queue = new std::deque<usb_raw_transfer_io>;
-		ep->thread_info.data_mutex = new std::mutex;
-		ep->thread_info.data_cond = new std::condition_variable;
+		// IN readers keep in_transfers slots in flight on top of what
+		// is queued; every other reader holds at most one.
+		unsigned int reserve = 1;
+		if (usb_endpoint_dir_in(&ep->endpoint))
+			reserve = in_transfers;
+		ep->thread_info.transfer_size = ep_transfer_size(&ep->endpoint);
+		ep->thread_info.data_queue = ep_queue_create(EP_QUEUE_CAPACITY, reserve,
+				std::max(ep->thread_info.transfer_size, MAX_TRANSFER_SIZE));
+
+		// Injected motion is merged into the reports of HID mouse
+		// interrupt IN endpoints.
+		ep->thread_info.fusion = NULL;
+		if (fusion_enabled && usb_endpoint_dir_in(&ep->endpoint) &&
+		    usb_endpoint_type(&ep->endpoint) == USB_ENDPOINT_XFER_INT &&
+		    alt->interface.bInterfaceClass == USB_CLASS_HID &&
+		    alt->interface.bInterfaceProtocol == 2)
+			ep->thread_info.fusion = fusion_create(poll_move_step);
+
+		// Keys injected on HID interrupt IN endpoints are merged with
+		// those held on the device.
+		ep->thread_info.keys = NULL;
+		if (usb_endpoint_dir_in(&ep->endpoint) &&
+		    usb_endpoint_type(&ep->endpoint) == USB_ENDPOINT_XFER_INT &&
+		    alt->interface.bInterfaceClass == USB_CLASS_HID)
+			ep->thread_info.keys = key_state_create();
+
+		// Writes to interrupt IN endpoints are timed to learn when the
+		// host polls them.
+		ep->thread_info.poll = NULL;
+		if (usb_endpoint_dir_in(&ep->endpoint) &&
+		    usb_endpoint_type(&ep->endpoint) == USB_ENDPOINT_XFER_INT)
+			ep->thread_info.poll = poll_estimator_create(&ep->endpoint);
 
 		switch (usb_endpoint_type(&ep->endpoint)) {
 		case USB_ENDPOINT_XFER_ISOC:
@@ -349,12 +691,28 @@ void process_eps(int fd, int config, int interface, int altsetting) {
 		if (verbose_level)
 			printf("Creating thread for EP%02x\n",
 				ep->thread_info.endpoint.bEndpointAddress);
-		pthread_create(&ep->thread_read, 0,
-			ep_loop_read, (void *)&ep->thread_info);
-		pthread_create(&ep->thread_write, 0,
-			ep_loop_write, (void *)&ep->thread_info);
+		if (reactor_handles(&ep->thread_info)) {
+			// The reactor takes over the libusb side, only the
+			// Raw Gadget side needs a thread of its own.
+			reactor_add(&ep->thread_info);
+			if (usb_endpoint_dir_in(&ep->endpoint))
+				pthread_create(&ep->thread_write, 0,
+					ep_loop_write, (void *)&ep->thread_info);
+			else
+				pthread_create(&ep->thread_read, 0,
+					ep_loop_read, (void *)&ep->thread_info);
+		}
+		else {
+			pthread_create(&ep->thread_read, 0,
+				ep_loop_read, (void *)&ep->thread_info);
+			pthread_create(&ep->thread_write, 0,
+				ep_loop_write, (void *)&ep->thread_info);
+		}
+		stats_register(&ep->thread_info);
 	}
 
+	ep_routes_add(alt);
+
 	printf("process_eps done\n");
 }
 
@@ -362,6 +720,9 @@ void terminate_eps(int fd, int config, int interface, int altsetting) {
 	struct raw_gadget_altsetting *alt = &host_device_desc.configs[config]
 					.interfaces[interface].altsettings[altsetting];
 
+	// Injectors must be done with the queues before they go away.
+	ep_routes_remove(alt);
+
 	please_stop_eps = true;
 
 	for (int i = 0; i < alt->interface.bNumEndpoints; i++) {
@@ -374,12 +735,14 @@ void terminate_eps(int fd, int config, int interface, int altsetting) {
 		// ioctl gets interrupted with no other side-effects.
 		// The libusb transfer handling does get interrupted directly
 		// and instead times out.
-		
-		// Wake threads waiting on condition variable
-		ep->thread_info.data_cond->notify_all();
-		
-		pthread_kill(ep->thread_read, SIGUSR1);
-		pthread_kill(ep->thread_write, SIGUSR1);
+		// The writing thread might also be sleeping on the queue
+		// eventfd, so kick it as well.
+		ep_queue_wake(ep->thread_info.data_queue);
+
+		if (ep->thread_read)
+			pthread_kill(ep->thread_read, SIGUSR1);
+		if (ep->thread_write)
+			pthread_kill(ep->thread_write, SIGUSR1);
 
 		if (ep->thread_read && pthread_join(ep->thread_read, NULL)) {
 			fprintf(stderr, "Error join thread_read\n");
@@ -390,12 +753,25 @@ void terminate_eps(int fd, int config, int interface, int altsetting) {
 		ep->thread_read = 0;
 		ep->thread_write = 0;
 
+		if (reactor_handles(&ep->thread_info))
+			reactor_remove(&ep->thread_info);
+
 		usb_raw_ep_disable(fd, ep->thread_info.ep_num);
 		ep->thread_info.ep_num = -1;
 
-		delete ep->thread_info.data_queue;
-		delete ep->thread_info.data_mutex;
-		delete ep->thread_info.data_cond;
+		stats_unregister(&ep->thread_info);
+		if (ep_queue_overflows(ep->thread_info.data_queue))
+			printf("EP%02x: queue overflowed %" PRIu64 " times\n",
+				ep->endpoint.bEndpointAddress,
+				ep_queue_overflows(ep->thread_info.data_queue));
+		ep_queue_destroy(ep->thread_info.data_queue);
+		ep->thread_info.data_queue = NULL;
+		fusion_destroy(ep->thread_info.fusion);
+		ep->thread_info.fusion = NULL;
+		poll_estimator_destroy(ep->thread_info.poll);
+		ep->thread_info.poll = NULL;
+		key_state_destroy(ep->thread_info.keys);
+		ep->thread_info.keys = NULL;
 	}
 
 	please_stop_eps = false;
@@ -504,6 +880,14 @@ void ep0_loop(int fd) {
 						dev->bMaxPacketSize0 = 64;
 				}
 
+				// Learn the report layout of HID interfaces from
+				// the descriptor the host gets.
+				if ((event.ctrl.bRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD &&
+				    (event.ctrl.bRequestType & USB_RECIP_MASK) == USB_RECIP_INTERFACE &&
+				    event.ctrl.bRequest == USB_REQ_GET_DESCRIPTOR &&
+				    (event.ctrl.wValue >> 8) == HID_DT_REPORT)
+					hid_capture(event.ctrl.wIndex, (uint8_t *)io.data, io.inner.length);
+
 				if (verbose_level >= 2)
 					printData(io, 0x00, "control", "in");
 
@@ -1,3 +1,16 @@
 void ep0_loop(int fd);
 
+struct ep_queue;
+struct in_stream;
+
+// 0 leaves bulk endpoints at one packet per transfer.
+extern int bulk_transfer_size;
+bool parse_transfer_size(const char *arg);
+int ep_transfer_size(const struct usb_endpoint_descriptor *ep);
+
+// Shared by the endpoint threads and the reactor.
+void printData(const struct usb_raw_transfer_io &io, __u8 bEndpointAddress, std::string transfer_type, std::string dir);
+void ep_fill_in_stream(struct in_stream *stream, struct ep_queue *queue);
+void ep_publish_in(struct thread_info *info, int slot, int nbytes);
+
 extern int debug_level; // 0=off, 1=basic, 2=detailed, 3=full hex dumps
@@ -0,0 +1,31 @@
+#include <sched.h>
+
+#include "rcu.h"
+
+int rcu_read_lock(struct rcu_domain *rcu) {
+	int index = rcu->index.load(std::memory_order_relaxed) & 1;
+	// Sequentially consistent, so that the protected pointer is loaded
+	// only after the writer can see this reader.
+	rcu->readers[index].fetch_add(1, std::memory_order_seq_cst);
+	return index;
+}
+
+void rcu_read_unlock(struct rcu_domain *rcu, int index) {
+	rcu->readers[index].fetch_sub(1, std::memory_order_release);
+}
+
+static void rcu_flip_and_wait(struct rcu_domain *rcu) {
+	unsigned int old = rcu->index.fetch_add(1, std::memory_order_seq_cst) & 1;
+	while (rcu->readers[old].load(std::memory_order_acquire) != 0)
+		sched_yield();
+}
+
+void rcu_synchronize(struct rcu_domain *rcu) {
+	std::lock_guard<std::mutex> lock(rcu->writer);
+
+	// A reader may have picked its counter just before the first flip and
+	// only incremented it afterwards, so both counters are drained once.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	rcu_flip_and_wait(rcu);
+	rcu_flip_and_wait(rcu);
+}
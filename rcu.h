@@ -0,0 +1,27 @@
+#ifndef RCU_H
+#define RCU_H
+
+#include <atomic>
+#include <mutex>
+
+// Read-copy-update for data that is read on every transfer and replaced
+// rarely. Readers never block: they bump one of two counters around their
+// critical section. A writer publishes the new version with an atomic
+// pointer store, then calls rcu_synchronize() before freeing the old one.
+// Both the pointer store and the readers' load are sequentially consistent.
+// Domains are meant to be zero-initialized globals.
+struct rcu_domain {
+	std::atomic<unsigned int>	index;
+	std::atomic<long>		readers[2];
+	std::mutex			writer;
+};
+
+// Returns the value to hand back to rcu_read_unlock().
+int rcu_read_lock(struct rcu_domain *rcu);
+void rcu_read_unlock(struct rcu_domain *rcu, int index);
+
+// Waits until every reader that might still see a previously published
+// pointer has left its critical section.
+void rcu_synchronize(struct rcu_domain *rcu);
+
+#endif // RCU_H
@@ -0,0 +1,385 @@
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "host-raw-gadget.h"
+#include "device-libusb.h"
+#include "ep-queue.h"
+#include "proxy.h"
+#include "reactor.h"
+#include "inject-ack.h"
+
+#define REACTOR_MAX_EVENTS	32
+
+// Writers free queue slots without signalling anybody, so an IN endpoint
+// that ran out of slots to read into is retried after this many ms.
+#define REACTOR_STARVED_TIMEOUT	1
+
+bool reactor_enabled = false;
+
+struct reactor_endpoint {
+	struct thread_info	*info;
+	struct in_stream	*in;
+	struct out_stream	*out;
+	bool			armed;
+	bool			stopped;
+};
+
+struct reactor_request {
+	struct thread_info	*info;
+	bool			add;
+	bool			done;
+};
+
+static std::thread reactor_thread;
+static int reactor_epfd = -1;
+static int reactor_wake_fd = -1;
+
+// Only touched by the reactor thread.
+static std::vector<struct reactor_endpoint *> reactor_endpoints;
+
+static std::mutex reactor_mutex;
+static std::condition_variable reactor_cond;
+static std::vector<struct reactor_request *> reactor_requests;
+static bool reactor_please_stop = false;
+
+// epoll tags of the descriptors that do not belong to an endpoint queue.
+static char reactor_libusb_tag;
+static char reactor_wake_tag;
+
+bool reactor_handles(struct thread_info *info) {
+	return reactor_enabled &&
+		usb_endpoint_type(&info->endpoint) != USB_ENDPOINT_XFER_ISOC;
+}
+
+static void reactor_kick() {
+	uint64_t value = 1;
+	if (write(reactor_wake_fd, &value, sizeof(value)) < 0) {
+		perror("write() reactor eventfd");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void reactor_watch(int fd, uint32_t events, void *tag) {
+	struct epoll_event event = {};
+	event.events = events;
+	event.data.ptr = tag;
+	if (epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, fd, &event) < 0 && errno != EEXIST) {
+		perror("epoll_ctl()");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*----------------------------------------------------------------------*/
+
+static void libusb_pollfd_added(int fd, short events, void *user_data __attribute__((unused))) {
+	uint32_t epoll_events = 0;
+	if (events & POLLIN)
+		epoll_events |= EPOLLIN;
+	if (events & POLLOUT)
+		epoll_events |= EPOLLOUT;
+	reactor_watch(fd, epoll_events, &reactor_libusb_tag);
+}
+
+static void libusb_pollfd_removed(int fd, void *user_data __attribute__((unused))) {
+	// libusb may already have closed the descriptor, which drops it from
+	// the epoll set anyway.
+	epoll_ctl(reactor_epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static void reactor_watch_libusb() {
+	// Register for changes first, so that no descriptor added in between
+	// is missed; adding one twice is harmless.
+	libusb_set_pollfd_notifiers(context, libusb_pollfd_added,
+				libusb_pollfd_removed, NULL);
+
+	const struct libusb_pollfd **pollfds = libusb_get_pollfds(context);
+	if (!pollfds) {
+		fprintf(stderr, "Failed to get libusb pollfds.\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; pollfds[i]; i++)
+		libusb_pollfd_added(pollfds[i]->fd, pollfds[i]->events, NULL);
+	libusb_free_pollfds(pollfds);
+}
+
+/*----------------------------------------------------------------------*/
+
+static void reactor_attach(struct thread_info *info) {
+	struct usb_endpoint_descriptor *ep = &info->endpoint;
+	struct reactor_endpoint *rep = new struct reactor_endpoint;
+	rep->info = info;
+	rep->in = NULL;
+	rep->out = NULL;
+	rep->armed = false;
+	rep->stopped = false;
+
+	if (ep->bEndpointAddress & USB_DIR_IN) {
+		rep->in = in_stream_create(ep->bEndpointAddress, ep->bmAttributes,
+				info->transfer_size, in_transfers);
+	}
+	else {
+		rep->out = out_stream_create(ep->bEndpointAddress, ep->bmAttributes,
+				MAX_TRANSFER_SIZE, out_transfers);
+		reactor_watch(info->data_queue->wake_fd, EPOLLIN, rep);
+	}
+
+	reactor_endpoints.push_back(rep);
+}
+
+static void reactor_detach(struct thread_info *info) {
+	for (size_t i = 0; i < reactor_endpoints.size(); i++) {
+		struct reactor_endpoint *rep = reactor_endpoints[i];
+		if (rep->info != info)
+			continue;
+
+		if (rep->out) {
+			epoll_ctl(reactor_epfd, EPOLL_CTL_DEL, info->data_queue->wake_fd, NULL);
+			ep_queue_disarm(info->data_queue);
+		}
+		in_stream_destroy(rep->in);
+		out_stream_destroy(rep->out);
+
+		reactor_endpoints.erase(reactor_endpoints.begin() + i);
+		delete rep;
+		return;
+	}
+}
+
+// Applies pending add/remove requests. Returns false once the reactor has
+// been asked to stop.
+static bool reactor_process_requests() {
+	std::lock_guard<std::mutex> lock(reactor_mutex);
+
+	for (size_t i = 0; i < reactor_requests.size(); i++) {
+		struct reactor_request *request = reactor_requests[i];
+		if (request->add)
+			reactor_attach(request->info);
+		else
+			reactor_detach(request->info);
+		request->done = true;
+	}
+	reactor_requests.clear();
+	reactor_cond.notify_all();
+
+	return !reactor_please_stop;
+}
+
+static void reactor_stop_endpoint(struct reactor_endpoint *rep) {
+	struct thread_info *info = rep->info;
+	printf("EP%x(%s_%s): device likely reset, stopping endpoint\n",
+		info->endpoint.bEndpointAddress,
+		info->transfer_type.c_str(), info->dir.c_str());
+	rep->stopped = true;
+}
+
+/*----------------------------------------------------------------------*/
+
+static void reactor_service_in(struct reactor_endpoint *rep) {
+	struct in_stream *stream = rep->in;
+	struct ep_queue *queue = rep->info->data_queue;
+
+	while (stream->in_flight && stream->completed[stream->head]) {
+		int slot, nbytes;
+		int rv = in_stream_next(stream, &slot, &nbytes, 0);
+		if (rv != LIBUSB_SUCCESS) {
+			ep_queue_cancel(queue, slot);
+			if (rv == LIBUSB_ERROR_NO_DEVICE) {
+				reactor_stop_endpoint(rep);
+				return;
+			}
+			continue;
+		}
+		ep_publish_in(rep->info, slot, nbytes);
+	}
+
+	ep_fill_in_stream(stream, queue);
+}
+
+static void reactor_service_out(struct reactor_endpoint *rep) {
+	struct out_stream *stream = rep->out;
+	struct thread_info *info = rep->info;
+	struct ep_queue *queue = info->data_queue;
+
+	while (stream->in_flight && stream->completed[stream->head]) {
+		if (out_stream_reap(stream, 0) == LIBUSB_ERROR_NO_DEVICE) {
+			reactor_stop_endpoint(rep);
+			return;
+		}
+	}
+
+	// Only submit into idle transfers; a full stream is picked up again
+	// once libusb reports a completion.
+	while (stream->in_flight < stream->num_transfers) {
+		struct usb_raw_transfer_io *io = ep_queue_front(queue);
+		if (!io)
+			break;
+
+		if (verbose_level >= 2)
+			printData(*io, info->endpoint.bEndpointAddress,
+				info->transfer_type, info->dir);
+
+		int rv = out_stream_submit(stream, (uint8_t *)io->data, io->inner.length);
+		if (queue->front_ack)
+			inject_ack_written(queue->front_ack, rv != LIBUSB_SUCCESS);
+		ep_queue_pop_front(queue);
+		if (rv == LIBUSB_ERROR_NO_DEVICE) {
+			reactor_stop_endpoint(rep);
+			return;
+		}
+	}
+}
+
+static void reactor_loop() {
+	// Completions reaped here need no extra wakeup.
+	stream_notify_self = true;
+
+	printf("Start reactor thread, thread id(%d)\n", gettid());
+
+	while (true) {
+		int timeout = -1;
+
+		for (size_t i = 0; i < reactor_endpoints.size(); i++) {
+			struct reactor_endpoint *rep = reactor_endpoints[i];
+			if (rep->stopped)
+				continue;
+
+			if (rep->in) {
+				reactor_service_in(rep);
+				if (!rep->stopped && rep->in->in_flight == 0 && timeout != 0)
+					timeout = REACTOR_STARVED_TIMEOUT;
+			}
+			else {
+				reactor_service_out(rep);
+				if (rep->stopped ||
+				    rep->out->in_flight == rep->out->num_transfers)
+					continue;
+				// Let the producer wake us up through the queue
+				// eventfd, unless it published in the meantime.
+				if (ep_queue_arm(rep->info->data_queue))
+					rep->armed = true;
+				else
+					timeout = 0;
+			}
+		}
+
+		if (!libusb_pollfds_handle_timeouts(context)) {
+			struct timeval tv;
+			if (libusb_get_next_timeout(context, &tv) == 1) {
+				int ms = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+				if (timeout < 0 || ms < timeout)
+					timeout = ms;
+			}
+		}
+
+		struct epoll_event events[REACTOR_MAX_EVENTS];
+		int n = epoll_wait(reactor_epfd, events, REACTOR_MAX_EVENTS, timeout);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait()");
+			exit(EXIT_FAILURE);
+		}
+
+		bool libusb_ready = (n == 0 && timeout != 0);
+		bool wake = false;
+		for (int i = 0; i < n; i++) {
+			void *tag = events[i].data.ptr;
+			if (tag == &reactor_libusb_tag)
+				libusb_ready = true;
+			else if (tag == &reactor_wake_tag)
+				wake = true;
+			else {
+				struct reactor_endpoint *rep = (struct reactor_endpoint *)tag;
+				ep_queue_ack(rep->info->data_queue);
+				rep->armed = false;
+			}
+		}
+
+		for (size_t i = 0; i < reactor_endpoints.size(); i++) {
+			struct reactor_endpoint *rep = reactor_endpoints[i];
+			if (rep->armed) {
+				ep_queue_disarm(rep->info->data_queue);
+				rep->armed = false;
+			}
+		}
+
+		if (libusb_ready) {
+			struct timeval tv = { .tv_sec = 0, .tv_usec = 0 };
+			libusb_handle_events_timeout_completed(context, &tv, NULL);
+		}
+
+		if (wake) {
+			uint64_t value;
+			if (read(reactor_wake_fd, &value, sizeof(value)) < 0 && errno != EINTR) {
+				perror("read() reactor eventfd");
+				exit(EXIT_FAILURE);
+			}
+			if (!reactor_process_requests())
+				break;
+		}
+	}
+
+	printf("End reactor thread, thread id(%d)\n", gettid());
+}
+
+/*----------------------------------------------------------------------*/
+
+void reactor_start() {
+	if (!reactor_enabled)
+		return;
+
+	reactor_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (reactor_epfd < 0) {
+		perror("epoll_create1()");
+		exit(EXIT_FAILURE);
+	}
+	reactor_wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (reactor_wake_fd < 0) {
+		perror("eventfd()");
+		exit(EXIT_FAILURE);
+	}
+
+	reactor_watch(reactor_wake_fd, EPOLLIN, &reactor_wake_tag);
+	reactor_watch_libusb();
+
+	// Stream completions handled by other threads (the hotplug monitor,
+	// synchronous control transfers) are forwarded to the reactor.
+	stream_notify_fd = reactor_wake_fd;
+
+	reactor_thread = std::thread(reactor_loop);
+}
+
+void reactor_stop() {
+	if (!reactor_thread.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(reactor_mutex);
+		reactor_please_stop = true;
+	}
+	reactor_kick();
+	reactor_thread.join();
+
+	libusb_set_pollfd_notifiers(context, NULL, NULL, NULL);
+	stream_notify_fd = -1;
+	close(reactor_wake_fd);
+	close(reactor_epfd);
+}
+
+static void reactor_request(struct thread_info *info, bool add) {
+	struct reactor_request request = { info, add, false };
+
+	std::unique_lock<std::mutex> lock(reactor_mutex);
+	reactor_requests.push_back(&request);
+	reactor_kick();
+	reactor_cond.wait(lock, [&request] { return request.done; });
+}
+
+void reactor_add(struct thread_info *info) {
+	reactor_request(info, true);
+}
+
+void reactor_remove(struct thread_info *info) {
+	reactor_request(info, false);
+}
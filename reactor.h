@@ -0,0 +1,22 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+struct thread_info;
+
+// In reactor mode a single thread drives the libusb side of every bulk and
+// interrupt endpoint from one epoll loop, and only the Raw Gadget side
+// (whose ioctls block) keeps a thread per endpoint.
+extern bool reactor_enabled;
+
+void reactor_start();
+void reactor_stop();
+
+// Hand an endpoint over to the reactor, or take it back. Both return once
+// the reactor thread has applied the change.
+void reactor_add(struct thread_info *info);
+void reactor_remove(struct thread_info *info);
+
+// Whether the libusb side of this endpoint is driven by the reactor.
+bool reactor_handles(struct thread_info *info);
+
+#endif // REACTOR_H
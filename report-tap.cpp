@@ -0,0 +1,108 @@
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "host-raw-gadget.h"
+#include "report-tap.h"
+
+struct report_tap report_tap;
+std::atomic<uint32_t> report_tap_mask(0);
+
+static uint64_t report_tap_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void report_tap_init() {
+	report_tap.head.store(0, std::memory_order_relaxed);
+	report_tap.tail.store(0, std::memory_order_relaxed);
+	report_tap.waiting.store(false, std::memory_order_relaxed);
+	for (int i = 0; i < 32; i++)
+		report_tap.overflows[i].store(0, std::memory_order_relaxed);
+	for (uint32_t i = 0; i < REPORT_TAP_RECORDS; i++)
+		report_tap.records[i].seq.store(i, std::memory_order_relaxed);
+
+	report_tap.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (report_tap.wake_fd < 0) {
+		perror("eventfd()");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void report_tap_cleanup() {
+	report_tap_mask.store(0, std::memory_order_relaxed);
+	close(report_tap.wake_fd);
+	report_tap.wake_fd = -1;
+}
+
+void report_tap_push(uint8_t ep_addr, const void *data, uint32_t length) {
+	uint32_t pos = report_tap.tail.load(std::memory_order_relaxed);
+	struct report_tap_record *record;
+
+	while (true) {
+		record = &report_tap.records[pos & (REPORT_TAP_RECORDS - 1)];
+		uint32_t seq = record->seq.load(std::memory_order_acquire);
+		int32_t diff = (int32_t)(seq - pos);
+		if (diff == 0) {
+			if (report_tap.tail.compare_exchange_weak(pos, pos + 1,
+					std::memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0) {
+			report_tap.overflows[report_tap_bit(ep_addr)].fetch_add(1,
+					std::memory_order_relaxed);
+			return;
+		}
+		else {
+			pos = report_tap.tail.load(std::memory_order_relaxed);
+		}
+	}
+
+	record->ep = ep_addr;
+	record->length = length > UINT16_MAX ? UINT16_MAX : length;
+	record->stamp = report_tap_now();
+	memcpy(record->data, data, length < REPORT_TAP_DATA ? length : REPORT_TAP_DATA);
+	record->seq.store(pos + 1, std::memory_order_release);
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (report_tap.wake_fd >= 0 && report_tap.waiting.load(std::memory_order_relaxed) &&
+	    report_tap.waiting.exchange(false, std::memory_order_relaxed)) {
+		uint64_t value = 1;
+		if (write(report_tap.wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+			perror("write() report tap eventfd");
+	}
+}
+
+bool report_tap_pop(struct report_tap_record *out) {
+	uint32_t pos = report_tap.head.load(std::memory_order_relaxed);
+	struct report_tap_record *record = &report_tap.records[pos & (REPORT_TAP_RECORDS - 1)];
+	if (record->seq.load(std::memory_order_acquire) != pos + 1)
+		return false;
+
+	out->ep = record->ep;
+	out->length = record->length;
+	out->stamp = record->stamp;
+	memcpy(out->data, record->data, std::min<uint32_t>(record->length, REPORT_TAP_DATA));
+	record->seq.store(pos + REPORT_TAP_RECORDS, std::memory_order_release);
+	report_tap.head.store(pos + 1, std::memory_order_relaxed);
+	return true;
+}
+
+void report_tap_wait(int timeout) {
+	report_tap.waiting.store(true, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	uint32_t pos = report_tap.head.load(std::memory_order_relaxed);
+	if (report_tap.records[pos & (REPORT_TAP_RECORDS - 1)].seq.load(std::memory_order_acquire) == pos + 1) {
+		report_tap.waiting.store(false, std::memory_order_relaxed);
+		return;
+	}
+
+	struct pollfd pfd = { report_tap.wake_fd, POLLIN, 0 };
+	if (poll(&pfd, 1, timeout) > 0) {
+		uint64_t value;
+		if (read(report_tap.wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+			perror("read() report tap eventfd");
+	}
+	report_tap.waiting.store(false, std::memory_order_relaxed);
+}
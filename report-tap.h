@@ -0,0 +1,61 @@
+#ifndef REPORT_TAP_H
+#define REPORT_TAP_H
+
+#include <atomic>
+#include <stdint.h>
+
+#define REPORT_TAP_CACHELINE	64
+
+// Records the ring holds (a power of two) and bytes of each report kept.
+#define REPORT_TAP_RECORDS	512
+#define REPORT_TAP_DATA		64
+
+struct report_tap_record {
+	std::atomic<uint32_t>	seq;
+	uint8_t			ep;
+	uint16_t		length;
+	uint64_t		stamp;
+	uint8_t			data[REPORT_TAP_DATA];
+};
+
+// Copies of the reports read on subscribed endpoints, on their way from
+// the endpoint readers to the subscription fan-out thread. Readers claim
+// records like the injection lane of ep_queue does and never block; when
+// the ring is full the report is counted in overflows[] and dropped. The
+// consumer sleeps on wake_fd, which readers only signal while it waits.
+struct report_tap {
+	alignas(REPORT_TAP_CACHELINE) std::atomic<uint32_t>	head;
+	alignas(REPORT_TAP_CACHELINE) std::atomic<uint32_t>	tail;
+	alignas(REPORT_TAP_CACHELINE) std::atomic<bool>		waiting;
+	std::atomic<uint64_t>					overflows[32];
+	int							wake_fd;
+	struct report_tap_record				records[REPORT_TAP_RECORDS];
+};
+
+extern struct report_tap report_tap;
+
+// Endpoints somebody subscribed to, one bit per report_tap_bit(); readers
+// skip the tap entirely for the others.
+extern std::atomic<uint32_t> report_tap_mask;
+
+static inline int report_tap_bit(uint8_t ep_addr) {
+	return (ep_addr & 0x0f) | ((ep_addr & 0x80) >> 3);
+}
+
+static inline bool report_tap_wanted(uint8_t ep_addr) {
+	return report_tap_mask.load(std::memory_order_relaxed) & (1u << report_tap_bit(ep_addr));
+}
+
+void report_tap_init();
+void report_tap_cleanup();
+
+// Any endpoint reader. Reports longer than REPORT_TAP_DATA are cut short;
+// length keeps the original size.
+void report_tap_push(uint8_t ep_addr, const void *data, uint32_t length);
+
+// Consumer side. pop() copies the oldest record out, returning false if
+// there is none; wait() sleeps up to timeout ms for one.
+bool report_tap_pop(struct report_tap_record *record);
+void report_tap_wait(int timeout);
+
+#endif // REPORT_TAP_H
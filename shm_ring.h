@@ -0,0 +1,131 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+// Shared-memory injection ring for clients running on the same machine as
+// the proxy (--shm_ring NAME). It saves the sendto()/recvfrom() pair of the
+// UDP transport: a client writes binary messages (see udp_protocol.h)
+// straight into a record and only makes a syscall when the proxy is asleep.
+//
+// This header is all a client needs, in C or C++:
+//
+//	struct shm_ring *ring = shm_ring_open("/usb-proxy");
+//	struct udp_msg_move move = { { UDP_MSG_MAGIC, UDP_MSG_VERSION, UDP_MSG_MOVE, 0 }, 10, -5, 0, 0 };
+//	shm_ring_send(ring, &move, sizeof(move));
+//
+// The ring is a bounded multi-producer queue of fixed-size records. A
+// producer claims a record by advancing tail with a CAS and publishes it by
+// storing its sequence number, so any number of client processes may write
+// at once. The proxy sets consumer_waiting before sleeping on it as a
+// futex; the producer that sees it set wakes the proxy up.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "udp_protocol.h"
+
+#define SHM_RING_MAGIC		0x50495355	// "USIP"
+#define SHM_RING_VERSION	1
+
+// Number of records, a power of two, and bytes of messages per record.
+#define SHM_RING_RECORDS	256
+#define SHM_RING_DATA		120
+
+#define SHM_RING_CACHELINE	64
+
+struct shm_ring_record {
+	uint32_t	seq;
+	uint16_t	length;
+	uint16_t	reserved;
+	uint8_t		data[SHM_RING_DATA];
+};
+
+struct shm_ring {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	records;
+	uint32_t	record_size;
+	uint32_t	consumer_waiting __attribute__((aligned(SHM_RING_CACHELINE)));
+	uint32_t	head __attribute__((aligned(SHM_RING_CACHELINE)));
+	uint32_t	tail __attribute__((aligned(SHM_RING_CACHELINE)));
+	uint64_t	overflows;
+	struct shm_ring_record	record[SHM_RING_RECORDS] __attribute__((aligned(SHM_RING_CACHELINE)));
+};
+
+static inline long shm_ring_futex(uint32_t *word, int op, uint32_t value,
+				const struct timespec *timeout) {
+	return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+// Maps the ring the proxy created. Returns NULL if there is none or it has
+// a different layout.
+static inline struct shm_ring *shm_ring_open(const char *name) {
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return NULL;
+	void *map = mmap(NULL, sizeof(struct shm_ring), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	struct shm_ring *ring = (struct shm_ring *)map;
+	if (ring->magic != SHM_RING_MAGIC || ring->version != SHM_RING_VERSION ||
+	    ring->records != SHM_RING_RECORDS ||
+	    ring->record_size != sizeof(struct shm_ring_record)) {
+		munmap(map, sizeof(struct shm_ring));
+		return NULL;
+	}
+	return ring;
+}
+
+static inline void shm_ring_close(struct shm_ring *ring) {
+	munmap(ring, sizeof(struct shm_ring));
+}
+
+// Queues length bytes of binary messages, handled in one go. Returns 0, or
+// -1 if the ring is full or the messages do not fit a record.
+static inline int shm_ring_send(struct shm_ring *ring, const void *msgs, size_t length) {
+	if (length > SHM_RING_DATA)
+		return -1;
+
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	struct shm_ring_record *record;
+	for (;;) {
+		record = &ring->record[tail & (SHM_RING_RECORDS - 1)];
+		uint32_t seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+		int32_t diff = (int32_t)(seq - tail);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ring->tail, &tail, tail + 1, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff < 0) {
+			__atomic_fetch_add(&ring->overflows, 1, __ATOMIC_RELAXED);
+			return -1;
+		}
+		else
+			tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	}
+
+	memcpy(record->data, msgs, length);
+	record->length = length;
+	__atomic_store_n(&record->seq, tail + 1, __ATOMIC_RELEASE);
+
+	// Pairs with the fence the proxy issues between setting
+	// consumer_waiting and checking the ring a last time.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->consumer_waiting, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&ring->consumer_waiting, 0, __ATOMIC_RELAXED))
+		shm_ring_futex(&ring->consumer_waiting, FUTEX_WAKE, INT_MAX, NULL);
+	return 0;
+}
+
+#endif // SHM_RING_H
@@ -0,0 +1,169 @@
+#include <cinttypes>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sys/resource.h>
+
+#include "host-raw-gadget.h"
+#include "ep-queue.h"
+#include "stats.h"
+#include "reactor.h"
+#include "poll-phase.h"
+
+int stats_interval = 0;
+
+struct stats_lane {
+	uint64_t		transfers;
+	uint64_t		wait_ns;
+	uint64_t		dropped;
+};
+
+struct stats_entry {
+	struct thread_info	*info;
+	uint64_t		wakeups;
+	uint64_t		idle_wakeups;
+	uint64_t		signals;
+	uint64_t		bytes;
+	struct stats_lane	lanes[2];
+};
+
+static std::mutex stats_mutex;
+static std::vector<struct stats_entry> stats_entries;
+
+static std::thread stats_thread;
+static std::mutex stats_stop_mutex;
+static std::condition_variable stats_stop_cond;
+static bool stats_please_stop = false;
+
+static uint64_t stats_context_switches = 0;
+
+// Voluntary and involuntary context switches of all threads so far.
+static uint64_t stats_get_context_switches() {
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) < 0)
+		return 0;
+	return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+// Endpoints register themselves in process_eps() and unregister in
+// terminate_eps() before their queues are destroyed, so the reporter never
+// touches a queue that is being torn down.
+void stats_register(struct thread_info *info) {
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	struct stats_entry entry = {};
+	entry.info = info;
+	stats_entries.push_back(entry);
+}
+
+void stats_unregister(struct thread_info *info) {
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	for (size_t i = 0; i < stats_entries.size(); i++) {
+		if (stats_entries[i].info == info) {
+			stats_entries.erase(stats_entries.begin() + i);
+			return;
+		}
+	}
+}
+
+static void stats_report() {
+	std::lock_guard<std::mutex> lock(stats_mutex);
+
+	uint64_t context_switches = stats_get_context_switches();
+	printf("[STATS] mode %s, context switches %.1f/s\n",
+		reactor_enabled ? "reactor" : "threads",
+		(double)(context_switches - stats_context_switches) / stats_interval);
+	stats_context_switches = context_switches;
+
+	for (size_t i = 0; i < stats_entries.size(); i++) {
+		struct stats_entry *entry = &stats_entries[i];
+		struct thread_info *info = entry->info;
+		struct ep_queue *queue = info->data_queue;
+
+		uint64_t wakeups = queue->wakeups.load(std::memory_order_relaxed);
+		uint64_t idle_wakeups = queue->idle_wakeups.load(std::memory_order_relaxed);
+		uint64_t signals = queue->signals.load(std::memory_order_relaxed);
+		uint64_t bytes = queue->bytes.load(std::memory_order_relaxed);
+
+		printf("[STATS] EP%02x(%s_%s): depth %u, overflows %" PRIu64 ", "
+			"wakeups %.1f/s (idle %.1f/s), signals %.1f/s, %.1f KB/s\n",
+			info->endpoint.bEndpointAddress,
+			info->transfer_type.c_str(), info->dir.c_str(),
+			ep_queue_size(queue), ep_queue_overflows(queue),
+			(double)(wakeups - entry->wakeups) / stats_interval,
+			(double)(idle_wakeups - entry->idle_wakeups) / stats_interval,
+			(double)(signals - entry->signals) / stats_interval,
+			(double)(bytes - entry->bytes) / 1024 / stats_interval);
+
+		entry->wakeups = wakeups;
+		entry->idle_wakeups = idle_wakeups;
+		entry->signals = signals;
+		entry->bytes = bytes;
+
+		static const char *lane_names[] = {"data", "inject"};
+		for (int l = 0; l < 2; l++) {
+			struct ep_lane_stats *lane = &queue->lanes[l];
+			struct stats_lane *last = &entry->lanes[l];
+			uint64_t transfers = lane->transfers.load(std::memory_order_relaxed);
+			uint64_t wait_ns = lane->wait_ns.load(std::memory_order_relaxed);
+			uint64_t dropped = lane->dropped.load(std::memory_order_relaxed);
+			uint64_t max_wait_ns = lane->max_wait_ns.exchange(0, std::memory_order_relaxed);
+			uint32_t max_depth = lane->max_depth.exchange(0, std::memory_order_relaxed);
+
+			printf("[STATS] EP%02x %s lane: depth %u (max %u), %.1f transfers/s, "
+				"wait avg %.1f us (max %.1f us), dropped %" PRIu64 "\n",
+				info->endpoint.bEndpointAddress, lane_names[l],
+				ep_queue_lane_size(queue, l), max_depth,
+				(double)(transfers - last->transfers) / stats_interval,
+				transfers > last->transfers ?
+					(double)(wait_ns - last->wait_ns) / (transfers - last->transfers) / 1000 : 0.0,
+				(double)max_wait_ns / 1000, dropped - last->dropped);
+
+			last->transfers = transfers;
+			last->wait_ns = wait_ns;
+			last->dropped = dropped;
+		}
+
+		struct poll_estimator *poll = info->poll;
+		if (poll) {
+			printf("[STATS] EP%02x polls: period %.1f us (nominal %.1f us), "
+				"phase error %.1f us, %" PRIu64 " samples\n",
+				info->endpoint.bEndpointAddress,
+				(double)poll->period_ns.load(std::memory_order_relaxed) / 1000,
+				(double)poll->nominal_ns / 1000,
+				(double)poll->phase_error_ns.load(std::memory_order_relaxed) / 1000,
+				poll->samples.load(std::memory_order_relaxed));
+		}
+	}
+}
+
+static void stats_loop() {
+	printf("Start stats thread, interval %ds, thread id(%d)\n",
+		stats_interval, gettid());
+
+	stats_context_switches = stats_get_context_switches();
+
+	std::unique_lock<std::mutex> lock(stats_stop_mutex);
+	while (!stats_please_stop) {
+		stats_stop_cond.wait_for(lock, std::chrono::seconds(stats_interval));
+		if (stats_please_stop)
+			break;
+		stats_report();
+	}
+}
+
+void stats_start() {
+	if (stats_interval <= 0)
+		return;
+	stats_thread = std::thread(stats_loop);
+}
+
+void stats_stop() {
+	if (!stats_thread.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(stats_stop_mutex);
+		stats_please_stop = true;
+	}
+	stats_stop_cond.notify_all();
+	stats_thread.join();
+}
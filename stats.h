@@ -0,0 +1,17 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+struct thread_info;
+
+// Seconds between periodic statistics reports, 0 disables them.
+extern int stats_interval;
+
+void stats_register(struct thread_info *info);
+void stats_unregister(struct thread_info *info);
+
+void stats_start();
+void stats_stop();
+
+#endif // STATS_H
@@ -0,0 +1,127 @@
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "host-raw-gadget.h"
+#include "timer-wheel.h"
+
+uint64_t timer_wheel_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct timer_wheel *timer_wheel_create() {
+	struct timer_wheel *wheel = new struct timer_wheel;
+	for (int i = 0; i < TIMER_WHEEL_SLOTS; i++)
+		wheel->slots[i] = NULL;
+	wheel->tick = timer_wheel_now() / TIMER_WHEEL_TICK;
+	wheel->count = 0;
+	wheel->armed = 0;
+	wheel->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (wheel->fd < 0) {
+		perror("timerfd_create()");
+		exit(EXIT_FAILURE);
+	}
+	return wheel;
+}
+
+void timer_wheel_destroy(struct timer_wheel *wheel) {
+	if (!wheel)
+		return;
+	close(wheel->fd);
+	delete wheel;
+}
+
+// deadline 0 disarms the timer.
+static void timer_wheel_arm(struct timer_wheel *wheel, uint64_t deadline) {
+	struct itimerspec spec = {};
+	spec.it_value.tv_sec = deadline / 1000000000;
+	spec.it_value.tv_nsec = deadline % 1000000000;
+	if (timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+		perror("timerfd_settime()");
+		exit(EXIT_FAILURE);
+	}
+	wheel->armed = deadline;
+}
+
+void timer_wheel_add(struct timer_wheel *wheel, struct timer_event *event) {
+	// Deadlines already past go into the current slot; 0 would disarm
+	// the timerfd.
+	if (event->deadline == 0)
+		event->deadline = 1;
+	uint64_t tick = event->deadline / TIMER_WHEEL_TICK;
+	if (tick < wheel->tick)
+		tick = wheel->tick;
+
+	struct timer_event **link = &wheel->slots[tick & (TIMER_WHEEL_SLOTS - 1)];
+	while (*link)
+		link = &(*link)->next;
+	event->next = NULL;
+	*link = event;
+	wheel->count++;
+
+	if (!wheel->armed || event->deadline < wheel->armed)
+		timer_wheel_arm(wheel, event->deadline);
+}
+
+// Earliest deadline, found by walking the slots from the current one
+// until one holds an event of the current turn.
+static uint64_t timer_wheel_next(struct timer_wheel *wheel) {
+	if (!wheel->count)
+		return 0;
+
+	for (uint64_t i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+		uint64_t end = (wheel->tick + i + 1) * TIMER_WHEEL_TICK;
+		uint64_t next = 0;
+		struct timer_event *event = wheel->slots[(wheel->tick + i) & (TIMER_WHEEL_SLOTS - 1)];
+		for (; event; event = event->next) {
+			if (event->deadline < end && (!next || event->deadline < next))
+				next = event->deadline;
+		}
+		if (next)
+			return next;
+	}
+
+	// Everything is at least one turn away.
+	uint64_t next = 0;
+	for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+		for (struct timer_event *event = wheel->slots[i]; event; event = event->next) {
+			if (!next || event->deadline < next)
+				next = event->deadline;
+		}
+	}
+	return next;
+}
+
+struct timer_event *timer_wheel_expire(struct timer_wheel *wheel, uint64_t now) {
+	struct timer_event *due = NULL;
+	uint64_t end = now / TIMER_WHEEL_TICK;
+	uint64_t ticks = end >= wheel->tick ? end - wheel->tick + 1 : 1;
+	if (ticks > TIMER_WHEEL_SLOTS)
+		ticks = TIMER_WHEEL_SLOTS;
+
+	for (uint64_t i = 0; i < ticks && wheel->count; i++) {
+		struct timer_event **link = &wheel->slots[(wheel->tick + i) & (TIMER_WHEEL_SLOTS - 1)];
+		while (*link) {
+			struct timer_event *event = *link;
+			if (event->deadline > now) {
+				link = &event->next;
+				continue;
+			}
+			*link = event->next;
+			wheel->count--;
+
+			// Keep due sorted, after the events with the same deadline.
+			struct timer_event **pos = &due;
+			while (*pos && (*pos)->deadline <= event->deadline)
+				pos = &(*pos)->next;
+			event->next = *pos;
+			*pos = event;
+		}
+	}
+	if (end > wheel->tick)
+		wheel->tick = end;
+
+	timer_wheel_arm(wheel, timer_wheel_next(wheel));
+	return due;
+}
@@ -0,0 +1,43 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+// Width of one slot in ns, and number of slots (a power of two). Events
+// further out than one turn of the wheel wait in their slot for later
+// turns.
+#define TIMER_WHEEL_TICK	100000
+#define TIMER_WHEEL_SLOTS	1024
+
+// Embedded at the start of whatever the owner schedules.
+struct timer_event {
+	uint64_t		deadline;
+	struct timer_event	*next;
+};
+
+// Hashed timer wheel keyed on CLOCK_MONOTONIC ns. Adding an event only
+// walks its own slot and expiring only visits the slots that went by. fd
+// is a timerfd armed for the earliest deadline, to be polled by the
+// owning thread, which is the only one touching the wheel.
+struct timer_wheel {
+	struct timer_event	*slots[TIMER_WHEEL_SLOTS];
+	uint64_t		tick;
+	unsigned int		count;
+	uint64_t		armed;
+	int			fd;
+};
+
+uint64_t timer_wheel_now();
+
+struct timer_wheel *timer_wheel_create();
+// Events still pending are not freed.
+void timer_wheel_destroy(struct timer_wheel *wheel);
+
+void timer_wheel_add(struct timer_wheel *wheel, struct timer_event *event);
+
+// Unlinks the events due by now and returns them ordered by deadline,
+// events with the same deadline in the order they were added. Then arms fd
+// for the next deadline.
+struct timer_event *timer_wheel_expire(struct timer_wheel *wheel, uint64_t now);
+
+#endif // TIMER_WHEEL_H
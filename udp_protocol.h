@@ -0,0 +1,149 @@
+#ifndef UDP_PROTOCOL_H
+#define UDP_PROTOCOL_H
+
+#include <stdint.h>
+
+// Binary datagrams accepted on the UDP port alongside the text commands.
+// A datagram carries one or more messages back to back, each starting
+// with udp_msg_header. All integers are little-endian. Text commands never
+// start with UDP_MSG_MAGIC, so both formats share the port.
+
+#define UDP_MSG_MAGIC		0xa5
+#define UDP_MSG_VERSION		1
+
+enum udp_msg_op {
+	UDP_MSG_MOVE	= 1,
+	UDP_MSG_BUTTON	= 2,
+	UDP_MSG_RAW	= 3,
+	UDP_MSG_SCHEDULE = 4,
+	UDP_MSG_SEQ	= 5,
+	UDP_MSG_ACK	= 6,
+	UDP_MSG_REPORT	= 7,
+	UDP_MSG_SUBSCRIBE = 8,
+	UDP_MSG_KEY	= 9,
+	UDP_MSG_TYPE	= 10,
+};
+
+struct udp_msg_header {
+	uint8_t		magic;
+	uint8_t		version;
+	uint8_t		op;
+	uint8_t		reserved;
+} __attribute__((packed));
+
+// Relative mouse motion, with the buttons the physical mouse holds.
+struct udp_msg_move {
+	struct udp_msg_header	header;
+	int16_t			x;
+	int16_t			y;
+	int8_t			wheel;
+	uint8_t			reserved;
+} __attribute__((packed));
+
+enum udp_msg_button_action {
+	UDP_MSG_BUTTON_SET	= 0,	// buttons is the new state
+	UDP_MSG_BUTTON_DOWN	= 1,	// press the buttons set in buttons
+	UDP_MSG_BUTTON_UP	= 2,	// release the buttons set in buttons
+};
+
+struct udp_msg_button {
+	struct udp_msg_header	header;
+	uint8_t			action;
+	uint8_t			buttons;
+	uint16_t		reserved;
+} __attribute__((packed));
+
+// A raw transfer for endpoint ep; length bytes of data follow.
+struct udp_msg_raw {
+	struct udp_msg_header	header;
+	uint8_t			ep;
+	uint8_t			reserved;
+	uint16_t		length;
+} __attribute__((packed));
+
+#define UDP_MSG_SCHEDULE_ABSOLUTE	0x01
+
+// Runs the messages that follow it in the datagram later: time microseconds
+// from now, or at time ns of CLOCK_MONOTONIC with UDP_MSG_SCHEDULE_ABSOLUTE.
+struct udp_msg_schedule {
+	struct udp_msg_header	header;
+	uint8_t			flags;
+	uint8_t			reserved[3];
+	uint64_t		time;
+} __attribute__((packed));
+
+// Asks for an acknowledgement of the messages that follow it in the
+// datagram, up to the next udp_msg_seq.
+struct udp_msg_seq {
+	struct udp_msg_header	header;
+	uint32_t		seq;
+} __attribute__((packed));
+
+// Sent back to the client once everything its udp_msg_seq covered was
+// written to the host, or dropped. Times are CLOCK_MONOTONIC ns; written
+// is 0 if nothing was injected.
+struct udp_msg_ack {
+	struct udp_msg_header	header;
+	uint8_t			status;		// enum inject_ack_status
+	uint8_t			reserved[3];
+	uint32_t		seq;
+	uint64_t		received;
+	uint64_t		enqueued;
+	uint64_t		written;
+} __attribute__((packed));
+
+enum udp_msg_subscribe_action {
+	UDP_MSG_UNSUBSCRIBE	= 0,
+	UDP_MSG_SUBSCRIBE_EP	= 1,
+};
+
+// Asks for a copy of every report read on endpoint ep (0: the mouse
+// endpoint), or stops it (0: all endpoints). Subscriptions expire unless
+// renewed, see UDP_SUBSCRIBE_TIMEOUT.
+struct udp_msg_subscribe {
+	struct udp_msg_header	header;
+	uint8_t			action;
+	uint8_t			ep;
+	uint16_t		reserved;
+} __attribute__((packed));
+
+// One report read on a subscribed endpoint, from the device for IN
+// endpoints or from the host for OUT ones; length bytes follow, at most 64.
+// seq counts the reports sent to this subscriber and dropped the ones it
+// lost so far, because the proxy fell behind or the socket was full.
+struct udp_msg_report {
+	struct udp_msg_header	header;
+	uint8_t			ep;
+	uint8_t			reserved;
+	uint16_t		length;
+	uint32_t		seq;
+	uint32_t		dropped;
+	uint64_t		timestamp;	// CLOCK_MONOTONIC ns when read
+} __attribute__((packed));
+
+enum udp_msg_key_action {
+	UDP_MSG_KEY_UP		= 0,
+	UDP_MSG_KEY_DOWN	= 1,
+	UDP_MSG_KEY_TAP		= 2,	// press, then release on the next report
+};
+
+#define UDP_MSG_PAGE_KEYBOARD	0x07
+#define UDP_MSG_PAGE_CONSUMER	0x0c
+
+// Presses or releases the key with HID usage usage of page, a keyboard key
+// or a media key. Releasing keyboard usage 0 releases every key.
+struct udp_msg_key {
+	struct udp_msg_header	header;
+	uint8_t			action;
+	uint8_t			page;
+	uint16_t		usage;
+} __attribute__((packed));
+
+// Types length bytes of ASCII text that follow, one key per poll.
+struct udp_msg_type {
+	struct udp_msg_header	header;
+	uint16_t		length;
+	uint16_t		reserved;
+} __attribute__((packed));
+
+#endif // UDP_PROTOCOL_H
@@ -1,9 +1,25 @@
 #include "udp_server.h"
 #include "host-raw-gadget.h"
+#include "ep-queue.h"
 #include "proxy.h"
 #include "misc.h"
+#include "injection.h"
+#include "udp_protocol.h"
+#include "ep-routes.h"
+#include "fusion.h"
+#include "poll-phase.h"
+#include "timer-wheel.h"
+#include "shm_ring.h"
+#include "inject-ack.h"
+#include "report-tap.h"
+#include "hid-report.h"
+#include "keyboard.h"
 
+#include <endian.h>
+#include <poll.h>
+#include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <iostream>
@@ -11,6 +27,7 @@
 #include <cstring>
 #include <algorithm>
 #include <iomanip>
+#include <cinttypes>
 
 // Global variable to track real mouse button state from physical mouse
 std::atomic<uint8_t> g_real_mouse_button_state(0x00);
@@ -20,7 +37,12 @@ void update_real_mouse_state(uint8_t button_state) {
     g_real_mouse_button_state.store(button_state);
 }
 
-UdpServer::UdpServer(int port) : port(port), sockfd(-1), running(false), current_button_state(0x00) {}
+int udp_batch = 1;
+
+std::string shm_ring_name;
+bool shm_busy_poll = false;
+
+UdpServer::UdpServer(int port) : port(port), sockfd(-1), running(false), current_button_state(0x00), routes(NULL), batching(false), timers(NULL), ring(NULL), sender(NULL), received_ns(0), current_ack(0), typing_armed(false) {}
 
 UdpServer::~UdpServer() {
     stop();
@@ -34,8 +56,9 @@ void UdpServer::start() {
     }
 
     // Configure socket for low latency
-    // Minimize receive buffer to reduce buffering delay
-    int rcvbuf = 4096;  // Small buffer for low latency
+    // Minimize receive buffer to reduce buffering delay, unless batching:
+    // then it has to absorb a burst while the previous batch is processed
+    int rcvbuf = udp_batch > 1 ? udp_batch * 4096 : 4096;
     if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0) {
         perror("setsockopt SO_RCVBUF failed (non-fatal)");
     }
@@ -67,9 +90,26 @@ void UdpServer::start() {
         return;
     }
 
+    timers = timer_wheel_create();
+    inject_ack_fd = sockfd;
     running = true;
-    server_thread = std::thread(&UdpServer::server_loop, this);
+    if (udp_batch > 1) {
+        batch_buffers.resize((size_t)udp_batch * UDP_DATAGRAM_SIZE);
+        pending_signals.reserve(32);
+        server_thread = std::thread(&UdpServer::batch_loop, this);
+    } else {
+        server_thread = std::thread(&UdpServer::server_loop, this);
+    }
     printf("UDP Server started on port %d\n", port);
+
+    report_tap_init();
+    fanout_thread = std::thread(&UdpServer::fanout_loop, this);
+
+    if (!shm_ring_name.empty() && shm_create()) {
+        shm_thread = std::thread(&UdpServer::shm_loop, this);
+        printf("Shared memory injection ring %s ready%s\n", shm_ring_name.c_str(),
+               shm_busy_poll ? " (busy polling)" : "");
+    }
 }
 
 void UdpServer::stop() {
@@ -78,53 +118,727 @@ void UdpServer::stop() {
         close(sockfd);
         sockfd = -1;
     }
+    if (ring) {
+        // Wake the ring consumer up to notice
+        __atomic_store_n(&ring->consumer_waiting, 0, __ATOMIC_RELAXED);
+        shm_ring_futex(&ring->consumer_waiting, FUTEX_WAKE, INT_MAX, NULL);
+    }
 }
 
 void UdpServer::join() {
     if (server_thread.joinable()) {
         server_thread.join();
     }
+    if (shm_thread.joinable()) {
+        shm_thread.join();
+        shm_destroy();
+    }
+    if (fanout_thread.joinable()) {
+        fanout_thread.join();
+        report_tap_cleanup();
+    }
 }
 
 void UdpServer::server_loop() {
-    char buffer[1024];
+    char buffer[UDP_DATAGRAM_SIZE];
     struct sockaddr_in cliaddr;
     socklen_t len;
 
     while (running) {
+        if (!wait_datagram())
+            continue;
+
         len = sizeof(cliaddr);
-        int n = recvfrom(sockfd, buffer, sizeof(buffer) - 1, 0, (struct sockaddr *)&cliaddr, &len);
-        if (n > 0) {
-            buffer[n] = '\0';
-            std::string packet(buffer);
-            // Remove newline if present
-            packet.erase(std::remove(packet.begin(), packet.end(), '\n'), packet.end());
-            packet.erase(std::remove(packet.begin(), packet.end(), '\r'), packet.end());
-            
-            if (debug_level >= 1) {
-                printf("[UDP] Received: %s\n", packet.c_str());
+        int n = recvfrom(sockfd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT, (struct sockaddr *)&cliaddr, &len);
+        if (n <= 0)
+            continue;
+
+        uint64_t received = inject_ack_now();
+        std::lock_guard<std::mutex> lock(handle_mutex);
+        int rcu;
+        routes_lock(&rcu);
+        handle_datagram(buffer, n, &cliaddr, received);
+        routes_unlock(rcu);
+    }
+
+    free_timers();
+}
+
+// Drains up to udp_batch datagrams per wakeup and handles them in order.
+// Injections made while handling a batch only wake each endpoint writer
+// once, after the whole batch.
+void UdpServer::batch_loop() {
+    struct mmsghdr msgs[UDP_BATCH_MAX];
+    struct iovec iovs[UDP_BATCH_MAX];
+    struct sockaddr_in addrs[UDP_BATCH_MAX];
+
+    for (int i = 0; i < udp_batch; i++) {
+        iovs[i].iov_base = &batch_buffers[(size_t)i * UDP_DATAGRAM_SIZE];
+        iovs[i].iov_len = UDP_DATAGRAM_SIZE - 1;
+    }
+
+    while (running) {
+        for (int i = 0; i < udp_batch; i++) {
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+
+        if (!wait_datagram())
+            continue;
+
+        int n = recvmmsg(sockfd, msgs, udp_batch, MSG_DONTWAIT, NULL);
+        if (n <= 0)
+            continue;
+        uint64_t received = inject_ack_now();
+
+        if (debug_level >= 2) {
+            printf("[UDP] Received a batch of %d datagrams\n", n);
+        }
+
+        // The routes stay locked until the queues have been signalled
+        std::lock_guard<std::mutex> lock(handle_mutex);
+        int rcu;
+        routes_lock(&rcu);
+        batching = true;
+        for (int i = 0; i < n; i++)
+            handle_datagram((char *)iovs[i].iov_base, msgs[i].msg_len, &addrs[i], received);
+        batching = false;
+        flush_signals();
+        routes_unlock(rcu);
+    }
+
+    free_timers();
+}
+
+// Waits up to a second for a datagram, running the timed commands that
+// fall due meanwhile. Returns whether a datagram is ready.
+bool UdpServer::wait_datagram() {
+    struct pollfd fds[2];
+    fds[0].fd = sockfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = timers->fd;
+    fds[1].events = POLLIN;
+
+    int n = poll(fds, 2, 1000);
+    if (n <= 0)
+        return false;
+
+    if (fds[1].revents & POLLIN)
+        run_timers();
+    return fds[0].revents & POLLIN;
+}
+
+bool UdpServer::schedule(uint64_t deadline, bool binary, const void* data, size_t length) {
+    // The ring consumer can outlive the server thread, which frees timers
+    if (!timers)
+        return false;
+    if (timers->count >= UDP_MAX_TIMERS) {
+        printf("Error: Too many timed commands pending, dropped one\n");
+        return false;
+    }
+    if (length > UDP_DATAGRAM_SIZE)
+        length = UDP_DATAGRAM_SIZE;
+
+    struct udp_timer* timer = new struct udp_timer;
+    timer->event.deadline = deadline;
+    // Timed commands are acknowledged to whoever sent them
+    timer->has_sender = sender != NULL;
+    if (sender)
+        timer->sender = *sender;
+    timer->binary = binary;
+    timer->length = length;
+    memcpy(timer->data, data, length);
+    timer_wheel_add(timers, &timer->event);
+    return true;
+}
+
+// "@MS COMMAND" runs COMMAND MS milliseconds from now, "@@NS COMMAND" at
+// NS nanoseconds of CLOCK_MONOTONIC.
+void UdpServer::handle_schedule(const std::string& command) {
+    bool absolute = command.compare(0, 2, "@@") == 0;
+    const char* start = command.c_str() + (absolute ? 2 : 1);
+    char* end;
+    uint64_t deadline;
+    if (absolute) {
+        deadline = strtoull(start, &end, 10);
+    } else {
+        double ms = strtod(start, &end);
+        if (ms < 0)
+            end = (char *)start;
+        deadline = timer_wheel_now() + (uint64_t)(ms * 1000000);
+    }
+
+    size_t rest = command.find_first_not_of(' ', end - command.c_str());
+    if (end == start || rest == std::string::npos || (*end != ' ')) {
+        printf("Error: Timed commands are @MS COMMAND or @@NS COMMAND\n");
+        return;
+    }
+
+    if (debug_level >= 2) {
+        printf("[TMR] Scheduled '%s' in %.3f ms\n", command.c_str() + rest,
+               ((int64_t)deadline - (int64_t)timer_wheel_now()) / 1e6);
+    }
+    schedule(deadline, false, command.c_str() + rest, command.size() - rest);
+}
+
+// Runs the timed commands that are due as one batch.
+void UdpServer::run_timers() {
+    uint64_t expirations;
+    if (read(timers->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        perror("read() timerfd");
+
+    std::lock_guard<std::mutex> lock(handle_mutex);
+    uint64_t now = timer_wheel_now();
+    struct timer_event* event = timer_wheel_expire(timers, now);
+    if (!event)
+        return;
+
+    int rcu;
+    routes_lock(&rcu);
+    batching = true;
+    while (event) {
+        if (event == &typing_event) {
+            event = event->next;
+            type_next();
+            continue;
+        }
+        struct udp_timer* timer = (struct udp_timer *)event;
+        event = event->next;
+
+        if (debug_level >= 2) {
+            printf("[TMR] Running timed command %.3f ms late\n",
+                   (now - timer->event.deadline) / 1e6);
+        }
+        sender = timer->has_sender ? &timer->sender : NULL;
+        received_ns = now;
+        if (timer->binary)
+            process_binary((const uint8_t *)timer->data, timer->length);
+        else
+            process_packet(std::string(timer->data, timer->length));
+        sender = NULL;
+        delete timer;
+    }
+    batching = false;
+    flush_signals();
+    routes_unlock(rcu);
+}
+
+void UdpServer::free_timers() {
+    std::lock_guard<std::mutex> lock(handle_mutex);
+    struct timer_event* event = timer_wheel_expire(timers, UINT64_MAX);
+    while (event) {
+        struct timer_event* next = event->next;
+        if (event != &typing_event)
+            delete (struct udp_timer *)event;
+        event = next;
+    }
+    drop_typing();
+    typing_armed = false;
+    timer_wheel_destroy(timers);
+    timers = NULL;
+}
+
+bool UdpServer::shm_create() {
+    int fd = shm_open(shm_ring_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0660);
+    if (fd < 0) {
+        perror("shm_open() injection ring");
+        return false;
+    }
+    if (ftruncate(fd, sizeof(struct shm_ring)) < 0) {
+        perror("ftruncate() injection ring");
+        close(fd);
+        return false;
+    }
+    void* map = mmap(NULL, sizeof(struct shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap() injection ring");
+        return false;
+    }
+
+    ring = (struct shm_ring *)map;
+    ring->records = SHM_RING_RECORDS;
+    ring->record_size = sizeof(struct shm_ring_record);
+    ring->consumer_waiting = 0;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->overflows = 0;
+    for (uint32_t i = 0; i < SHM_RING_RECORDS; i++)
+        ring->record[i].seq = i;
+    ring->version = SHM_RING_VERSION;
+    // Clients only accept the ring once it is fully initialized
+    __atomic_store_n(&ring->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+    return true;
+}
+
+void UdpServer::shm_destroy() {
+    munmap(ring, sizeof(struct shm_ring));
+    ring = NULL;
+    shm_unlink(shm_ring_name.c_str());
+}
+
+// Drains the ring, sleeping on consumer_waiting while it is empty unless
+// busy polling.
+void UdpServer::shm_loop() {
+    while (running) {
+        if (shm_drain())
+            continue;
+
+        if (shm_busy_poll)
+            continue;
+
+        __atomic_store_n(&ring->consumer_waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (shm_drain() || !running) {
+            __atomic_store_n(&ring->consumer_waiting, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // Times out to notice stop() should its wakeup race with us
+        struct timespec timeout = { 1, 0 };
+        shm_ring_futex(&ring->consumer_waiting, FUTEX_WAIT, 1, &timeout);
+        __atomic_store_n(&ring->consumer_waiting, 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Handles the records published so far as one batch. Returns false if
+// there were none.
+bool UdpServer::shm_drain() {
+    uint32_t head = ring->head;
+    struct shm_ring_record* record = &ring->record[head & (SHM_RING_RECORDS - 1)];
+    if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != head + 1)
+        return false;
+
+    std::lock_guard<std::mutex> lock(handle_mutex);
+    int rcu;
+    routes_lock(&rcu);
+    batching = true;
+    do {
+        // Copied out first: the client could still scribble over the
+        // record while the messages are decoded
+        uint8_t data[SHM_RING_DATA];
+        size_t length = std::min<size_t>(record->length, SHM_RING_DATA);
+        memcpy(data, record->data, length);
+        __atomic_store_n(&record->seq, head + SHM_RING_RECORDS, __ATOMIC_RELEASE);
+        head++;
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELAXED);
+
+        if (debug_level >= 2) {
+            printf("[SHM] Received %zu bytes\n", length);
+        }
+        // No reply address, so sequence numbers are ignored
+        process_binary(data, length);
+
+        record = &ring->record[head & (SHM_RING_RECORDS - 1)];
+    } while (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) == head + 1);
+    batching = false;
+    flush_signals();
+    routes_unlock(rcu);
+    return true;
+}
+
+// Reports lost by sub: those it could not be sent, and those the tap
+// dropped on its endpoints since it subscribed to them.
+static uint64_t subscriber_drops(const struct udp_subscriber& sub) {
+    uint64_t drops = sub.send_drops;
+    for (int bit = 0; bit < 32; bit++) {
+        if (sub.eps & (1u << bit))
+            drops += report_tap.overflows[bit].load(std::memory_order_relaxed) - sub.tap_base[bit];
+    }
+    return drops;
+}
+
+static void print_subscriber(const struct udp_subscriber& sub, const char* what) {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &sub.addr.sin_addr, ip, sizeof(ip));
+    printf("[SUB] %s:%d %s, %u reports sent, %" PRIu64 " dropped\n", ip, ntohs(sub.addr.sin_port),
+           what, sub.seq, subscriber_drops(sub));
+}
+
+// Subscribes the sender to ep_addr, or unsubscribes it (ep_addr 0: from
+// every endpoint). Subscribing again renews the subscription.
+void UdpServer::subscribe(int ep_addr, bool add) {
+    if (!sender) {
+        printf("Error: Only UDP clients can subscribe\n");
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(subscribers_mutex);
+    size_t i;
+    for (i = 0; i < subscribers.size(); i++) {
+        if (subscribers[i].addr.sin_addr.s_addr == sender->sin_addr.s_addr &&
+            subscribers[i].addr.sin_port == sender->sin_port)
+            break;
+    }
+
+    int bit = report_tap_bit(ep_addr);
+    if (add) {
+        if (i == subscribers.size()) {
+            struct udp_subscriber sub = {};
+            sub.addr = *sender;
+            subscribers.push_back(sub);
+        }
+        struct udp_subscriber* sub = &subscribers[i];
+        if (!(sub->eps & (1u << bit)))
+            sub->tap_base[bit] = report_tap.overflows[bit].load(std::memory_order_relaxed);
+        sub->eps |= 1u << bit;
+        sub->expires = timer_wheel_now() + UDP_SUBSCRIBE_TIMEOUT * 1000000000ULL;
+        if (debug_level >= 1) {
+            printf("[SUB] Subscribed to EP 0x%02x\n", ep_addr);
+        }
+    } else if (i < subscribers.size()) {
+        if (ep_addr == 0)
+            subscribers[i].eps = 0;
+        else
+            subscribers[i].eps &= ~(1u << bit);
+        if (!subscribers[i].eps) {
+            print_subscriber(subscribers[i], "unsubscribed");
+            subscribers.erase(subscribers.begin() + i);
+        }
+    }
+    update_tap_mask();
+}
+
+// Called with subscribers_mutex held.
+void UdpServer::update_tap_mask() {
+    uint32_t mask = 0;
+    for (size_t i = 0; i < subscribers.size(); i++)
+        mask |= subscribers[i].eps;
+    report_tap_mask.store(mask, std::memory_order_relaxed);
+}
+
+// Sends the reports the endpoint readers tapped to their subscribers, so
+// that a slow or unreachable client never holds up a reader.
+void UdpServer::fanout_loop() {
+    struct report_tap_record record;
+
+    while (running) {
+        report_tap_wait(1000);
+
+        std::lock_guard<std::mutex> lock(subscribers_mutex);
+        while (report_tap_pop(&record))
+            fanout_report(record);
+
+        uint64_t now = timer_wheel_now();
+        bool expired = false;
+        for (size_t i = 0; i < subscribers.size(); ) {
+            if (subscribers[i].expires > now) {
+                i++;
+                continue;
             }
-            
-            process_packet(packet);
+            print_subscriber(subscribers[i], "expired");
+            subscribers.erase(subscribers.begin() + i);
+            expired = true;
         }
+        if (expired)
+            update_tap_mask();
+    }
+}
+
+void UdpServer::fanout_report(const struct report_tap_record& record) {
+    char buffer[sizeof(struct udp_msg_report) + REPORT_TAP_DATA];
+    struct udp_msg_report* msg = (struct udp_msg_report *)buffer;
+    size_t length = std::min<size_t>(record.length, REPORT_TAP_DATA);
+    uint32_t bit = 1u << report_tap_bit(record.ep);
+
+    msg->header.magic = UDP_MSG_MAGIC;
+    msg->header.version = UDP_MSG_VERSION;
+    msg->header.op = UDP_MSG_REPORT;
+    msg->header.reserved = 0;
+    msg->ep = record.ep;
+    msg->reserved = 0;
+    msg->length = htole16(length);
+    msg->timestamp = htole64(record.stamp);
+    memcpy(buffer + sizeof(*msg), record.data, length);
+
+    for (size_t i = 0; i < subscribers.size(); i++) {
+        struct udp_subscriber* sub = &subscribers[i];
+        if (!(sub->eps & bit))
+            continue;
+        msg->seq = htole32(sub->seq++);
+        msg->dropped = htole32(subscriber_drops(*sub));
+        if (sendto(sockfd, buffer, sizeof(*msg) + length, MSG_DONTWAIT,
+                   (const struct sockaddr *)&sub->addr, sizeof(sub->addr)) < 0)
+            sub->send_drops++;
+    }
+}
+
+void UdpServer::handle_datagram(char* buffer, int n, const struct sockaddr_in* from, uint64_t received) {
+    sender = from;
+    received_ns = received;
+    if (n > 0 && (uint8_t)buffer[0] == UDP_MSG_MAGIC) {
+        process_binary((const uint8_t *)buffer, n);
+    } else if (n > 0) {
+        buffer[n] = '\0';
+        std::string packet(buffer);
+        // Remove newline if present
+        packet.erase(std::remove(packet.begin(), packet.end(), '\n'), packet.end());
+        packet.erase(std::remove(packet.begin(), packet.end(), '\r'), packet.end());
+
+        if (debug_level >= 1) {
+            printf("[UDP] Received: %s\n", packet.c_str());
+        }
+
+        process_packet(packet);
+    }
+    sender = NULL;
+}
+
+void UdpServer::commit_injection(struct ep_queue* queue, uint32_t ticket) {
+    if (current_ack) {
+        inject_ack_queued(current_ack);
+        ep_queue_inject_tag(queue, ticket, current_ack);
+    }
+
+    if (!batching) {
+        ep_queue_inject_commit(queue, ticket, true);
+        return;
+    }
+
+    ep_queue_inject_commit(queue, ticket, false);
+    signal_injection(queue);
+}
+
+// Starts acknowledging the injections that follow, if there is anybody to
+// reply to.
+void UdpServer::begin_ack(uint32_t seq, bool binary) {
+    end_ack();
+    if (sender)
+        current_ack = inject_ack_begin(seq, binary, sender, received_ns);
+}
+
+void UdpServer::end_ack() {
+    if (current_ack) {
+        inject_ack_release(current_ack);
+        current_ack = 0;
     }
 }
 
+// Wakes the writer of queue, once the batch is done when batching.
+void UdpServer::signal_injection(struct ep_queue* queue) {
+    if (!batching) {
+        ep_queue_signal(queue);
+        return;
+    }
+
+    if (std::find(pending_signals.begin(), pending_signals.end(), queue) == pending_signals.end())
+        pending_signals.push_back(queue);
+}
+
+void UdpServer::flush_signals() {
+    for (size_t i = 0; i < pending_signals.size(); i++)
+        ep_queue_signal(pending_signals[i]);
+    pending_signals.clear();
+}
+
 void UdpServer::process_packet(const std::string& packet) {
     if (packet.empty()) return;
 
-    if (packet[0] == '+') {
+    if (packet[0] == '#') {
+        // "#SEQ COMMAND" acknowledges COMMAND once it reached the host
+        char* end;
+        unsigned long seq = strtoul(packet.c_str() + 1, &end, 10);
+        size_t rest = packet.find_first_not_of(' ', end - packet.c_str());
+        if (end == packet.c_str() + 1 || *end != ' ' || rest == std::string::npos) {
+            printf("Error: Acknowledged commands are #SEQ COMMAND\n");
+            return;
+        }
+        begin_ack(seq, false);
+        process_packet(packet.substr(rest));
+        end_ack();
+    } else if (packet[0] == '@') {
+        handle_schedule(packet);
+    } else if (packet[0] == '+') {
         handle_command(packet);
     } else {
         handle_raw_injection(packet);
     }
 }
 
+void UdpServer::process_binary(const uint8_t* buffer, size_t length) {
+    decode_binary(buffer, length);
+    end_ack();
+}
+
+// Decodes binary messages in place and writes each report straight into a
+// cell of the endpoint's injection lane.
+void UdpServer::decode_binary(const uint8_t* buffer, size_t length) {
+    const uint8_t* p = buffer;
+    const uint8_t* end = buffer + length;
+
+    while (p < end) {
+        size_t left = end - p;
+        const struct udp_msg_header* header = (const struct udp_msg_header *)p;
+        if (left < sizeof(*header) || header->magic != UDP_MSG_MAGIC ||
+            header->version != UDP_MSG_VERSION) {
+            printf("Error: Malformed binary message at offset %zu\n", (size_t)(p - buffer));
+            return;
+        }
+
+        size_t size;
+        switch (header->op) {
+        case UDP_MSG_MOVE: {
+            const struct udp_msg_move* move = (const struct udp_msg_move *)p;
+            size = sizeof(*move);
+            if (left < size)
+                break;
+            int mouse_ep = find_mouse_endpoint();
+            if (mouse_ep != -1)
+                inject_mouse_move(mouse_ep, (int16_t)le16toh(move->x),
+                                  (int16_t)le16toh(move->y), move->wheel);
+            break;
+        }
+        case UDP_MSG_BUTTON: {
+            const struct udp_msg_button* button = (const struct udp_msg_button *)p;
+            size = sizeof(*button);
+            if (left < size)
+                break;
+            if (button->action == UDP_MSG_BUTTON_DOWN)
+                current_button_state |= button->buttons;
+            else if (button->action == UDP_MSG_BUTTON_UP)
+                current_button_state &= ~button->buttons;
+            else
+                current_button_state = button->buttons;
+            int mouse_ep = find_mouse_endpoint();
+            if (mouse_ep != -1)
+                inject_mouse_buttons(mouse_ep, current_button_state);
+            break;
+        }
+        case UDP_MSG_SCHEDULE: {
+            const struct udp_msg_schedule* sched = (const struct udp_msg_schedule *)p;
+            size = sizeof(*sched);
+            if (left < size)
+                break;
+            // The rest of the datagram is handled later.
+            uint64_t time = le64toh(sched->time);
+            uint64_t deadline = sched->flags & UDP_MSG_SCHEDULE_ABSOLUTE ?
+                                time : timer_wheel_now() + time * 1000;
+            if (left > size)
+                schedule(deadline, true, p + size, left - size);
+            return;
+        }
+        case UDP_MSG_SEQ: {
+            const struct udp_msg_seq* seq = (const struct udp_msg_seq *)p;
+            size = sizeof(*seq);
+            if (left < size)
+                break;
+            begin_ack(le32toh(seq->seq), true);
+            break;
+        }
+        case UDP_MSG_SUBSCRIBE: {
+            const struct udp_msg_subscribe* sub = (const struct udp_msg_subscribe *)p;
+            size = sizeof(*sub);
+            if (left < size)
+                break;
+            bool add = sub->action == UDP_MSG_SUBSCRIBE_EP;
+            int ep = sub->ep;
+            if (add && ep == 0)
+                ep = find_mouse_endpoint();
+            if (ep != -1)
+                subscribe(ep, add);
+            break;
+        }
+        case UDP_MSG_KEY: {
+            const struct udp_msg_key* key = (const struct udp_msg_key *)p;
+            size = sizeof(*key);
+            if (left < size)
+                break;
+            bool media = key->page == UDP_MSG_PAGE_CONSUMER;
+            int usage = le16toh(key->usage);
+            if ((!media && key->page != UDP_MSG_PAGE_KEYBOARD) || key->action > UDP_MSG_KEY_TAP ||
+                (!usage && key->action != UDP_MSG_KEY_UP)) {
+                printf("Error: Bad key message (page 0x%02x, action %u)\n", key->page, key->action);
+                break;
+            }
+            int ep = find_keyboard_endpoint(media);
+            if (ep == -1) {
+                printf("Error: Could not find %s endpoint for injection\n", media ? "media key" : "keyboard");
+                break;
+            }
+            if (media)
+                press_consumer(ep, usage, key->action);
+            else if (usage)
+                press_keys(ep, std::vector<int>(1, usage), key->action);
+            else
+                press_keys(ep, std::vector<int>(), key->action);
+            break;
+        }
+        case UDP_MSG_TYPE: {
+            const struct udp_msg_type* type = (const struct udp_msg_type *)p;
+            size = sizeof(*type);
+            if (left < size)
+                break;
+            size += le16toh(type->length);
+            if (left < size)
+                break;
+            if (find_keyboard_endpoint(false) == -1)
+                printf("Error: Could not find keyboard endpoint for injection\n");
+            else
+                type_text((const char *)p + sizeof(*type), le16toh(type->length));
+            break;
+        }
+        case UDP_MSG_RAW: {
+            const struct udp_msg_raw* raw = (const struct udp_msg_raw *)p;
+            size = sizeof(*raw);
+            if (left < size)
+                break;
+            size += le16toh(raw->length);
+            if (left < size)
+                break;
+            inject_raw(raw->ep, p + sizeof(*raw), le16toh(raw->length));
+            break;
+        }
+        default:
+            printf("Error: Unknown binary op: %u\n", header->op);
+            return;
+        }
+
+        if (left < size) {
+            printf("Error: Truncated binary message (op %u)\n", header->op);
+            return;
+        }
+        p += size;
+    }
+}
+
 void UdpServer::handle_command(const std::string& command) {
     std::stringstream ss(command);
     std::string cmd;
     ss >> cmd;
 
+    if (cmd == "+reload") {
+        if (injection_enabled)
+            injection_request_reload();
+        else
+            printf("Error: +reload needs --enable_injection\n");
+        return;
+    }
+
+    if (cmd == "+subscribe" || cmd == "+unsubscribe") {
+        // Hex endpoint addresses; by default the mouse endpoint, or every
+        // endpoint when unsubscribing
+        bool add = cmd == "+subscribe";
+        std::string ep_str;
+        bool any = false;
+        while (ss >> ep_str) {
+            subscribe(strtol(ep_str.c_str(), NULL, 16), add);
+            any = true;
+        }
+        if (!any && !add)
+            subscribe(0, false);
+        else if (!any && find_mouse_endpoint() != -1)
+            subscribe(find_mouse_endpoint(), true);
+        else if (!any)
+            printf("Error: Could not find mouse endpoint to subscribe to\n");
+        return;
+    }
+
+    if (handle_key_command(command))
+        return;
+
     int mouse_ep = find_mouse_endpoint();
     if (mouse_ep == -1) {
         printf("Error: Could not find mouse endpoint for injection\n");
@@ -138,72 +852,26 @@ void UdpServer::handle_command(const std::string& command) {
     if (cmd == "+move") {
         int x, y;
         if (ss >> x >> y) {
-            // Get the current REAL button state from physical mouse
-            uint8_t real_button_state = g_real_mouse_button_state.load();
-            
-            // Mouse report format (9 bytes, 0-indexed) - Logitech:
-            // Byte 0: 02 (magic number, constant)
-            // Byte 1: Button state (00 = no button, 01 = left click, etc.)
-            // Byte 2: 00 (padding)
-            // Byte 3: X low byte (16-bit signed little-endian)
-            // Byte 4: X high byte
-            // Byte 5: Y low byte (16-bit signed little-endian)
-            // Byte 6: Y high byte
-            // Byte 7: Scroll wheel (ff = down, 01 = up, 00 = no scroll)
-            // Byte 8: 00 (padding)
-            std::vector<uint8_t> data(9, 0);
-            data[0] = 0x02;  // Magic number
-            data[1] = real_button_state;  // Use REAL physical mouse button state
-            data[2] = 0x00;  // Padding
-            
-            // X coordinate: 16-bit signed little-endian (bytes 3-4)
-            data[3] = x & 0xFF;        // X low byte
-            data[4] = (x >> 8) & 0xFF; // X high byte
-            
-            // Y coordinate: 16-bit signed little-endian (bytes 5-6)
-            data[5] = y & 0xFF;        // Y low byte
-            data[6] = (y >> 8) & 0xFF; // Y high byte
-            
-            // Scroll wheel and padding (bytes 7-8)
-            data[7] = 0x00;  // No scroll
-            data[8] = 0x00;  // Padding
-            
             if (debug_level >= 2) {
-                printf("[CMD] Mouse move: X=%d, Y=%d (real button state: 0x%02x)\n", x, y, real_button_state);
+                printf("[CMD] Mouse move: X=%d, Y=%d (real button state: 0x%02x)\n",
+                       x, y, g_real_mouse_button_state.load());
             }
-            
-            inject_packet(mouse_ep, data);
+
+            inject_mouse_move(mouse_ep, x, y, 0);
         } else {
             printf("Error: +move requires X and Y coordinates\n");
         }
     } else if (cmd == "+click") {
-        // Click: Left button down then up
-        std::vector<uint8_t> down(9, 0);
-        down[0] = 0x02;  // Magic number
-        down[1] = 0x01;  // Left button pressed (bit 0)
-        down[2] = 0x00;  // Padding
-        // Bytes 3-6: X and Y = 0 (no movement)
-        down[7] = 0x00;  // No scroll
-        down[8] = 0x00;  // Padding
-        
+        // Click: Left button down now, up 10ms later from the timer wheel
         if (debug_level >= 2) {
             printf("[CMD] Mouse left click\n");
         }
-        
-        inject_packet(mouse_ep, down);
 
-        // Small delay between down and up
-        usleep(10000); // 10ms
-        
-        // Release: All buttons up
-        std::vector<uint8_t> up(9, 0);
-        up[0] = 0x02;  // Magic number
-        up[1] = 0x00;  // No buttons (back to normal state)
-        up[2] = 0x00;  // Padding
-        // Bytes 3-6: X and Y = 0
-        up[7] = 0x00;  // No scroll
-        up[8] = 0x00;  // Padding
-        inject_packet(mouse_ep, up);
+        current_button_state |= 0x01;
+        inject_mouse_buttons(mouse_ep, current_button_state);
+
+        static const char release[] = "+mouseup 1";
+        schedule(timer_wheel_now() + UDP_CLICK_DELAY, false, release, sizeof(release) - 1);
     } else if (cmd == "+mousedown") {
         // Press and hold mouse button
         int button = 1; // Default to left button
@@ -211,17 +879,11 @@ void UdpServer::handle_command(const std::string& command) {
         
         current_button_state |= (1 << (button - 1)); // Set button bit
         
-        std::vector<uint8_t> data(9, 0);
-        data[0] = 0x02;  // Magic number
-        data[1] = current_button_state;
-        data[2] = 0x00;  // Padding
-        // Bytes 3-8: no movement or scroll
-        
         if (debug_level >= 2) {
             printf("[CMD] Mouse button %d down (state: 0x%02x)\n", button, current_button_state);
         }
         
-        inject_packet(mouse_ep, data);
+        inject_mouse_buttons(mouse_ep, current_button_state);
     } else if (cmd == "+mouseup") {
         // Release mouse button
         int button = 1; // Default to left button
@@ -229,22 +891,93 @@ void UdpServer::handle_command(const std::string& command) {
         
         current_button_state &= ~(1 << (button - 1)); // Clear button bit
         
-        std::vector<uint8_t> data(9, 0);
-        data[0] = 0x02;  // Magic number
-        data[1] = current_button_state;
-        data[2] = 0x00;  // Padding
-        // Bytes 3-8: no movement or scroll
-        
         if (debug_level >= 2) {
             printf("[CMD] Mouse button %d up (state: 0x%02x)\n", button, current_button_state);
         }
         
-        inject_packet(mouse_ep, data);
+        inject_mouse_buttons(mouse_ep, current_button_state);
     } else {
         printf("Error: Unknown command: %s\n", cmd.c_str());
     }
 }
 
+// Keyboard commands. Returns false if command is not one.
+bool UdpServer::handle_key_command(const std::string& command) {
+    std::stringstream ss(command);
+    std::string cmd, name;
+    ss >> cmd;
+
+    bool media = cmd == "+media" || cmd == "+mediadown" || cmd == "+mediaup";
+    if (!media && cmd != "+key" && cmd != "+keydown" && cmd != "+keyup" && cmd != "+type")
+        return false;
+
+    int ep_addr = find_keyboard_endpoint(media);
+    if (ep_addr == -1) {
+        printf("Error: Could not find %s endpoint for injection\n", media ? "media key" : "keyboard");
+        return true;
+    }
+
+    if (cmd == "+type") {
+        // The rest of the line; \n, \t and \\ stand for Enter, Tab and \.
+        std::string text;
+        for (size_t i = cmd.size() + 1; i < command.size(); i++) {
+            char c = command[i];
+            if (c == '\\' && i + 1 < command.size()) {
+                c = command[++i];
+                if (c == 'n')
+                    c = '\n';
+                else if (c == 't')
+                    c = '\t';
+            }
+            text += c;
+        }
+        if (debug_level >= 2) {
+            printf("[CMD] Typing %zu characters on EP 0x%02x\n", text.size(), ep_addr);
+        }
+        type_text(text.data(), text.size());
+        return true;
+    }
+
+    int action = UDP_MSG_KEY_TAP;
+    if (cmd == "+keydown" || cmd == "+mediadown")
+        action = UDP_MSG_KEY_DOWN;
+    else if (cmd == "+keyup" || cmd == "+mediaup")
+        action = UDP_MSG_KEY_UP;
+
+    if (media) {
+        // Releasing no media key releases them all
+        int usage = 0;
+        if (ss >> name)
+            usage = key_consumer_usage(name);
+        if (usage < 0 || (!usage && action != UDP_MSG_KEY_UP)) {
+            printf("Error: %s requires a media key name\n", cmd.c_str());
+            return true;
+        }
+        press_consumer(ep_addr, usage, action);
+        return true;
+    }
+
+    std::vector<int> usages;
+    while (ss >> name) {
+        int usage = key_usage(name);
+        if (usage < 0) {
+            printf("Error: Unknown key: %s\n", name.c_str());
+            return true;
+        }
+        usages.push_back(usage);
+    }
+    if (usages.empty() && action != UDP_MSG_KEY_UP) {
+        printf("Error: %s requires at least one key\n", cmd.c_str());
+        return true;
+    }
+
+    if (debug_level >= 2) {
+        printf("[CMD] %s of %zu keys on EP 0x%02x\n", cmd.c_str(), usages.size(), ep_addr);
+    }
+    press_keys(ep_addr, usages, action);
+    return true;
+}
+
 void UdpServer::handle_raw_injection(const std::string& data_str) {
     std::stringstream ss(data_str);
     std::string ep_str, payload_str;
@@ -293,92 +1026,461 @@ void UdpServer::handle_raw_injection(const std::string& data_str) {
     inject_packet(ep_addr, data);
 }
 
+void UdpServer::routes_lock(int* rcu) {
+    *rcu = rcu_read_lock(&ep_routes_rcu);
+    routes = ep_routes.load();
+}
+
+void UdpServer::routes_unlock(int rcu) {
+    routes = NULL;
+    rcu_read_unlock(&ep_routes_rcu, rcu);
+}
+
+const struct ep_route* UdpServer::find_endpoint(int ep_addr) {
+    const struct ep_route *route = ep_route_lookup(routes, ep_addr);
+    if (!route)
+        printf("Endpoint 0x%02x not found for injection\n", ep_addr);
+    return route;
+}
+
 void UdpServer::inject_packet(int ep_addr, const std::vector<uint8_t>& data) {
-    // Find the endpoint queue
-    struct raw_gadget_config *config = &host_device_desc.configs[host_device_desc.current_config];
-    
-    for (int i = 0; i < config->config.bNumInterfaces; i++) {
-        struct raw_gadget_interface *iface = &config->interfaces[i];
-        struct raw_gadget_altsetting *alt = &iface->altsettings[iface->current_altsetting];
-        
-        for (int j = 0; j < alt->interface.bNumEndpoints; j++) {
-            struct raw_gadget_endpoint *ep = &alt->endpoints[j];
-            if (ep->endpoint.bEndpointAddress == ep_addr) {
-                // Found it
-                struct usb_raw_transfer_io io;
-                io.inner.ep = ep->thread_info.ep_num;
-                io.inner.flags = 0;
-                io.inner.length = data.size();
-                if (data.size() > sizeof(io.data)) {
-                    printf("Packet too large for injection: %lu\n", data.size());
-                    return;
-                }
-                memcpy(io.data, data.data(), data.size());
-
-                ep->thread_info.data_mutex->lock();
-                ep->thread_info.data_queue->push_back(io);
-                ep->thread_info.data_mutex->unlock();
-                
-                // Wake the endpoint thread immediately for low latency
-                ep->thread_info.data_cond->notify_one();
-                
-                if (debug_level >= 1) {
-                    printf("[INJ] EP 0x%02x: Injected %lu bytes\n", ep_addr, data.size());
-                }
-                
-                if (debug_level >= 3) {
-                    printHexDump("[INJ] Data: ", data.data(), data.size());
-                }
-                
-                return;
-            }
+    inject_raw(ep_addr, data.data(), data.size());
+}
+
+void UdpServer::inject_raw(int ep_addr, const uint8_t* data, size_t length) {
+    const struct ep_route *route = find_endpoint(ep_addr);
+    if (!route)
+        return;
+
+    if (length > sizeof(((struct usb_raw_transfer_io *)0)->data)) {
+        printf("Packet too large for injection: %zu\n", length);
+        if (current_ack)
+            inject_ack_dropped(current_ack);
+        return;
+    }
+
+    // Enqueueing also wakes the endpoint writer if it is idle
+    uint32_t ticket;
+    struct usb_raw_transfer_io *io = ep_queue_inject_claim(route->queue, &ticket);
+    if (!io) {
+        printf("[INJ] EP 0x%02x: injection queue full, dropped %zu bytes\n",
+               ep_addr, length);
+        if (current_ack)
+            inject_ack_dropped(current_ack);
+        return;
+    }
+    io->inner.ep = route->ep_num;
+    io->inner.flags = 0;
+    io->inner.length = length;
+    memcpy(io->data, data, length);
+    commit_injection(route->queue, ticket);
+
+    if (debug_level >= 1) {
+        printf("[INJ] EP 0x%02x: Injected %zu bytes\n", ep_addr, length);
+    }
+
+    if (debug_level >= 3) {
+        printHexDump("[INJ] Data: ", data, length);
+    }
+}
+
+// Builds a mouse report right in the injection lane, laid out as the
+// interface's report descriptor says (see hid-report.h). Values are
+// clamped to their logical range.
+void UdpServer::inject_mouse_report(int ep_addr, uint8_t buttons, int x, int y, int wheel) {
+    const struct ep_route *route = find_endpoint(ep_addr);
+    if (!route)
+        return;
+
+    // Still under ep_routes_rcu, which covers the codec too
+    const struct hid_codec *codec = hid_codec_get(route->interface);
+    const struct hid_mouse_codec *mouse = &codec->mouse;
+    if (!mouse->present) {
+        printf("[INJ] EP 0x%02x: interface %d has no mouse report\n", ep_addr, route->interface);
+        if (current_ack)
+            inject_ack_dropped(current_ack);
+        return;
+    }
+
+    uint32_t ticket;
+    struct usb_raw_transfer_io *io = ep_queue_inject_claim(route->queue, &ticket);
+    if (!io) {
+        printf("[INJ] EP 0x%02x: injection queue full, dropped %d bytes\n", ep_addr,
+               mouse->length);
+        if (current_ack)
+            inject_ack_dropped(current_ack);
+        return;
+    }
+    io->inner.ep = route->ep_num;
+    io->inner.flags = 0;
+    io->inner.length = mouse->length;
+    uint8_t *report = (uint8_t *)io->data;
+    memset(report, 0, mouse->length);
+    if (codec->has_ids)
+        report[0] = mouse->id;
+    hid_put(report, &mouse->buttons, buttons);
+    hid_put(report, &mouse->x, x);
+    hid_put(report, &mouse->y, y);
+    hid_put(report, &mouse->wheel, wheel);
+    commit_injection(route->queue, ticket);
+
+    if (debug_level >= 2) {
+        printf("[BIN] EP 0x%02x: buttons 0x%02x, X=%d, Y=%d, wheel %d\n",
+               ep_addr, buttons, x, y, wheel);
+    }
+}
+
+// With --fuse_motion, motion is added to the next report the mouse sends
+// instead of going out as a report of its own, which would reset the
+// buttons and motion the device reports in the same poll interval.
+//
+// With --move_step, large moves are split into reports of at most that
+// many counts each. The writer releases one per poll, so the move is spread
+// over frames at the rate the host actually polls.
+void UdpServer::inject_mouse_move(int ep_addr, int x, int y, int wheel) {
+    const struct ep_route *route = find_endpoint(ep_addr);
+    if (route && route->fusion) {
+        fusion_add_motion(route->fusion, x, y, wheel);
+        if (current_ack) {
+            inject_ack_queued(current_ack);
+            if (!fusion_add_ack(route->fusion, current_ack))
+                inject_ack_release(current_ack);
+        }
+        signal_injection(route->queue);
+        return;
+    }
+
+    int steps = 1;
+    if (poll_move_step > 0) {
+        int largest = std::max(abs(x), abs(y));
+        steps = (largest + poll_move_step - 1) / poll_move_step;
+    }
+
+    // Moves the report cannot carry in one go, say 12-bit X/Y, are split
+    // too.
+    int needed = 1;
+    if (route) {
+        const struct hid_mouse_codec *mouse = &hid_codec_get(route->interface)->mouse;
+        if (mouse->present && mouse->x.max > 0 && mouse->y.max > 0) {
+            needed = std::max(needed, (abs(x) + mouse->x.max - 1) / mouse->x.max);
+            needed = std::max(needed, (abs(y) + mouse->y.max - 1) / mouse->y.max);
         }
     }
-    printf("Endpoint 0x%02x not found for injection\n", ep_addr);
+    // Leave room in the injection lane; very large moves take bigger
+    // steps instead, as long as the report can carry them. A move that
+    // would still be clamped is refused rather than cut short.
+    if (needed > EP_QUEUE_CAPACITY / 2) {
+        printf("[INJ] EP 0x%02x: move %d,%d needs %d reports, more than the %d "
+               "the injection lane takes\n", ep_addr, x, y, needed, EP_QUEUE_CAPACITY / 2);
+        if (current_ack)
+            inject_ack_dropped(current_ack);
+        return;
+    }
+    steps = std::min(std::max(steps, needed), EP_QUEUE_CAPACITY / 2);
+
+    uint8_t buttons = g_real_mouse_button_state.load();
+    for (int i = 0; i < steps; i++) {
+        int part_x = x * (i + 1) / steps - x * i / steps;
+        int part_y = y * (i + 1) / steps - y * i / steps;
+        inject_mouse_report(ep_addr, buttons, part_x, part_y, i == 0 ? wheel : 0);
+    }
 }
 
-int UdpServer::find_mouse_endpoint() {
-    // Look for HID Mouse: bInterfaceClass=3 (HID), bInterfaceProtocol=2 (Mouse)
-    
-    struct raw_gadget_config *config = &host_device_desc.configs[host_device_desc.current_config];
-    
-    for (int i = 0; i < config->config.bNumInterfaces; i++) {
-        struct raw_gadget_interface *iface = &config->interfaces[i];
-        struct raw_gadget_altsetting *alt = &iface->altsettings[iface->current_altsetting];
-        
-        // Check if this is a HID Mouse interface (Class 3, Protocol 2)
-        if (alt->interface.bInterfaceClass == 3 && alt->interface.bInterfaceProtocol == 2) {
-            // Found HID Mouse interface, return its interrupt IN endpoint
-            for (int j = 0; j < alt->interface.bNumEndpoints; j++) {
-                struct raw_gadget_endpoint *ep = &alt->endpoints[j];
-                if ((ep->endpoint.bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_INT &&
-                    (ep->endpoint.bEndpointAddress & USB_DIR_IN)) {
-                    if (debug_level >= 2) {
-                        printf("[INIT] Found mouse endpoint: 0x%02x (max packet: %d bytes)\n", 
-                               ep->endpoint.bEndpointAddress, ep->endpoint.wMaxPacketSize);
-                    }
-                    return ep->endpoint.bEndpointAddress;
-                }
-            }
+void UdpServer::inject_mouse_buttons(int ep_addr, uint8_t buttons) {
+    const struct ep_route *route = find_endpoint(ep_addr);
+    if (route && route->fusion) {
+        fusion_set_buttons(route->fusion, buttons);
+        if (current_ack) {
+            inject_ack_queued(current_ack);
+            if (!fusion_add_ack(route->fusion, current_ack))
+                inject_ack_release(current_ack);
         }
+        signal_injection(route->queue);
+        return;
     }
-    
-    if (debug_level >= 1) {
-        printf("[WARN] No HID Mouse interface found, falling back to first Interrupt IN\n");
+
+    inject_mouse_report(ep_addr, buttons, 0, 0, 0);
+}
+
+// Builds a keyboard report of the keys injection holds plus extra (may be
+// NULL) right in the injection lane. The writer adds the keys held on the
+// device before it goes out.
+void UdpServer::inject_keyboard_report(int ep_addr, const uint64_t* extra) {
+    const struct ep_route *route = find_endpoint(ep_addr);
+    if (!route)
+        return;
+
+    const struct hid_codec *codec = hid_codec_get(route->interface);
+    if (!codec->keyboard.present || !route->keys) {
+        printf("[INJ] EP 0x%02x: interface %d has no keyboard report\n", ep_addr, route->interface);
+        if (current_ack)
+            inject_ack_dropped(current_ack);
+        return;
     }
-    
-    // Fallback: Find first Interrupt IN endpoint
-    for (int i = 0; i < config->config.bNumInterfaces; i++) {
-        struct raw_gadget_interface *iface = &config->interfaces[i];
-        struct raw_gadget_altsetting *alt = &iface->altsettings[iface->current_altsetting];
-        
-        for (int j = 0; j < alt->interface.bNumEndpoints; j++) {
-            struct raw_gadget_endpoint *ep = &alt->endpoints[j];
-            if ((ep->endpoint.bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_INT &&
-                (ep->endpoint.bEndpointAddress & USB_DIR_IN)) {
-                return ep->endpoint.bEndpointAddress;
-            }
+
+    uint64_t keys[4];
+    key_state_held(route->keys, keys);
+    for (int i = 0; extra && i < 4; i++)
+        keys[i] |= extra[i];
+
+    uint32_t ticket;
+    struct usb_raw_transfer_io *io = ep_queue_inject_claim(route->queue, &ticket);
+    if (!io) {
+        printf("[INJ] EP 0x%02x: injection queue full, dropped %d bytes\n", ep_addr,
+               codec->keyboard.length);
+        if (current_ack)
+            inject_ack_dropped(current_ack);
+        return;
+    }
+    io->inner.ep = route->ep_num;
+    io->inner.flags = 0;
+    uint8_t *report = (uint8_t *)io->data;
+    memset(report, 0, codec->keyboard.length);
+    if (codec->has_ids)
+        report[0] = codec->keyboard.id;
+    io->inner.length = hid_keyboard_encode(codec, keys, report);
+    commit_injection(route->queue, ticket);
+
+    if (debug_level >= 3) {
+        printHexDump("[INJ] Keyboard: ", report, io->inner.length);
+    }
+}
+
+// The same for the media keys injection holds.
+void UdpServer::inject_consumer_report(int ep_addr) {
+    const struct ep_route *route = find_endpoint(ep_addr);
+    if (!route)
+        return;
+
+    const struct hid_codec *codec = hid_codec_get(route->interface);
+    if (!codec->consumer.present || !route->keys) {
+        printf("[INJ] EP 0x%02x: interface %d has no media key report\n", ep_addr, route->interface);
+        if (current_ack)
+            inject_ack_dropped(current_ack);
+        return;
+    }
+
+    uint16_t usages[KEY_CONSUMER_MAX];
+    int count = key_state_held_consumer(route->keys, usages);
+
+    uint32_t ticket;
+    struct usb_raw_transfer_io *io = ep_queue_inject_claim(route->queue, &ticket);
+    if (!io) {
+        printf("[INJ] EP 0x%02x: injection queue full, dropped %d bytes\n", ep_addr,
+               codec->consumer.length);
+        if (current_ack)
+            inject_ack_dropped(current_ack);
+        return;
+    }
+    io->inner.ep = route->ep_num;
+    io->inner.flags = 0;
+    uint8_t *report = (uint8_t *)io->data;
+    memset(report, 0, codec->consumer.length);
+    if (codec->has_ids)
+        report[0] = codec->consumer.id;
+    io->inner.length = hid_consumer_encode(codec, usages, count, report);
+    commit_injection(route->queue, ticket);
+
+    if (debug_level >= 3) {
+        printHexDump("[INJ] Media keys: ", report, io->inner.length);
+    }
+}
+
+// Presses or releases keyboard usages, one report for all of them.
+// Releasing no usages releases every key. A tap presses them together and
+// releases the other keys a report before the modifiers, so that the host
+// never sees, say, C without the Ctrl of Ctrl+C.
+void UdpServer::press_keys(int ep_addr, const std::vector<int>& usages, int action) {
+    const struct ep_route *route = find_endpoint(ep_addr);
+    if (!route || !route->keys)
+        return;
+
+    if (action == UDP_MSG_KEY_UP && usages.empty())
+        key_state_press(route->keys, 0, false);
+    for (size_t i = 0; i < usages.size(); i++)
+        key_state_press(route->keys, usages[i], action != UDP_MSG_KEY_UP);
+    inject_keyboard_report(ep_addr, NULL);
+    if (action != UDP_MSG_KEY_TAP)
+        return;
+
+    bool modifiers = false, others = false;
+    for (size_t i = 0; i < usages.size(); i++) {
+        if (usages[i] >= HID_USAGE_LEFT_CONTROL) {
+            modifiers = true;
+            continue;
         }
+        key_state_press(route->keys, usages[i], false);
+        others = true;
+    }
+    if (modifiers && others)
+        inject_keyboard_report(ep_addr, NULL);
+    for (size_t i = 0; i < usages.size(); i++)
+        key_state_press(route->keys, usages[i], false);
+    inject_keyboard_report(ep_addr, NULL);
+}
+
+void UdpServer::press_consumer(int ep_addr, int usage, int action) {
+    const struct ep_route *route = find_endpoint(ep_addr);
+    if (!route || !route->keys)
+        return;
+
+    if (action != UDP_MSG_KEY_UP && !key_state_press_consumer(route->keys, usage, true)) {
+        printf("Error: %d media keys are held already\n", KEY_CONSUMER_MAX);
+        if (current_ack)
+            inject_ack_dropped(current_ack);
+        return;
+    }
+    if (action == UDP_MSG_KEY_UP && !usage) {
+        uint16_t held[KEY_CONSUMER_MAX];
+        int count = key_state_held_consumer(route->keys, held);
+        for (int i = 0; i < count; i++)
+            key_state_press_consumer(route->keys, held[i], false);
+    }
+    else if (action == UDP_MSG_KEY_UP)
+        key_state_press_consumer(route->keys, usage, false);
+    inject_consumer_report(ep_addr);
+
+    if (action == UDP_MSG_KEY_TAP) {
+        key_state_press_consumer(route->keys, usage, false);
+        inject_consumer_report(ep_addr);
+    }
+}
+
+// Queues the reports that type text on top of the keys held: one with the
+// key, one without. Shift is changed in a report of its own, and released
+// at the end. They are released by type_next(), paced at the poll rate of
+// the keyboard endpoint so that long text never overflows its injection
+// lane.
+void UdpServer::type_text(const char* text, size_t length) {
+    // The ring consumer can outlive the server thread, which frees timers
+    if (!timers)
+        return;
+
+    uint8_t modifiers = 0;
+    std::vector<struct udp_key_step> added;
+    for (size_t i = 0; i < length; i++) {
+        int usage;
+        bool shift;
+        if (!key_from_char(text[i], &usage, &shift)) {
+            printf("Error: Cannot type character 0x%02x, skipped\n", (uint8_t)text[i]);
+            continue;
+        }
+        uint8_t wanted = shift ? 0x02 : 0x00;
+        if (wanted != modifiers)
+            added.push_back({ 0, wanted, false, 0 });
+        // The same key twice in a row needs a report without it between
+        added.push_back({ (uint8_t)usage, wanted, false, 0 });
+        added.push_back({ 0, wanted, false, 0 });
+        modifiers = wanted;
+    }
+    if (modifiers)
+        added.push_back({ 0, 0, false, 0 });
+    if (added.empty())
+        return;
+
+    if (typing.size() + added.size() > UDP_MAX_TYPED) {
+        printf("Error: Too much text waiting to be typed, dropped %zu bytes\n", length);
+        if (current_ack)
+            inject_ack_dropped(current_ack);
+        return;
+    }
+
+    if (current_ack) {
+        inject_ack_queued(current_ack);
+        for (size_t i = 0; i < added.size(); i++)
+            added[i].ack = current_ack;
+    }
+    added.back().last = true;
+    typing.insert(typing.end(), added.begin(), added.end());
+
+    if (!typing_armed)
+        type_next();
+}
+
+// Injects the next typed report unless the writer still has
+// UDP_TYPE_BACKLOG of them to go, and comes back a poll later.
+void UdpServer::type_next() {
+    typing_armed = false;
+    if (typing.empty() || !timers)
+        return;
+
+    int ep_addr = find_keyboard_endpoint(false);
+    const struct ep_route *route = ep_addr == -1 ? NULL : ep_route_lookup(routes, ep_addr);
+    if (!route) {
+        printf("Error: Keyboard endpoint went away, dropped %zu typed reports\n", typing.size());
+        drop_typing();
+        return;
+    }
+
+    if (ep_queue_lane_size(route->queue, 1) < UDP_TYPE_BACKLOG) {
+        struct udp_key_step step = typing.front();
+        typing.pop_front();
+
+        uint64_t keys[4] = { 0, 0, 0, 0 };
+        if (step.usage)
+            keys[step.usage / 64] |= 1ULL << (step.usage % 64);
+        for (int i = 0; i < 8; i++) {
+            if (step.modifiers & (1 << i))
+                keys[(HID_USAGE_LEFT_CONTROL + i) / 64] |= 1ULL << ((HID_USAGE_LEFT_CONTROL + i) % 64);
+        }
+
+        uint32_t ack = current_ack;
+        current_ack = step.ack;
+        inject_keyboard_report(ep_addr, keys);
+        current_ack = ack;
+        if (step.last && step.ack)
+            inject_ack_release(step.ack);
+    }
+    if (typing.empty())
+        return;
+
+    uint64_t period = route->poll ? route->poll->period_ns.load(std::memory_order_relaxed) : 0;
+    if (!period)
+        period = 1000000;
+    typing_event.deadline = timer_wheel_now() + period;
+    timer_wheel_add(timers, &typing_event);
+    typing_armed = true;
+}
+
+void UdpServer::drop_typing() {
+    while (!typing.empty()) {
+        struct udp_key_step step = typing.front();
+        typing.pop_front();
+        if (step.last && step.ack) {
+            inject_ack_dropped(step.ack);
+            inject_ack_release(step.ack);
+        }
+    }
+}
+
+int UdpServer::find_mouse_endpoint() {
+    // HID Mouse (bInterfaceClass=3, bInterfaceProtocol=2) interrupt IN, or
+    // the first interrupt IN endpoint if there is no mouse interface
+    if (!routes)
+        return -1;
+
+    if (debug_level >= 2 && routes->mouse != -1) {
+        printf("[INIT] Found mouse endpoint: 0x%02x\n", routes->mouse);
+    }
+    return routes->mouse;
+}
+
+int UdpServer::find_keyboard_endpoint(bool consumer) {
+    // The HID boot keyboard (bInterfaceProtocol=1) if it has the report,
+    // else the first HID interrupt IN endpoint whose interface does
+    if (!routes)
+        return -1;
+
+    const struct ep_route *route = routes->keyboard != -1 ?
+                                   ep_route_lookup(routes, routes->keyboard) : NULL;
+    for (int i = -1; i < 32; i++) {
+        if (i >= 0)
+            route = &routes->routes[i];
+        if (!route || !route->queue || !route->keys)
+            continue;
+        const struct hid_codec *codec = hid_codec_get(route->interface);
+        if (consumer ? codec->consumer.present : codec->keyboard.present)
+            return route->address;
     }
     return -1;
 }
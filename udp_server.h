@@ -2,10 +2,80 @@
 #define UDP_SERVER_H
 
 #include <thread>
+#include <mutex>
+#include <deque>
 #include <atomic>
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <netinet/in.h>
+
+#include "timer-wheel.h"
+
+struct ep_queue;
+struct shm_ring;
+struct report_tap_record;
+struct ep_route;
+struct ep_route_table;
+
+// Largest datagram the server reads.
+#define UDP_DATAGRAM_SIZE	1024
+
+// Most datagrams drained per recvmmsg() call.
+#define UDP_BATCH_MAX		256
+
+// Datagrams received per wakeup; 1 reads them one at a time with recvfrom().
+extern int udp_batch;
+
+// POSIX shared memory object of the local injection ring, empty for none,
+// and whether its consumer spins instead of sleeping when it is empty.
+extern std::string shm_ring_name;
+extern bool shm_busy_poll;
+
+// Most timed commands waiting at once.
+#define UDP_MAX_TIMERS		4096
+
+// Time between the press and the release of +click, in ns.
+#define UDP_CLICK_DELAY		10000000
+
+// Subscriptions end this many seconds after they were last renewed.
+#define UDP_SUBSCRIBE_TIMEOUT	30
+
+// Most reports of typed text waiting at once, and how many of them are
+// queued ahead of the keyboard endpoint writer.
+#define UDP_MAX_TYPED		65536
+#define UDP_TYPE_BACKLOG	2
+
+// One report of typed text: key (0 for none) and the modifiers held with
+// it, bit i standing for usage 0xe0 + i. ack is that of the +type command
+// (0 for none), which holds a reference on it until its last report.
+struct udp_key_step {
+    uint8_t usage;
+    uint8_t modifiers;
+    bool last;
+    uint32_t ack;
+};
+
+// A client receiving copies of the reports of some endpoints.
+struct udp_subscriber {
+    struct sockaddr_in addr;
+    uint32_t eps;
+    uint64_t expires;
+    uint32_t seq;
+    uint64_t send_drops;
+    // report_tap overflows of each endpoint when it subscribed
+    uint64_t tap_base[32];
+};
+
+// A command or binary messages to be handled at event.deadline.
+struct udp_timer {
+    struct timer_event event;
+    bool has_sender;
+    struct sockaddr_in sender;
+    bool binary;
+    size_t length;
+    char data[UDP_DATAGRAM_SIZE];
+};
 
 // Global variable to track real mouse button state from physical mouse
 extern std::atomic<uint8_t> g_real_mouse_button_state;
@@ -31,14 +101,93 @@ private:
     // Track current mouse button state (for UDP commands only)
     uint8_t current_button_state;
 
+    // Endpoint routes, valid while a datagram or batch is being handled.
+    const struct ep_route_table* routes;
+
+    // Queues injected into during the current batch, signalled once it has
+    // been processed.
+    bool batching;
+    std::vector<struct ep_queue*> pending_signals;
+    std::vector<char> batch_buffers;
+
+    // Timed commands. Their timerfd is polled along with the socket, so
+    // the server thread never sleeps on them.
+    struct timer_wheel* timers;
+
+    // Local injection ring, drained by a thread of its own. Both threads
+    // hold handle_mutex while handling anything, so the state above is
+    // only ever touched by one of them at a time.
+    struct shm_ring* ring;
+    std::thread shm_thread;
+    std::mutex handle_mutex;
+
+    // Where the command being handled came from (NULL if not from the
+    // socket), when, and the acknowledgement it asked for (0 for none).
+    const struct sockaddr_in* sender;
+    uint64_t received_ns;
+    uint32_t current_ack;
+
+    // Typed text waiting for the keyboard endpoint. typing_event is on
+    // the timer wheel while there is any, and releases one report per
+    // poll.
+    std::deque<struct udp_key_step> typing;
+    struct timer_event typing_event;
+    bool typing_armed;
+
+    // Report subscriptions, served by the fan-out thread.
+    std::vector<struct udp_subscriber> subscribers;
+    std::mutex subscribers_mutex;
+    std::thread fanout_thread;
+
     void server_loop();
+    void batch_loop();
+    bool wait_datagram();
+    bool schedule(uint64_t deadline, bool binary, const void* data, size_t length);
+    void handle_schedule(const std::string& command);
+    void run_timers();
+    void free_timers();
+    bool shm_create();
+    void shm_destroy();
+    void shm_loop();
+    bool shm_drain();
+    void handle_datagram(char* buffer, int n, const struct sockaddr_in* from, uint64_t received);
+    void commit_injection(struct ep_queue* queue, uint32_t ticket);
+    void signal_injection(struct ep_queue* queue);
+    void flush_signals();
     void process_packet(const std::string& packet);
+    void process_binary(const uint8_t* buffer, size_t length);
+    void decode_binary(const uint8_t* buffer, size_t length);
+    void subscribe(int ep_addr, bool add);
+    void update_tap_mask();
+    void fanout_loop();
+    void fanout_report(const struct report_tap_record& record);
+    void begin_ack(uint32_t seq, bool binary);
+    void end_ack();
     void handle_command(const std::string& command);
     void handle_raw_injection(const std::string& data);
     void inject_packet(int ep_addr, const std::vector<uint8_t>& data);
+    void inject_mouse_report(int ep_addr, uint8_t buttons, int x, int y, int wheel);
+    void inject_mouse_move(int ep_addr, int x, int y, int wheel);
+    void inject_mouse_buttons(int ep_addr, uint8_t buttons);
+    void inject_raw(int ep_addr, const uint8_t* data, size_t length);
+    void inject_keyboard_report(int ep_addr, const uint64_t* extra);
+    void inject_consumer_report(int ep_addr);
+    void press_keys(int ep_addr, const std::vector<int>& usages, int action);
+    void press_consumer(int ep_addr, int usage, int action);
+    void type_text(const char* text, size_t length);
+    void type_next();
+    void drop_typing();
+    bool handle_key_command(const std::string& command);
+
+    void routes_lock(int* rcu);
+    void routes_unlock(int rcu);
+    const struct ep_route* find_endpoint(int ep_addr);
     
-    // Helper to find mouse endpoint
+    // Address of the mouse endpoint, -1 if there is none
     int find_mouse_endpoint();
+    // Address of the endpoint of the keyboard, or media key, report, -1
+    // if there is none
+    int find_keyboard_endpoint(bool consumer);
 };
 
 #endif // UDP_SERVER_H
@@ -3,6 +3,13 @@
 #include "proxy.h"
 #include "misc.h"
 #include "udp_server.h"
+#include "stats.h"
+#include "reactor.h"
+#include "injection.h"
+#include "ep-queue.h"
+#include "fusion.h"
+#include "poll-phase.h"
+#include "hid-report.h"
 
 int verbose_level = 0;
 bool please_stop_ep0 = false;
@@ -30,7 +37,20 @@ void usage() {
 	printf("\t--injection_file: specify the file that contains injection rules\n");
 	printf("\t--enable_customized_config: enable the customized config feature\n");
 	printf("\t--debug_level: set debug verbosity (0=off, 1=basic, 2=detailed, 3=full hex)\n");
-	printf("\t--descriptor_file: file to save USB descriptors (default: usb_descriptors.json)\n\n");
+	printf("\t--descriptor_file: file to save USB descriptors (default: usb_descriptors.json)\n");
+	printf("\t--stats_interval: print per-endpoint statistics every N seconds (default: 0, off)\n");
+	printf("\t--in_transfers: transfers kept in flight per bulk/int IN endpoint (default: 4)\n");
+	printf("\t--out_transfers: transfers kept in flight per bulk/int OUT endpoint (default: 4)\n");
+	printf("\t--iso_transfers: isochronous transfers kept in flight per endpoint (default: 4)\n");
+	printf("\t--iso_packets: packets carried by each isochronous transfer (default: 8)\n");
+	printf("\t--transfer_size: bytes per bulk IN transfer, SIZE or EP=SIZE, up to 65536 (default: wMaxPacketSize)\n");
+	printf("\t--inject_policy: interleave, priority or drop_oldest_real, how writers pick injected transfers (default: interleave)\n");
+	printf("\t--fuse_motion: add injected mouse motion and buttons to the reports of the real mouse\n");
+	printf("\t--move_step: largest X/Y delta of one injected mouse report, bigger moves are spread over polls (default: 0, off)\n");
+	printf("\t--shm_ring: POSIX shared memory name of a local injection ring, e.g. /usb-proxy (default: none)\n");
+	printf("\t--shm_busy_poll: spin on the shared memory ring instead of sleeping when it is empty\n");
+	printf("\t--udp_batch: UDP datagrams received per wakeup with recvmmsg (default: 1, off)\n");
+	printf("\t--reactor: drive the libusb side of all bulk/int endpoints from one epoll thread\n\n");
 	printf("* If `device` not specified, `usb-proxy` will use `dummy_udc.0` as default device.\n");
 	printf("* If `driver` not specified, `usb-proxy` will use `dummy_udc` as default driver.\n");
 	printf("* If both `vendor_id` and `product_id` not specified, `usb-proxy` will connect\n");
@@ -57,6 +77,9 @@ void handle_signal(int signum) {
 		please_stop_ep0 = true;
 		please_stop_eps = true;
 		break;
+	case SIGHUP:
+		injection_request_reload();
+		break;
 	}
 }
 
@@ -173,6 +196,7 @@ int main(int argc, char **argv)
 	action.sa_handler = handle_signal;
 	sigaction(SIGTERM, &action, NULL);
 	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGHUP, &action, NULL);
 
 	int opt, lopt, loidx;
 	const char *optstring = "hv";
@@ -188,6 +212,19 @@ int main(int argc, char **argv)
 		{"enable_customized_config", no_argument, &lopt, 9},
 		{"debug_level", required_argument, &lopt, 10},
 		{"descriptor_file", required_argument, &lopt, 11},
+		{"stats_interval", required_argument, &lopt, 12},
+		{"in_transfers", required_argument, &lopt, 13},
+		{"out_transfers", required_argument, &lopt, 14},
+		{"reactor", no_argument, &lopt, 15},
+		{"iso_transfers", required_argument, &lopt, 16},
+		{"iso_packets", required_argument, &lopt, 17},
+		{"transfer_size", required_argument, &lopt, 18},
+		{"udp_batch", required_argument, &lopt, 19},
+		{"inject_policy", required_argument, &lopt, 20},
+		{"fuse_motion", no_argument, &lopt, 21},
+		{"move_step", required_argument, &lopt, 22},
+		{"shm_ring", required_argument, &lopt, 23},
+		{"shm_busy_poll", no_argument, &lopt, 24},
 		{0, 0, 0, 0}
 	};
 	while ((opt = getopt_long(argc, argv, optstring, long_options, &loidx)) != -1) {
@@ -237,6 +274,90 @@ int main(int argc, char **argv)
 		case 11:
 			descriptor_file = optarg;
 			break;
+		case 12:
+			stats_interval = std::stoi(optarg);
+			if (stats_interval < 0) {
+				printf("Invalid stats interval, must be >= 0\n");
+				return 1;
+			}
+			break;
+		case 13:
+			in_transfers = std::stoi(optarg);
+			if (in_transfers < 1 || in_transfers > IN_STREAM_MAX_TRANSFERS) {
+				printf("Invalid in_transfers, must be 1-%d\n", IN_STREAM_MAX_TRANSFERS);
+				return 1;
+			}
+			break;
+		case 14:
+			out_transfers = std::stoi(optarg);
+			if (out_transfers < 1 || out_transfers > OUT_STREAM_MAX_TRANSFERS) {
+				printf("Invalid out_transfers, must be 1-%d\n", OUT_STREAM_MAX_TRANSFERS);
+				return 1;
+			}
+			break;
+		case 15:
+			reactor_enabled = true;
+			break;
+		case 16:
+			iso_transfers = std::stoi(optarg);
+			if (iso_transfers < 1 || iso_transfers > ISO_STREAM_MAX_TRANSFERS) {
+				printf("Invalid iso_transfers, must be 1-%d\n", ISO_STREAM_MAX_TRANSFERS);
+				return 1;
+			}
+			break;
+		case 17:
+			iso_packets = std::stoi(optarg);
+			if (iso_packets < 1 || iso_packets > ISO_STREAM_MAX_PACKETS) {
+				printf("Invalid iso_packets, must be 1-%d\n", ISO_STREAM_MAX_PACKETS);
+				return 1;
+			}
+			break;
+		case 18:
+			if (!parse_transfer_size(optarg)) {
+				printf("Invalid transfer_size, must be SIZE or EP=SIZE with SIZE up to %d\n",
+					MAX_BULK_TRANSFER_SIZE);
+				return 1;
+			}
+			break;
+		case 19:
+			udp_batch = std::stoi(optarg);
+			if (udp_batch < 1 || udp_batch > UDP_BATCH_MAX) {
+				printf("Invalid udp_batch, must be 1-%d\n", UDP_BATCH_MAX);
+				return 1;
+			}
+			break;
+		case 20:
+			if (!strcmp(optarg, "interleave"))
+				ep_queue_policy = EP_QUEUE_INTERLEAVE;
+			else if (!strcmp(optarg, "priority"))
+				ep_queue_policy = EP_QUEUE_PRIORITY;
+			else if (!strcmp(optarg, "drop_oldest_real"))
+				ep_queue_policy = EP_QUEUE_DROP_OLDEST_REAL;
+			else {
+				printf("Invalid inject_policy, must be interleave, priority or drop_oldest_real\n");
+				return 1;
+			}
+			break;
+		case 21:
+			fusion_enabled = true;
+			break;
+		case 22:
+			poll_move_step = std::stoi(optarg);
+			if (poll_move_step < 0 || poll_move_step > 32767) {
+				printf("Invalid move_step, must be 0-32767\n");
+				return 1;
+			}
+			break;
+		case 23:
+			if (optarg[0] != '/' || strchr(optarg + 1, '/')) {
+				printf("Invalid shm_ring, must be a name like /usb-proxy\n");
+				return 1;
+			}
+			shm_ring_name = optarg;
+			break;
+		case 24:
+			shm_busy_poll = true;
+			break;
 
 		default:
 			usage();
@@ -254,21 +375,14 @@ int main(int argc, char **argv)
 			printf("Injection file not specified\n");
 			return 1;
 		}
-		struct stat buffer;
-		if (stat(injection_file.c_str(), &buffer) != 0) {
-			printf("Injection file %s not found\n", injection_file.c_str());
+		if (!injection_load(injection_file, injection_config))
 			return 1;
-		}
+		printf("Parsed injection file: %s\n", injection_file.c_str());
 
-		Json::Reader jsonReader;
-		std::ifstream ifs(injection_file.c_str());
-		if (jsonReader.parse(ifs, injection_config))
-			printf("Parsed injection file: %s\n", injection_file.c_str());
-		else {
-			printf("Error parsing injection file: %s\n", injection_file.c_str());
+		injection_rules = injection_compile(injection_config);
+		if (!injection_rules)
 			return 1;
-		}
-		ifs.close();
+		injection_watch_start();
 	}
 
 	if (customized_config_enabled) {
@@ -316,11 +430,16 @@ int main(int argc, char **argv)
 
 	UdpServer udp_server(12345);
 	udp_server.start();
+	reactor_start();
+	stats_start();
 
 	ep0_loop(fd);
 
+	stats_stop();
+	reactor_stop();
 	udp_server.stop();
 	udp_server.join();
+	injection_watch_stop();
 
 	close(fd);
 
@@ -340,6 +459,8 @@ int main(int argc, char **argv)
 	}
 	delete[] host_device_desc.configs;
 	delete[] device_config_desc;
+	injection_free(injection_rules.load());
+	hid_codecs_cleanup();
 
 	if (context && callback_handle != -1) {
 		libusb_hotplug_deregister_callback(context, callback_handle);